@@ -0,0 +1,59 @@
+#include "acpi.h"
+
+#include "clib.h"
+#include "loader.h"
+
+
+uint32_t acpi_table_length(uint64_t table)
+{
+	uint32_t length;
+
+	memcpy(&length, (const char *)table + 4, sizeof(length));
+	return length;
+}
+
+uint64_t find_acpi_table(
+	const struct efi_system_table *system,
+	const char *signature)
+{
+	struct efi_guid acpi20 = EFI_ACPI_20_TABLE_GUID;
+	struct efi_guid acpi = EFI_ACPI_TABLE_GUID;
+	const char *rsdp;
+	const char *sdt;
+	size_t entry_size = 4;
+	uint64_t sdt_addr = 0;
+	uint32_t length;
+
+	rsdp = (const char *)find_config_table(system, acpi20);
+	if (rsdp == NULL)
+		rsdp = (const char *)find_config_table(system, acpi);
+	if (rsdp == NULL || memcmp(rsdp, "RSD PTR ", 8) != 0)
+		return 0;
+
+	/* The XSDT address is only there since ACPI 2.0. */
+	if (rsdp[15] >= 2) {
+		memcpy(&sdt_addr, &rsdp[24], sizeof(uint64_t));
+		entry_size = 8;
+	}
+	if (sdt_addr == 0) {
+		uint32_t rsdt;
+
+		memcpy(&rsdt, &rsdp[16], sizeof(rsdt));
+		sdt_addr = rsdt;
+		entry_size = 4;
+	}
+	if (sdt_addr == 0)
+		return 0;
+
+	sdt = (const char *)sdt_addr;
+	length = acpi_table_length(sdt_addr);
+	for (uint32_t offset = ACPI_HEADER_SIZE; offset + entry_size <= length;
+			offset += entry_size) {
+		uint64_t table = 0;
+
+		memcpy(&table, &sdt[offset], entry_size);
+		if (table != 0 && memcmp((const char *)table, signature, 4) == 0)
+			return table;
+	}
+	return 0;
+}
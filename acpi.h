@@ -0,0 +1,24 @@
+#ifndef __ACPI_H__
+#define __ACPI_H__
+
+#include <stdint.h>
+
+#include "efi/efi.h"
+
+
+/* ACPI tables aren't necessarily aligned, so all the fields are read with
+ * memcpy at offsets from the ACPI specification. All tables start with the
+ * same 36 byte header, length of the table is at offset 4. */
+static const uint32_t ACPI_HEADER_SIZE = 36;
+
+/* Returns the address of the first ACPI table with the given signature
+ * found through the RSDP the firmware gave us, or zero if there is no such
+ * table. XSDT is used if the firmware has ACPI 2.0, RSDT otherwise. */
+uint64_t find_acpi_table(
+	const struct efi_system_table *system,
+	const char *signature);
+
+/* Length of the table from its header. */
+uint32_t acpi_table_length(uint64_t table);
+
+#endif  // __ACPI_H__
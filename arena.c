@@ -0,0 +1,96 @@
+#include "arena.h"
+
+#include "clib.h"
+#include "log.h"
+
+
+static const uint64_t ARENA_PAGE_SIZE = 4096;
+static const uint64_t ARENA_MIN_PAGES = 16;
+static const size_t ARENA_ALIGN = 16;
+
+void setup_arena(
+	struct arena *arena,
+	struct efi_system_table *system,
+	enum efi_memory_type type)
+{
+	memset(arena, 0, sizeof(*arena));
+	arena->system = system;
+	arena->type = type;
+}
+
+/* Every new chunk is at least twice as large as the previous one, so even
+ * a few hundred thousand modules take only a handful of chunks. */
+static efi_status_t arena_grow(struct arena *arena, size_t size)
+{
+	const size_t header =
+		(sizeof(struct arena_chunk) + ARENA_ALIGN - 1)
+		& ~(ARENA_ALIGN - 1);
+	uint64_t pages = (header + size + ARENA_PAGE_SIZE - 1) / ARENA_PAGE_SIZE;
+	struct arena_chunk *chunk;
+	efi_status_t status;
+	uint64_t addr;
+
+	if (pages < ARENA_MIN_PAGES)
+		pages = ARENA_MIN_PAGES;
+	if (arena->chunk != NULL && pages < 2 * arena->chunk->pages)
+		pages = 2 * arena->chunk->pages;
+
+	status = arena->system->boot->allocate_pages(
+		EFI_ALLOCATE_ANY_PAGES,
+		arena->type,
+		pages,
+		&addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			arena->system,
+			"failed to allocate %llu pages for the loader arena\r\n",
+			(unsigned long long)pages);
+		return status;
+	}
+
+	chunk = (struct arena_chunk *)addr;
+	chunk->next = arena->chunk;
+	chunk->pages = pages;
+	arena->chunk = chunk;
+	arena->pos = (char *)addr + header;
+	arena->end = (char *)addr + pages * ARENA_PAGE_SIZE;
+	return EFI_SUCCESS;
+}
+
+efi_status_t arena_alloc(struct arena *arena, size_t size, void **ptr)
+{
+	size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if ((size_t)(arena->end - arena->pos) < size) {
+		efi_status_t status = arena_grow(arena, size);
+
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	*ptr = arena->pos;
+	arena->pos += size;
+	return EFI_SUCCESS;
+}
+
+efi_status_t arena_release(struct arena *arena)
+{
+	while (arena->chunk != NULL) {
+		struct arena_chunk *chunk = arena->chunk;
+		efi_status_t status;
+
+		arena->chunk = chunk->next;
+		status = arena->system->boot->free_pages(
+			(uint64_t)chunk, chunk->pages);
+		if (status != EFI_SUCCESS) {
+			err(
+				arena->system,
+				"failed to free the loader arena\r\n");
+			return status;
+		}
+	}
+
+	arena->pos = NULL;
+	arena->end = NULL;
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,40 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "efi/efi.h"
+
+
+/* Bump allocator for the loader bookkeeping. Each firmware pool call takes
+ * a lock and walks the firmware free lists, so instead we take memory from
+ * the firmware in a few large page allocations and hand it out by bumping
+ * a pointer. Individual allocations cannot be freed, the whole arena is
+ * released at once. */
+struct arena_chunk {
+	struct arena_chunk *next;
+	uint64_t pages;
+};
+
+struct arena {
+	struct efi_system_table *system;
+	enum efi_memory_type type;
+	struct arena_chunk *chunk;
+	char *pos;
+	char *end;
+};
+
+void setup_arena(
+	struct arena *arena,
+	struct efi_system_table *system,
+	enum efi_memory_type type);
+
+/* Allocate size bytes aligned on 16 bytes. */
+efi_status_t arena_alloc(struct arena *arena, size_t size, void **ptr);
+
+/* Return all the memory of the arena back to the firmware. The arena stays
+ * usable and will allocate new chunks on demand. */
+efi_status_t arena_release(struct arena *arena);
+
+#endif  // __ARENA_H__
@@ -0,0 +1,42 @@
+#ifndef __BUNDLE_H__
+#define __BUNDLE_H__
+
+#include <stdint.h>
+
+/* Bundle is a simple archive that allows to load many modules with a single
+ * file read. The layout of the bundle file is:
+ *
+ *   - bundle_header
+ *   - an array of bundle_entry structures sorted by name
+ *   - string table with the names of entries
+ *   - contents of the entries each starting at a page aligned offset
+ *
+ * Entry names are paths of files as they appear in the config, with '\'
+ * used as a separator and no leading separator. Names are sorted and
+ * compared ignoring case of ASCII letters, like FAT does, so that the
+ * loader could binary search them without any preprocessing.
+ *
+ * All the numbers are stored little-endian. */
+
+#define BUNDLE_MAGIC "EFIBUNDL"
+
+static const uint32_t BUNDLE_VERSION = 1;
+static const uint64_t BUNDLE_ALIGN = 4096;
+
+struct bundle_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entries;
+	uint64_t size;
+	uint64_t strings;
+	uint64_t strings_size;
+};
+
+struct bundle_entry {
+	uint64_t offset;
+	uint64_t size;
+	uint32_t name;
+	uint32_t name_size;
+};
+
+#endif  // __BUNDLE_H__
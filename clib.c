@@ -525,6 +525,31 @@ void *memcpy(void *dst, const void *src, size_t size)
 	return dst;
 }
 
+void *memmove(void *dst, const void *src, size_t size)
+{
+	const char *from = src;
+	char *to = dst;
+
+	if (to <= from)
+		return memcpy(dst, src, size);
+
+	for (size_t i = size; i > 0; --i)
+		to[i - 1] = from[i - 1];
+	return dst;
+}
+
+int memcmp(const void *l, const void *r, size_t size)
+{
+	const unsigned char *lptr = l;
+	const unsigned char *rptr = r;
+
+	for (size_t i = 0; i < size; ++i) {
+		if (lptr[i] != rptr[i])
+			return lptr[i] < rptr[i] ? -1 : 1;
+	}
+	return 0;
+}
+
 int isdigit(int code)
 {
 	return code >= '0' && code <= '9';
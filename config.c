@@ -1,57 +1,742 @@
 #include "loader.h"
 
 #include "clib.h"
+#include "config_bin.h"
 #include "io.h"
 #include "log.h"
 
 
+enum char_class {
+	CC_SPACE = 1,
+	CC_NAME = 2,
+	CC_PATH = 4,
+};
+
+/* The lexer classifies characters with a single table lookup instead of
+ * chains of isalnum/isspace calls. Everything above 0x7f is invalid. */
+#define S CC_SPACE
+#define P CC_PATH
+#define W (CC_NAME | CC_PATH)
+static const uint8_t char_class[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, S, S, 0, 0, S, 0, 0,  /* 0x00 */
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,  /* 0x10 */
+	S, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, W, W, P,  /* 0x20 */
+	W, W, W, W, W, W, W, W, W, W, 0, 0, 0, 0, 0, 0,  /* 0x30 */
+	0, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,  /* 0x40 */
+	W, W, W, W, W, W, W, W, W, W, W, 0, P, 0, 0, W,  /* 0x50 */
+	0, W, W, W, W, W, W, W, W, W, W, W, W, W, W, W,  /* 0x60 */
+	W, W, W, W, W, W, W, W, W, W, W, 0, 0, 0, 0, 0,  /* 0x70 */
+};
+#undef W
+#undef P
+#undef S
+
+static const uintptr_t PAGE_SIZE = 4096;
+
+/* Returns a word with the top bit set in every byte of v that is zero and
+ * all other bits cleared. Unlike the usual haszero trick it's exact, i.e.
+ * doesn't mark bytes above a zero byte. */
+static uint64_t zero_bytes(uint64_t v)
+{
+	const uint64_t low = 0x7f7f7f7f7f7f7f7fULL;
+
+	return ~(((v & low) + low) | v | low);
+}
+
+static uint64_t space_bytes(uint64_t v)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+
+	return zero_bytes(v ^ (ones * ' '))
+		| zero_bytes(v ^ (ones * '\t'))
+		| zero_bytes(v ^ (ones * '\n'))
+		| zero_bytes(v ^ (ones * '\r'));
+}
+
+/* Generated configs are often indented and separated by empty lines, so
+ * whitespaces are skipped 8 bytes at a time. A wide load never crosses a
+ * page boundary, so it cannot fault even when it reads past the end of
+ * the config. Both supported architectures are little-endian, so the
+ * first byte of the config is the lowest byte of the word. */
 static size_t skip_ws(const char *data, size_t i)
 {
-	while (isspace(data[i]))
-		++i;
-	return i;
+	const uint64_t high = 0x8080808080808080ULL;
+
+	while (1) {
+		const uintptr_t offset = (uintptr_t)&data[i] & (PAGE_SIZE - 1);
+		uint64_t spaces;
+		uint64_t word;
+
+		if (offset > PAGE_SIZE - sizeof(word)) {
+			if (!(char_class[(unsigned char)data[i]] & CC_SPACE))
+				return i;
+			++i;
+			continue;
+		}
+
+		__builtin_memcpy(&word, &data[i], sizeof(word));
+		spaces = space_bytes(word);
+		if (spaces != high)
+			return i + __builtin_ctzll(~spaces & high) / 8;
+		i += sizeof(word);
+	}
 }
 
 static size_t skip_name(const char *data, size_t i)
 {
-	while (isalnum(data[i])
-	       || data[i] == '_'
-	       || data[i] == '-'
-	       || data[i] == '.')
+	while (char_class[(unsigned char)data[i]] & CC_NAME)
 		++i;
 	return i;
 }
 
 static size_t skip_path(const char *data, size_t i)
 {
-	while (isalnum(data[i])
-	       || data[i] == '_'
-	       || data[i] == '-'
-	       || data[i] == '.'
-	       || data[i] == '\\'
-	       || data[i] == '/')
+	while (char_class[(unsigned char)data[i]] & CC_PATH)
 		++i;
 	return i;
 }
 
-static efi_status_t add_module(
+/* Report an error at the given offset in the config. Line and column are
+ * only computed when something goes wrong, so they cost nothing on the
+ * normal path. */
+static void config_error(struct loader *loader, size_t pos, const char *msg)
+{
+	unsigned line = 1;
+	unsigned column = 1;
+
+	if (loader->config_probe)
+		return;
+
+	for (size_t i = 0; i < pos; ++i) {
+		if (loader->config_data[i] == '\n') {
+			++line;
+			column = 1;
+		} else {
+			++column;
+		}
+	}
+
+	err(
+		loader->system,
+		"invalid config format at %u:%u: %s\r\n",
+		line,
+		column,
+		msg);
+}
+
+/* FNV-1a, it's simple and good enough for short module names. */
+static uint64_t name_hash(const char *name)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	while (*name) {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static size_t index_size(size_t modules)
+{
+	size_t size = 16;
+
+	while (size < 2 * modules)
+		size *= 2;
+	return size;
+}
+
+/* Insert the module in the open addressing hash index. Module names are
+ * how the kernel finds the modules, so they must be unique, returns false
+ * if there is already a module with the same name. */
+static bool index_module(struct loader *loader, size_t module)
+{
+	const size_t mask = loader->module_index_size - 1;
+	const char *name = loader->module[module].name;
+	size_t slot = name_hash(name) & mask;
+
+	while (loader->module_index[slot] != 0) {
+		const size_t other = loader->module_index[slot] - 1;
+
+		if (strcmp(loader->module[other].name, name) == 0)
+			return false;
+		slot = (slot + 1) & mask;
+	}
+	loader->module_index[slot] = module + 1;
+	return true;
+}
+
+const struct module *find_module(
+	const struct loader *loader,
+	const char *name)
+{
+	const size_t mask = loader->module_index_size - 1;
+	size_t slot;
+
+	if (loader->module_index_size == 0)
+		return NULL;
+
+	slot = name_hash(name) & mask;
+	while (loader->module_index[slot] != 0) {
+		const struct module *module =
+			&loader->module[loader->module_index[slot] - 1];
+
+		if (strcmp(module->name, name) == 0)
+			return module;
+		slot = (slot + 1) & mask;
+	}
+	return NULL;
+}
+
+static bool token_equal(
+	const char *data, size_t begin, size_t end, const char *str)
+{
+	for (size_t i = begin; i < end; ++i, ++str) {
+		if (*str == '\0' || data[i] != *str)
+			return false;
+	}
+	return *str == '\0';
+}
+
+/* Numbers in attributes are either decimal or hexadecimal with 0x prefix,
+ * sizes may have one of K, M, G or T binary suffixes, e.g. 2M or 0x10K. */
+static bool parse_number(
+	const char *data, size_t begin, size_t end, uint64_t *value)
+{
+	uint64_t base = 10;
+	uint64_t shift = 0;
+	uint64_t number = 0;
+
+	if (begin == end)
+		return false;
+
+	switch (data[end - 1]) {
+	case 'K': case 'k':
+		shift = 10;
+		break;
+	case 'M': case 'm':
+		shift = 20;
+		break;
+	case 'G': case 'g':
+		shift = 30;
+		break;
+	case 'T': case 't':
+		shift = 40;
+		break;
+	}
+	if (shift != 0)
+		--end;
+
+	if (end - begin > 2 && data[begin] == '0'
+			&& (data[begin + 1] == 'x' || data[begin + 1] == 'X')) {
+		base = 16;
+		begin += 2;
+	}
+
+	if (begin == end)
+		return false;
+
+	for (size_t i = begin; i < end; ++i) {
+		const char c = data[i];
+		uint64_t digit;
+
+		if (c >= '0' && c <= '9')
+			digit = c - '0';
+		else if (base == 16 && c >= 'a' && c <= 'f')
+			digit = c - 'a' + 10;
+		else if (base == 16 && c >= 'A' && c <= 'F')
+			digit = c - 'A' + 10;
+		else
+			return false;
+
+		if (digit >= base || number > (UINT64_MAX - digit) / base)
+			return false;
+		number = number * base + digit;
+	}
+
+	if (number > (UINT64_MAX >> shift))
+		return false;
+	*value = number << shift;
+	return true;
+}
+
+bool parse_size(const uint16_t *str, uint64_t *size)
+{
+	char data[32];
+	size_t len = 0;
+
+	while (str[len] != 0) {
+		if (len == sizeof(data) || str[len] > 0x7f)
+			return false;
+		data[len] = (char)str[len];
+		++len;
+	}
+	return parse_number(data, 0, len, size);
+}
+
+struct memory_type_name {
+	const char *name;
+	uint32_t type;
+};
+
+static const struct memory_type_name memory_type_names[] = {
+	{ "kernel", LOADER_KERNEL_MEMORY },
+	{ "module", LOADER_MODULE_MEMORY },
+	{ "loader_code", EFI_LOADER_CODE },
+	{ "loader_data", EFI_LOADER_DATA },
+	{ "reserved", EFI_RESERVED_MEMORY_TYPE },
+	{ "acpi_reclaim", EFI_ACPI_RECLAIM_MEMORY },
+	{ "acpi_nvs", EFI_ACPI_MEMORY_NVS },
+};
+
+/* Firmware refuses to allocate conventional and persistent memory as well
+ * as the types between the standard ones and the OEM defined range. */
+static bool valid_memory_type(uint64_t type)
+{
+	return type <= UINT32_MAX
+		&& type != EFI_CONVENTIAL_MEMORY
+		&& type != EFI_PERSISTENT_MEMORY
+		&& (type < EFI_MAX_MEMORY_TYPE || type >= 0x70000000);
+}
+
+/* Memory type is either one of the names above or a number. */
+static bool parse_memory_type(
+	const char *data, size_t begin, size_t end, uint32_t *type)
+{
+	uint64_t value;
+
+	for (size_t i = 0;
+			i < sizeof(memory_type_names) / sizeof(memory_type_names[0]);
+			++i) {
+		if (token_equal(data, begin, end, memory_type_names[i].name)) {
+			*type = memory_type_names[i].type;
+			return true;
+		}
+	}
+
+	if (!parse_number(data, begin, end, &value)
+			|| !valid_memory_type(value))
+		return false;
+
+	*type = (uint32_t)value;
+	return true;
+}
+
+static bool parse_node(
+	const char *data,
+	size_t begin,
+	size_t end,
+	uint32_t *node)
+{
+	uint64_t value;
+
+	if (token_equal(data, begin, end, "local-to-cpu0")) {
+		*node = MODULE_LOCAL_NODE;
+		return true;
+	}
+
+	if (!parse_number(data, begin, end, &value)
+			|| value >= MODULE_LOCAL_NODE)
+		return false;
+
+	*node = (uint32_t)value;
+	return true;
+}
+
+/* Module attributes follow the path and are separated by whitespaces, just
+ * like the module entries themselves. Since the attributes are optional
+ * parse_entries can only tell an attribute from the name of the next entry
+ * by the ':' after it, so it scans the token once and hands it over here
+ * when there is no ':'.
+ *
+ * Besides the "lazy" flag there are key=value attributes that control where
+ * the module is placed in memory:
+ *
+ *   - align=<size> - alignment of the module, must be a power of two;
+ *   - below=<address> - the module must end at or below the address;
+ *   - at=<address> - the module must be loaded at the page aligned address;
+ *   - type=<type> - memory type of the module pages in the memory map;
+ *   - node=<node> - NUMA node to place the module on, either a proximity
+ *     domain number from the ACPI SRAT or "local-to-cpu0" for the node of
+ *     the boot CPU.
+ *
+ * The same attributes apply to the "heap" entry, for which "lazy" means
+ * that the loader leaves the memory as it is for the kernel to zero. */
+static efi_status_t parse_attribute(
+	struct loader *loader,
+	size_t attr_begin,
+	size_t attr_end,
+	size_t *pos,
+	struct module *module)
+{
+	const char *data = loader->config_data;
+	size_t value_begin, value_end;
+	bool valid = false;
+
+	if (data[attr_end] != '=') {
+		if (!token_equal(data, attr_begin, attr_end, "lazy")) {
+			config_error(loader, attr_begin, "unknown module attribute");
+			return EFI_INVALID_PARAMETER;
+		}
+		module->lazy = true;
+		*pos = attr_end;
+		return EFI_SUCCESS;
+	}
+
+	value_begin = attr_end + 1;
+	value_end = skip_name(data, value_begin);
+
+	if (token_equal(data, attr_begin, attr_end, "align")) {
+		valid = parse_number(data, value_begin, value_end, &module->align)
+			&& module->align != 0
+			&& (module->align & (module->align - 1)) == 0;
+	} else if (token_equal(data, attr_begin, attr_end, "below")) {
+		valid = parse_number(data, value_begin, value_end, &module->below)
+			&& module->below != 0;
+	} else if (token_equal(data, attr_begin, attr_end, "at")) {
+		valid = parse_number(data, value_begin, value_end, &module->at)
+			&& module->at % 4096 == 0;
+		module->fixed = true;
+	} else if (token_equal(data, attr_begin, attr_end, "type")) {
+		valid = parse_memory_type(
+			data, value_begin, value_end, &module->type);
+	} else if (token_equal(data, attr_begin, attr_end, "node")) {
+		valid = parse_node(data, value_begin, value_end, &module->node);
+	} else {
+		config_error(loader, attr_begin, "unknown module attribute");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (!valid) {
+		config_error(loader, value_begin, "invalid module attribute value");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	*pos = value_end;
+	return EFI_SUCCESS;
+}
+
+/* Attributes may come in any order, so the checks that involve more than
+ * one of them are done once all the attributes of the entry are parsed. */
+static efi_status_t check_attributes(
+	struct loader *loader,
+	size_t pos,
+	const struct module *module)
+{
+	if (module->fixed && module->align != 0
+			&& module->at % module->align != 0) {
+		config_error(loader, pos, "module address is not aligned");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (module->fixed && module->node != MODULE_ANY_NODE) {
+		config_error(
+			loader,
+			pos,
+			"module with a fixed address can't have a node");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (module->fixed && module->below != 0 && module->at >= module->below) {
+		config_error(loader, pos, "module address is above the limit");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Modules without attributes are placed anywhere in memory the kernel
+ * keeps. */
+static const struct module default_entry = {
+	.type = LOADER_MODULE_MEMORY,
+	.node = MODULE_ANY_NODE,
+};
+
+/* Scan the token at i and the whitespaces after it. A token followed by
+ * ':' is a module name, anything else is an attribute. */
+static size_t next_token(
+	const char *data, size_t i, size_t *begin, size_t *end)
+{
+	*begin = skip_ws(data, i);
+	*end = skip_name(data, *begin);
+	return skip_ws(data, *end);
+}
+
+/* Walk over the entries of the config. When module is NULL the function
+ * only validates the config, counts the modules and the total number of
+ * characters in their paths including terminators. Otherwise it fills in
+ * the modules, widens all the paths one after another into the paths
+ * buffer and terminates the module names in place in the config data.
+ *
+ * Every token is scanned once: the token after a path is either the name
+ * of the next entry or the first attribute. Most entries have no
+ * attributes, so for them the attribute parsing is skipped entirely. */
+static efi_status_t parse_entries(
 	struct loader *loader,
-	const char *name,
-	const uint16_t *path)
-{
-	if (loader->modules == loader->module_capacity) {
-		efi_status_t status = EFI_SUCCESS;
-		size_t new_size = 2 * loader->modules;
-		struct module *new_module = NULL;
-		struct module *old_module = loader->module;
-
-		if (new_size == 0)
-			new_size = 16;
-
-		status = loader->system->boot->allocate_pool(
-			EFI_LOADER_DATA,
-			new_size * sizeof(struct module),
-			(void **)&new_module);
+	struct module *module,
+	uint16_t *paths,
+	size_t *modules,
+	size_t *paths_size)
+{
+	char *data = loader->config_data;
+	size_t token_begin, token_end;
+	size_t total = 0;
+	size_t count = 0;
+	size_t i = next_token(data, 0, &token_begin, &token_end);
+
+	while (data[token_begin] != '\0') {
+		struct module entry = default_entry;
+		size_t name_begin, name_size;
+		size_t path_begin, path_size;
+		size_t attrs_begin;
+
+		/* We expect ':' after name and before the path, and if it's
+		 * not there, then something went wrong, so we can fail here. */
+		if (data[i] != ':') {
+			config_error(loader, i, "missing ':'");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		name_begin = token_begin;
+		name_size = token_end - token_begin;
+
+		i = skip_ws(data, i + 1);
+		path_begin = i;
+		i = skip_path(data, i);
+		path_size = i - path_begin;
+		attrs_begin = i;
+
+		/* skip_* functions do not return errors and it may happen that
+		 * we hit the end of the file prematurely or encountered an
+		 * unsupported character. Check here that the name and path
+		 * arent't actually empty to catch problems of that kind. */
+		if (name_size == 0) {
+			config_error(loader, name_begin, "empty module name");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		if (path_size == 0) {
+			config_error(loader, path_begin, "empty module path");
+			return EFI_INVALID_PARAMETER;
+		}
+
+		i = next_token(data, i, &token_begin, &token_end);
+		if (data[i] != ':' && data[token_begin] != '\0') {
+			efi_status_t status = EFI_SUCCESS;
+
+			do {
+				if (token_begin == token_end) {
+					config_error(loader, i, "missing ':'");
+					return EFI_INVALID_PARAMETER;
+				}
+
+				status = parse_attribute(
+					loader, token_begin, token_end, &i, &entry);
+				if (status != EFI_SUCCESS)
+					return status;
+
+				i = next_token(data, i, &token_begin, &token_end);
+			} while (data[i] != ':' && data[token_begin] != '\0');
+
+			status = check_attributes(loader, attrs_begin, &entry);
+			if (status != EFI_SUCCESS)
+				return status;
+		}
+
+		/* By now we have looked past the name, so it's safe to put
+		 * the terminator right after it, even if it overwrites ':'. */
+		if (module != NULL) {
+			to_u16strncpy(paths, &data[path_begin], path_size);
+			paths[path_size] = '\0';
+			entry.path = paths;
+			paths += path_size + 1;
+
+			data[name_begin + name_size] = '\0';
+			entry.name = &data[name_begin];
+			module[count] = entry;
+		}
+
+		total += path_size + 1;
+		++count;
+	}
+
+	*modules = count;
+	*paths_size = total;
+	return EFI_SUCCESS;
+}
+
+static bool is_binary_config(const struct loader *loader)
+{
+	return loader->config_size >= sizeof(struct config_bin_header)
+		&& memcmp(
+			loader->config_data,
+			CONFIG_BIN_MAGIC,
+			sizeof(CONFIG_BIN_MAGIC)) == 0;
+}
+
+static bool in_region(uint64_t offset, uint64_t size, uint64_t total)
+{
+	return offset <= total && size <= total - offset;
+}
+
+/* A precompiled config doesn't go through the text parser, so its module
+ * records are checked against the same rules here. The flags are read as
+ * bytes, since a bool holding anything but 0 or 1 is undefined. */
+static bool valid_bin_module(const struct module *module)
+{
+	const uint8_t *raw = (const uint8_t *)module;
+	const uint8_t lazy = raw[offsetof(struct module, lazy)];
+	const uint8_t fixed = raw[offsetof(struct module, fixed)];
+
+	if (lazy > 1 || fixed > 1)
+		return false;
+
+	if (!valid_memory_type(module->type))
+		return false;
+
+	if ((module->align & (module->align - 1)) != 0)
+		return false;
+
+	if (!fixed)
+		return true;
+
+	return module->at % 4096 == 0
+		&& (module->align == 0 || module->at % module->align == 0)
+		&& module->node == MODULE_ANY_NODE
+		&& (module->below == 0 || module->at < module->below);
+}
+
+/* Use the precompiled config in place. All we have to do is to check that
+ * the offsets make sense and turn them into pointers, the module list and
+ * the name index are ready to use as they are. */
+static efi_status_t use_binary_config(struct loader *loader)
+{
+	char *data = loader->config_data;
+	const struct config_bin_header *hdr =
+		(const struct config_bin_header *)data;
+	const uint16_t *paths_end;
+	struct module *module;
+	size_t *index;
+
+	if (hdr->version != CONFIG_BIN_VERSION
+		|| hdr->module_size != sizeof(struct module)) {
+		err(
+			loader->system,
+			"Unsupported precompiled config version %u\r\n",
+			(unsigned)hdr->version);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->size > loader->config_size
+		|| hdr->modules > hdr->size / sizeof(struct module)
+		|| hdr->index_size > hdr->size / sizeof(size_t)
+		|| !in_region(
+			hdr->module_offset,
+			hdr->modules * sizeof(struct module),
+			hdr->size)
+		|| !in_region(
+			hdr->index_offset,
+			hdr->index_size * sizeof(size_t),
+			hdr->size)
+		|| !in_region(hdr->paths_offset, hdr->paths_size, hdr->size)
+		|| !in_region(hdr->names_offset, hdr->names_size, hdr->size)) {
+		err(loader->system, "Precompiled config is truncated\r\n");
+		return EFI_LOAD_ERROR;
+	}
+
+	if (hdr->module_offset % 8 != 0
+		|| hdr->index_offset % 8 != 0
+		|| hdr->paths_offset % 8 != 0
+		|| hdr->paths_size < sizeof(uint16_t)
+		|| hdr->names_size == 0
+		|| hdr->index_size == 0
+		|| (hdr->index_size & (hdr->index_size - 1)) != 0
+		|| hdr->kernel >= hdr->modules
+		|| (hdr->bundle != CONFIG_BIN_NO_BUNDLE
+			&& hdr->bundle >= hdr->modules)) {
+		err(loader->system, "Precompiled config is malformed\r\n");
+		return EFI_LOAD_ERROR;
+	}
+
+	paths_end = (const uint16_t *)&data[hdr->paths_offset + hdr->paths_size];
+	if (paths_end[-1] != 0
+		|| data[hdr->names_offset + hdr->names_size - 1] != '\0') {
+		err(loader->system, "Precompiled config is malformed\r\n");
+		return EFI_LOAD_ERROR;
+	}
+
+	index = (size_t *)&data[hdr->index_offset];
+	for (size_t i = 0; i < hdr->index_size; ++i) {
+		if (index[i] > hdr->modules) {
+			err(
+				loader->system,
+				"Precompiled config index is malformed\r\n");
+			return EFI_LOAD_ERROR;
+		}
+	}
+
+	module = (struct module *)&data[hdr->module_offset];
+	for (size_t i = 0; i < hdr->modules; ++i) {
+		const uint64_t path = (uintptr_t)module[i].path;
+		const uint64_t name = (uintptr_t)module[i].name;
+
+		if (path < hdr->paths_offset
+			|| path - hdr->paths_offset >= hdr->paths_size
+			|| (path - hdr->paths_offset) % sizeof(uint16_t) != 0
+			|| name < hdr->names_offset
+			|| name - hdr->names_offset >= hdr->names_size
+			|| !valid_bin_module(&module[i])) {
+			err(
+				loader->system,
+				"Precompiled config module %u is malformed\r\n",
+				(unsigned)i);
+			return EFI_LOAD_ERROR;
+		}
+
+		module[i].path = (const uint16_t *)&data[path];
+		module[i].name = &data[name];
+	}
+
+	if (module[hdr->kernel].lazy) {
+		err(loader->system, "Precompiled config kernel is lazy\r\n");
+		return EFI_LOAD_ERROR;
+	}
+
+	loader->module = module;
+	loader->modules = hdr->modules;
+	loader->module_index = index;
+	loader->module_index_size = hdr->index_size;
+	loader->kernel = hdr->kernel;
+	if (hdr->bundle != CONFIG_BIN_NO_BUNDLE) {
+		loader->has_bundle = true;
+		loader->bundle_module = hdr->bundle;
+	}
+	return EFI_SUCCESS;
+}
+
+static efi_status_t parse_text_config(struct loader *loader)
+{
+	efi_status_t status = EFI_SUCCESS;
+	size_t modules = 0;
+	size_t paths_size = 0;
+	uint16_t *paths = NULL;
+	const struct module *bundle;
+	const struct module *kernel;
+
+	status = parse_entries(loader, NULL, NULL, &modules, &paths_size);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	/* Modules, the name index and all the module paths share a single
+	 * allocation that is sized exactly on the first pass over the config. */
+	if (modules != 0) {
+		const size_t index = index_size(modules);
+
+		status = arena_alloc(
+			&loader->arena,
+			modules * sizeof(struct module)
+				+ index * sizeof(size_t)
+				+ paths_size * sizeof(uint16_t),
+			(void **)&loader->module);
 		if (status != EFI_SUCCESS) {
 			err(
 				loader->system,
@@ -59,32 +744,169 @@ static efi_status_t add_module(
 			return status;
 		}
 
-		memcpy(
-			new_module,
-			old_module,
-			loader->modules * sizeof(struct module));
-		loader->module = new_module;
-		loader->module_capacity = new_size;
-
-		if (old_module != NULL) {
-			status = loader->system->boot->free_pool(
-				(void *)old_module);
-			if (status != EFI_SUCCESS) {
+		loader->module_index = (size_t *)&loader->module[modules];
+		loader->module_index_size = index;
+		memset(loader->module_index, 0, index * sizeof(size_t));
+
+		paths = (uint16_t *)&loader->module_index[index];
+		status = parse_entries(
+			loader, loader->module, paths, &modules, &paths_size);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+	loader->modules = modules;
+
+	for (size_t j = 0; j < loader->modules; ++j) {
+		if (!index_module(loader, j)) {
+			if (!loader->config_probe)
 				err(
 					loader->system,
-					"failed to free buffer for modules\r\n");
-				return status;
-			}
+					"invalid config format: duplicate module %s\r\n",
+					loader->module[j].name);
+			return EFI_INVALID_PARAMETER;
 		}
 	}
 
-	memset(&loader->module[loader->modules], 0, sizeof(struct module));
-	loader->module[loader->modules].name = name;
-	loader->module[loader->modules].path = path;
-	++loader->modules;
+	bundle = find_module(loader, "bundle");
+	if (bundle != NULL) {
+		loader->has_bundle = true;
+		loader->bundle_module = bundle - loader->module;
+	}
+
+	kernel = find_module(loader, "kernel");
+	if (kernel == NULL) {
+		if (!loader->config_probe)
+			err(
+				loader->system,
+				"invalid config format: no kernel module\r\n");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	if (kernel->lazy) {
+		if (!loader->config_probe)
+			err(
+				loader->system,
+				"invalid config format: kernel cannot be lazy\r\n");
+		return EFI_INVALID_PARAMETER;
+	}
+
+	loader->kernel = kernel - loader->module;
+	if (loader->module[loader->kernel].type == LOADER_MODULE_MEMORY)
+		loader->module[loader->kernel].type = LOADER_KERNEL_MEMORY;
 	return EFI_SUCCESS;
 }
 
+efi_status_t parse_config(struct loader *loader)
+{
+	/* The config from the load options is parsed when it's loaded. */
+	if (loader->module != NULL)
+		return EFI_SUCCESS;
+
+	if (is_binary_config(loader))
+		return use_binary_config(loader);
+
+	return parse_text_config(loader);
+}
+
+static bool is_efi_image_path(const uint16_t *data, size_t begin, size_t end)
+{
+	static const char ext[] = ".efi";
+	const size_t ext_size = sizeof(ext) - 1;
+
+	if (end - begin < ext_size)
+		return false;
+
+	for (size_t i = 0; i < ext_size; ++i) {
+		uint16_t c = data[end - ext_size + i];
+
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+		if (c != ext[i])
+			return false;
+	}
+	return true;
+}
+
+/* Boot entries can carry the config in the load options of the loader as
+ * a UCS-2 string. The UEFI shell passes the whole command line as the load
+ * options, so if the first word is the loader image path we skip it.
+ *
+ * The load options belong to the firmware, so they are narrowed to ASCII
+ * into the arena. Options like "root=/dev/sda1" are meant for something
+ * else, so the options are only used if they parse as a config with a
+ * kernel, otherwise the function returns false and the config comes from
+ * the file. The parsed modules are kept, so parse_config has nothing left
+ * to do. */
+static bool config_from_load_options(struct loader *loader)
+{
+	const uint16_t *options = loader->image->load_options;
+	const size_t size = loader->image->load_options_size / sizeof(*options);
+	size_t begin = 0;
+	size_t word = 0;
+	size_t end = 0;
+	efi_status_t status;
+	char *data = NULL;
+
+	if (options == NULL || size == 0)
+		return false;
+
+	while (end < size && options[end] != 0)
+		++end;
+
+	for (size_t i = 0; i < end; ++i) {
+		if (options[i] > 0x7f)
+			return false;
+	}
+
+	while (begin < end && isspace(options[begin]))
+		++begin;
+
+	word = begin;
+	while (word < end && !isspace(options[word]))
+		++word;
+
+	if (is_efi_image_path(options, begin, word))
+		begin = word;
+
+	while (begin < end && isspace(options[begin]))
+		++begin;
+
+	if (begin == end)
+		return false;
+
+	status = arena_alloc(&loader->arena, end - begin + 1, (void **)&data);
+	if (status != EFI_SUCCESS)
+		return false;
+
+	for (size_t i = begin; i < end; ++i)
+		data[i - begin] = (char)options[i];
+	data[end - begin] = '\0';
+
+	/* The options are parsed and checked as a whole, the same way as the
+	 * config file, so that options that pass the check can't fail the
+	 * boot in parse_config later. */
+	loader->config_data = data;
+	loader->config_size = end - begin;
+	loader->config_probe = true;
+	status = parse_text_config(loader);
+	loader->config_probe = false;
+
+	if (status != EFI_SUCCESS) {
+		info(
+			loader->system,
+			"Load options are not a valid config, reading the file\r\n");
+		loader->config_data = NULL;
+		loader->config_size = 0;
+		loader->module = NULL;
+		loader->modules = 0;
+		loader->module_index = NULL;
+		loader->module_index_size = 0;
+		loader->has_bundle = false;
+		return false;
+	}
+	return true;
+}
+
 efi_status_t load_config(
 	struct loader *loader,
 	const uint16_t *config_path)
@@ -94,12 +916,16 @@ efi_status_t load_config(
 	struct efi_file_info file_info;
 	efi_uint_t size;
 
-	status = loader->rootdir->open(
-		loader->rootdir,
-		&loader->config,
-		(uint16_t *)config_path,
-		EFI_FILE_MODE_READ,
-		EFI_FILE_READ_ONLY);
+	/* The config embedded in the loader image is already in memory. */
+	if (loader->config_data != NULL)
+		return EFI_SUCCESS;
+
+	if (config_from_load_options(loader)) {
+		info(loader->system, "Using the config from load options\r\n");
+		return EFI_SUCCESS;
+	}
+
+	status = open_file(loader, config_path, &loader->config);
 	if (status != EFI_SUCCESS) {
 		err(
 			loader->system,
@@ -124,8 +950,8 @@ efi_status_t load_config(
 		return status;
 	}
 
-	status = loader->system->boot->allocate_pool(
-		EFI_LOADER_DATA,
+	status = arena_alloc(
+		&loader->arena,
 		file_info.file_size + 1,
 		(void **)&loader->config_data);
 	if (status != EFI_SUCCESS) {
@@ -138,6 +964,7 @@ efi_status_t load_config(
 	}
 
 	memset((void *)loader->config_data, 0, file_info.file_size + 1);
+	loader->config_size = file_info.file_size;
 
 	return efi_read_fixed(
 		loader->system,
@@ -146,107 +973,3 @@ efi_status_t load_config(
 		/* size */file_info.file_size,
 		(void *)loader->config_data);
 }
-
-efi_status_t parse_config(struct loader *loader)
-{
-	size_t i = 0;
-
-	while (1) {
-		efi_status_t status = EFI_SUCCESS;
-		uint16_t *path = NULL;
-		char *name = NULL;
-		size_t name_begin, name_size;
-		size_t path_begin, path_size;
-
-		i = skip_ws(loader->config_data, i);
-		if (loader->config_data[i] == '\0')
-			break;
-
-		name_begin = i;
-		i = skip_name(loader->config_data, i);
-		name_size = i - name_begin;
-		i = skip_ws(loader->config_data, i);
-
-		/* We expect ':' after name and before the path, and if it's
-		 * not there, then something went wrong, so we can fail here. */
-		if (loader->config_data[i] != ':') {
-			err(
-				loader->system,
-				"incorrect config format: missing ':'\r\n");
-			return EFI_INVALID_PARAMETER;
-		}
-
-		i = skip_ws(loader->config_data, i + 1);
-		path_begin = i;
-		i = skip_path(loader->config_data, i);
-		path_size = i - path_begin;
-
-		/* skip_* functions do not return errors and it may happen that
-		 * we hit the end of the file prematurely or encountered an
-		 * unsupported character. Check here that the name and path
-		 * arent't actually empty to catch problems of that kind. */
-		if (name_size == 0) {
-			err(
-				loader->system,
-				"invalid config format: empty module name\r\n");
-			return EFI_INVALID_PARAMETER;
-		}
-
-		if (path_size == 0) {
-			err(
-				loader->system,
-				"invalid config format: empty module path\r\n");
-			return EFI_INVALID_PARAMETER;
-		}
-
-		status = loader->system->boot->allocate_pool(
-			EFI_LOADER_DATA,
-			name_size + 1,
-			(void **)&name);
-		if (status != EFI_SUCCESS) {
-			err(
-				loader->system,
-				"failed to allocate buffer for module name\r\n");
-			return status;
-		}
-		strncpy(name, &loader->config_data[name_begin], name_size);
-		name[name_size] = '\0';
-
-		status = loader->system->boot->allocate_pool(
-			EFI_LOADER_DATA,
-			2 * (path_size + 1),
-			(void **)&path);
-		if (status != EFI_SUCCESS) {
-			err(
-				loader->system,
-				"failed to allocate buffer for module path\r\n");
-			return status;
-		}
-		to_u16strncpy(
-			path, &loader->config_data[path_begin], path_size);
-		path[path_size] = '\0';
-
-		status = add_module(loader, name, path);
-		if (status != EFI_SUCCESS) {
-			err(
-				loader->system,
-				"failed to add module %s\r\n",
-				name);
-			return status;
-		}
-	}
-
-	for (size_t j = 0; j < loader->modules; ++j) {
-		if (strcmp(loader->module[j].name, "kernel") != 0)
-			continue;
-
-		loader->kernel = j;
-		return EFI_SUCCESS;
-	}
-
-	/* If we got here, it means that we couldn't find the kernel module. */
-	err(
-		loader->system,
-		"invalid config format: no kernel module\r\n");
-	return EFI_INVALID_PARAMETER;
-}
@@ -0,0 +1,47 @@
+#ifndef __CONFIG_BIN_H__
+#define __CONFIG_BIN_H__
+
+#include <stdint.h>
+
+/* Precompiled config (see tools/mkconfig.c). It's the result of parsing a
+ * text config laid out so that the loader can use it in place:
+ *
+ *   - config_bin_header
+ *   - an array of struct module (see loader.h)
+ *   - the hash index of module names, as built by parse_config
+ *   - UCS-2 paths of the modules
+ *   - names of the modules
+ *
+ * Pointers in the module entries are stored as offsets from the beginning
+ * of the file, the loader turns them into pointers in place. All regions
+ * start at 8 byte aligned offsets and the paths and names regions end with
+ * a terminator, so any offset inside of them refers to a terminated string.
+ *
+ * The magic starts with a byte that isn't allowed in the text config, so
+ * the two cannot be confused. */
+
+#define CONFIG_BIN_MAGIC "\177CFGBIN"
+
+static const uint32_t CONFIG_BIN_VERSION = 3;
+
+struct config_bin_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t module_size;
+	uint64_t size;
+	uint64_t modules;
+	uint64_t kernel;
+	uint64_t bundle;
+	uint64_t module_offset;
+	uint64_t index_offset;
+	uint64_t index_size;
+	uint64_t paths_offset;
+	uint64_t paths_size;
+	uint64_t names_offset;
+	uint64_t names_size;
+};
+
+// Value of the bundle field when there is no bundle in the config
+static const uint64_t CONFIG_BIN_NO_BUNDLE = UINT64_MAX;
+
+#endif  // __CONFIG_BIN_H__
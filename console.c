@@ -0,0 +1,381 @@
+#include "console.h"
+
+#include "clib.h"
+
+
+/* Glyphs are 5x7 pixels, each row is a byte with the leftmost pixel in
+ * bit 4. A cell has one column of spacing on the right and a row of
+ * spacing above and below the glyph, and the whole cell is scaled up on
+ * large screens. */
+static const uint32_t GLYPH_WIDTH = 5;
+static const uint32_t GLYPH_HEIGHT = 7;
+static const uint32_t CELL_WIDTH = 6;
+static const uint32_t CELL_HEIGHT = 9;
+static const uint32_t MIN_COLUMNS = 80;
+static const uint32_t MIN_ROWS = 25;
+static const uint64_t CONSOLE_PAGE_SIZE = 4096;
+
+static const struct efi_graphics_output_blt_pixel FOREGROUND = {
+	0xaa, 0xaa, 0xaa, 0 };
+static const struct efi_graphics_output_blt_pixel BACKGROUND = {
+	0, 0, 0, 0 };
+
+/* Printable ASCII characters starting from space. */
+static const uint8_t font[][7] = {
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 },	/* space */
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x00, 0x04 },	/* ! */
+	{ 0x0a, 0x0a, 0x0a, 0x00, 0x00, 0x00, 0x00 },	/* " */
+	{ 0x0a, 0x0a, 0x1f, 0x0a, 0x1f, 0x0a, 0x0a },	/* # */
+	{ 0x04, 0x0f, 0x14, 0x0e, 0x05, 0x1e, 0x04 },	/* $ */
+	{ 0x18, 0x19, 0x02, 0x04, 0x08, 0x13, 0x03 },	/* % */
+	{ 0x0c, 0x12, 0x14, 0x08, 0x15, 0x12, 0x0d },	/* & */
+	{ 0x04, 0x04, 0x08, 0x00, 0x00, 0x00, 0x00 },	/* ' */
+	{ 0x02, 0x04, 0x08, 0x08, 0x08, 0x04, 0x02 },	/* ( */
+	{ 0x08, 0x04, 0x02, 0x02, 0x02, 0x04, 0x08 },	/* ) */
+	{ 0x00, 0x04, 0x15, 0x0e, 0x15, 0x04, 0x00 },	/* * */
+	{ 0x00, 0x04, 0x04, 0x1f, 0x04, 0x04, 0x00 },	/* + */
+	{ 0x00, 0x00, 0x00, 0x00, 0x0c, 0x04, 0x08 },	/* , */
+	{ 0x00, 0x00, 0x00, 0x1f, 0x00, 0x00, 0x00 },	/* - */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x0c, 0x0c },	/* . */
+	{ 0x00, 0x01, 0x02, 0x04, 0x08, 0x10, 0x00 },	/* / */
+	{ 0x0e, 0x11, 0x13, 0x15, 0x19, 0x11, 0x0e },	/* 0 */
+	{ 0x04, 0x0c, 0x04, 0x04, 0x04, 0x04, 0x0e },	/* 1 */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x08, 0x1f },	/* 2 */
+	{ 0x1f, 0x02, 0x04, 0x02, 0x01, 0x11, 0x0e },	/* 3 */
+	{ 0x02, 0x06, 0x0a, 0x12, 0x1f, 0x02, 0x02 },	/* 4 */
+	{ 0x1f, 0x10, 0x1e, 0x01, 0x01, 0x11, 0x0e },	/* 5 */
+	{ 0x06, 0x08, 0x10, 0x1e, 0x11, 0x11, 0x0e },	/* 6 */
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x08, 0x08 },	/* 7 */
+	{ 0x0e, 0x11, 0x11, 0x0e, 0x11, 0x11, 0x0e },	/* 8 */
+	{ 0x0e, 0x11, 0x11, 0x0f, 0x01, 0x02, 0x0c },	/* 9 */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x0c, 0x00 },	/* : */
+	{ 0x00, 0x0c, 0x0c, 0x00, 0x0c, 0x04, 0x08 },	/* ; */
+	{ 0x02, 0x04, 0x08, 0x10, 0x08, 0x04, 0x02 },	/* < */
+	{ 0x00, 0x00, 0x1f, 0x00, 0x1f, 0x00, 0x00 },	/* = */
+	{ 0x08, 0x04, 0x02, 0x01, 0x02, 0x04, 0x08 },	/* > */
+	{ 0x0e, 0x11, 0x01, 0x02, 0x04, 0x00, 0x04 },	/* ? */
+	{ 0x0e, 0x11, 0x01, 0x0d, 0x15, 0x15, 0x0e },	/* @ */
+	{ 0x0e, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },	/* A */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x11, 0x11, 0x1e },	/* B */
+	{ 0x0e, 0x11, 0x10, 0x10, 0x10, 0x11, 0x0e },	/* C */
+	{ 0x1c, 0x12, 0x11, 0x11, 0x11, 0x12, 0x1c },	/* D */
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x1f },	/* E */
+	{ 0x1f, 0x10, 0x10, 0x1e, 0x10, 0x10, 0x10 },	/* F */
+	{ 0x0e, 0x11, 0x10, 0x17, 0x11, 0x11, 0x0f },	/* G */
+	{ 0x11, 0x11, 0x11, 0x1f, 0x11, 0x11, 0x11 },	/* H */
+	{ 0x0e, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e },	/* I */
+	{ 0x07, 0x02, 0x02, 0x02, 0x02, 0x12, 0x0c },	/* J */
+	{ 0x11, 0x12, 0x14, 0x18, 0x14, 0x12, 0x11 },	/* K */
+	{ 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x1f },	/* L */
+	{ 0x11, 0x1b, 0x15, 0x15, 0x11, 0x11, 0x11 },	/* M */
+	{ 0x11, 0x11, 0x19, 0x15, 0x13, 0x11, 0x11 },	/* N */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },	/* O */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x10, 0x10, 0x10 },	/* P */
+	{ 0x0e, 0x11, 0x11, 0x11, 0x15, 0x12, 0x0d },	/* Q */
+	{ 0x1e, 0x11, 0x11, 0x1e, 0x14, 0x12, 0x11 },	/* R */
+	{ 0x0f, 0x10, 0x10, 0x0e, 0x01, 0x01, 0x1e },	/* S */
+	{ 0x1f, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },	/* T */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x0e },	/* U */
+	{ 0x11, 0x11, 0x11, 0x11, 0x11, 0x0a, 0x04 },	/* V */
+	{ 0x11, 0x11, 0x11, 0x15, 0x15, 0x15, 0x0a },	/* W */
+	{ 0x11, 0x11, 0x0a, 0x04, 0x0a, 0x11, 0x11 },	/* X */
+	{ 0x11, 0x11, 0x11, 0x0a, 0x04, 0x04, 0x04 },	/* Y */
+	{ 0x1f, 0x01, 0x02, 0x04, 0x08, 0x10, 0x1f },	/* Z */
+	{ 0x0e, 0x08, 0x08, 0x08, 0x08, 0x08, 0x0e },	/* [ */
+	{ 0x00, 0x10, 0x08, 0x04, 0x02, 0x01, 0x00 },	/* \ */
+	{ 0x0e, 0x02, 0x02, 0x02, 0x02, 0x02, 0x0e },	/* ] */
+	{ 0x04, 0x0a, 0x11, 0x00, 0x00, 0x00, 0x00 },	/* ^ */
+	{ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x1f },	/* _ */
+	{ 0x08, 0x04, 0x02, 0x00, 0x00, 0x00, 0x00 },	/* ` */
+	{ 0x00, 0x00, 0x0e, 0x01, 0x0f, 0x11, 0x0f },	/* a */
+	{ 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x1e },	/* b */
+	{ 0x00, 0x00, 0x0e, 0x10, 0x10, 0x11, 0x0e },	/* c */
+	{ 0x01, 0x01, 0x0d, 0x13, 0x11, 0x11, 0x0f },	/* d */
+	{ 0x00, 0x00, 0x0e, 0x11, 0x1f, 0x10, 0x0e },	/* e */
+	{ 0x06, 0x09, 0x08, 0x1c, 0x08, 0x08, 0x08 },	/* f */
+	{ 0x00, 0x0f, 0x11, 0x11, 0x0f, 0x01, 0x0e },	/* g */
+	{ 0x10, 0x10, 0x16, 0x19, 0x11, 0x11, 0x11 },	/* h */
+	{ 0x04, 0x00, 0x0c, 0x04, 0x04, 0x04, 0x0e },	/* i */
+	{ 0x02, 0x00, 0x06, 0x02, 0x02, 0x12, 0x0c },	/* j */
+	{ 0x10, 0x10, 0x12, 0x14, 0x18, 0x14, 0x12 },	/* k */
+	{ 0x0c, 0x04, 0x04, 0x04, 0x04, 0x04, 0x0e },	/* l */
+	{ 0x00, 0x00, 0x1a, 0x15, 0x15, 0x11, 0x11 },	/* m */
+	{ 0x00, 0x00, 0x16, 0x19, 0x11, 0x11, 0x11 },	/* n */
+	{ 0x00, 0x00, 0x0e, 0x11, 0x11, 0x11, 0x0e },	/* o */
+	{ 0x00, 0x00, 0x1e, 0x11, 0x1e, 0x10, 0x10 },	/* p */
+	{ 0x00, 0x00, 0x0d, 0x13, 0x0f, 0x01, 0x01 },	/* q */
+	{ 0x00, 0x00, 0x16, 0x19, 0x10, 0x10, 0x10 },	/* r */
+	{ 0x00, 0x00, 0x0e, 0x10, 0x0e, 0x01, 0x1e },	/* s */
+	{ 0x08, 0x08, 0x1c, 0x08, 0x08, 0x09, 0x06 },	/* t */
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x13, 0x0d },	/* u */
+	{ 0x00, 0x00, 0x11, 0x11, 0x11, 0x0a, 0x04 },	/* v */
+	{ 0x00, 0x00, 0x11, 0x11, 0x15, 0x15, 0x0a },	/* w */
+	{ 0x00, 0x00, 0x11, 0x0a, 0x04, 0x0a, 0x11 },	/* x */
+	{ 0x00, 0x00, 0x11, 0x11, 0x0f, 0x01, 0x0e },	/* y */
+	{ 0x00, 0x00, 0x1f, 0x02, 0x04, 0x08, 0x1f },	/* z */
+	{ 0x02, 0x04, 0x04, 0x08, 0x04, 0x04, 0x02 },	/* { */
+	{ 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04 },	/* | */
+	{ 0x08, 0x04, 0x04, 0x02, 0x04, 0x04, 0x08 },	/* } */
+	{ 0x00, 0x00, 0x08, 0x15, 0x02, 0x00, 0x00 },	/* ~ */
+};
+
+static void mark_dirty(
+	struct console *console,
+	uint32_t left,
+	uint32_t top,
+	uint32_t right,
+	uint32_t bottom)
+{
+	if (console->left >= console->right) {
+		console->left = left;
+		console->top = top;
+		console->right = right;
+		console->bottom = bottom;
+		return;
+	}
+
+	if (left < console->left)
+		console->left = left;
+	if (top < console->top)
+		console->top = top;
+	if (right > console->right)
+		console->right = right;
+	if (bottom > console->bottom)
+		console->bottom = bottom;
+}
+
+static efi_status_t flush(struct console *console)
+{
+	efi_status_t status;
+
+	if (console->left >= console->right)
+		return EFI_SUCCESS;
+
+	status = console->gop->blt(
+		console->gop,
+		console->buffer,
+		EFI_BLT_BUFFER_TO_VIDEO,
+		console->left,
+		console->top,
+		console->left,
+		console->top,
+		console->right - console->left,
+		console->bottom - console->top,
+		console->width * sizeof(*console->buffer));
+	console->left = console->right = 0;
+	return status;
+}
+
+static void draw_glyph(struct console *console, uint16_t c)
+{
+	const uint32_t scale = console->scale;
+	const uint32_t left = console->column * CELL_WIDTH * scale;
+	const uint32_t top = console->row * CELL_HEIGHT * scale;
+	const uint8_t *glyph = font[(c < ' ' || c > '~' ? '?' : c) - ' '];
+
+	for (uint32_t y = 0; y < CELL_HEIGHT * scale; ++y) {
+		const uint64_t offset =
+			(uint64_t)(top + y) * console->width + left;
+		struct efi_graphics_output_blt_pixel *line =
+			&console->buffer[offset];
+		const uint32_t row = y / scale;
+		const uint8_t bits = row >= 1 && row <= GLYPH_HEIGHT
+			? glyph[row - 1]
+			: 0;
+
+		for (uint32_t x = 0; x < CELL_WIDTH * scale; ++x) {
+			const uint32_t column = x / scale;
+
+			line[x] = column < GLYPH_WIDTH
+					&& (bits & (0x10 >> column))
+				? FOREGROUND
+				: BACKGROUND;
+		}
+	}
+
+	mark_dirty(
+		console,
+		left,
+		top,
+		left + CELL_WIDTH * scale,
+		top + CELL_HEIGHT * scale);
+}
+
+/* Move the text up by half of the screen, so that the next rows/2 lines
+ * don't need the whole screen to be copied again. */
+static void scroll(struct console *console)
+{
+	const uint32_t lines = console->rows > 1 ? console->rows / 2 : 1;
+	const uint64_t row_pixels =
+		(uint64_t)CELL_HEIGHT * console->scale * console->width;
+	const uint64_t shift = lines * row_pixels;
+	const uint64_t total = console->rows * row_pixels;
+
+	memmove(
+		console->buffer,
+		&console->buffer[shift],
+		(total - shift) * sizeof(*console->buffer));
+	memset(
+		&console->buffer[total - shift],
+		0,
+		shift * sizeof(*console->buffer));
+
+	console->row -= lines;
+	mark_dirty(
+		console,
+		0,
+		0,
+		console->width,
+		console->rows * CELL_HEIGHT * console->scale);
+}
+
+static void new_line(struct console *console)
+{
+	if (++console->row == console->rows)
+		scroll(console);
+}
+
+static efi_status_t output_string(
+	struct efi_simple_text_output_protocol *out,
+	uint16_t *str)
+{
+	struct console *console = (struct console *)out;
+
+	for (; *str != 0; ++str) {
+		switch (*str) {
+		case '\r':
+			console->column = 0;
+			break;
+		case '\n':
+			new_line(console);
+			break;
+		default:
+			if (console->column == console->columns) {
+				console->column = 0;
+				new_line(console);
+			}
+			draw_glyph(console, *str);
+			++console->column;
+			break;
+		}
+	}
+	return flush(console);
+}
+
+static efi_status_t clear_screen(struct efi_simple_text_output_protocol *out)
+{
+	struct console *console = (struct console *)out;
+
+	memset(
+		console->buffer,
+		0,
+		(uint64_t)console->width * console->height
+			* sizeof(*console->buffer));
+	console->column = 0;
+	console->row = 0;
+	mark_dirty(console, 0, 0, console->width, console->height);
+	return flush(console);
+}
+
+static struct efi_graphics_output_protocol *find_gop(
+	struct efi_system_table *system)
+{
+	struct efi_guid guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+	struct efi_graphics_output_protocol *gop;
+
+	if (system->boot->locate_protocol(&guid, NULL, (void **)&gop)
+			!= EFI_SUCCESS)
+		return NULL;
+	if (gop->mode == NULL || gop->mode->info == NULL)
+		return NULL;
+	return gop;
+}
+
+efi_status_t setup_console(
+	struct console *console,
+	struct efi_system_table *system)
+{
+	struct efi_graphics_output_protocol *gop = find_gop(system);
+	uint32_t width_scale, height_scale;
+	efi_status_t status;
+	uint64_t pages;
+	uint64_t addr;
+
+	memset(console, 0, sizeof(*console));
+	if (gop == NULL)
+		return EFI_UNSUPPORTED;
+
+	console->gop = gop;
+	console->width = gop->mode->info->horizontal_resolution;
+	console->height = gop->mode->info->vertical_resolution;
+
+	/* Scale the font up as long as at least 80x25 characters fit. */
+	width_scale = console->width / (CELL_WIDTH * MIN_COLUMNS);
+	height_scale = console->height / (CELL_HEIGHT * MIN_ROWS);
+	console->scale = width_scale < height_scale
+		? width_scale
+		: height_scale;
+	if (console->scale == 0)
+		console->scale = 1;
+
+	console->columns = console->width / (CELL_WIDTH * console->scale);
+	console->rows = console->height / (CELL_HEIGHT * console->scale);
+	if (console->columns == 0 || console->rows == 0)
+		return EFI_UNSUPPORTED;
+
+	pages = ((uint64_t)console->width * console->height
+			* sizeof(*console->buffer)
+		+ CONSOLE_PAGE_SIZE - 1) / CONSOLE_PAGE_SIZE;
+	status = system->boot->allocate_pages(
+		EFI_ALLOCATE_ANY_PAGES, EFI_LOADER_DATA, pages, &addr);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	console->buffer = (struct efi_graphics_output_blt_pixel *)addr;
+	console->out.output_string = output_string;
+	console->out.clear_screen = clear_screen;
+	return clear_screen(&console->out);
+}
+
+bool find_framebuffer(
+	struct efi_system_table *system,
+	struct manifest_framebuffer *framebuffer)
+{
+	struct efi_graphics_output_protocol *gop = find_gop(system);
+	const struct efi_graphics_output_mode_information *info;
+
+	if (gop == NULL || gop->mode->frame_buffer_base == 0)
+		return false;
+
+	info = gop->mode->info;
+	memset(framebuffer, 0, sizeof(*framebuffer));
+	framebuffer->base = gop->mode->frame_buffer_base;
+	framebuffer->size = gop->mode->frame_buffer_size;
+	framebuffer->width = info->horizontal_resolution;
+	framebuffer->height = info->vertical_resolution;
+	framebuffer->stride = info->pixels_per_scan_line;
+
+	switch (info->pixel_format) {
+	case EFI_PIXEL_RED_GREEN_BLUE_RESERVED_8BIT_PER_COLOR:
+		framebuffer->red_mask = 0x000000ff;
+		framebuffer->green_mask = 0x0000ff00;
+		framebuffer->blue_mask = 0x00ff0000;
+		framebuffer->reserved_mask = 0xff000000;
+		return true;
+	case EFI_PIXEL_BLUE_GREEN_RED_RESERVED_8BIT_PER_COLOR:
+		framebuffer->red_mask = 0x00ff0000;
+		framebuffer->green_mask = 0x0000ff00;
+		framebuffer->blue_mask = 0x000000ff;
+		framebuffer->reserved_mask = 0xff000000;
+		return true;
+	case EFI_PIXEL_BIT_MASK:
+		framebuffer->red_mask = info->pixel_information.red_mask;
+		framebuffer->green_mask = info->pixel_information.green_mask;
+		framebuffer->blue_mask = info->pixel_information.blue_mask;
+		framebuffer->reserved_mask =
+			info->pixel_information.reserved_mask;
+		return true;
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef __CONSOLE_H__
+#define __CONSOLE_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "efi/efi.h"
+#include "manifest.h"
+
+
+/* Text console drawn with a built-in bitmap font on top of the graphics
+ * output protocol. Firmware text consoles on real hardware are often very
+ * slow, some of them redraw the whole screen for every line they scroll.
+ * Here the text is drawn into a back buffer in memory and only the
+ * changed part of it is copied to the screen with one Blt per string.
+ * Scrolling moves the back buffer by half of the screen at once, so full
+ * screen copies are rare.
+ *
+ * The console implements output_string of the simple text output
+ * protocol, so it can replace the firmware console for logging (see
+ * set_log_output). */
+struct console {
+	struct efi_simple_text_output_protocol out;
+	struct efi_graphics_output_protocol *gop;
+	struct efi_graphics_output_blt_pixel *buffer;
+	uint32_t width;
+	uint32_t height;
+	uint32_t scale;
+	uint32_t columns;
+	uint32_t rows;
+	uint32_t column;
+	uint32_t row;
+
+	/* Dirty rectangle in pixels, empty if left >= right. */
+	uint32_t left;
+	uint32_t top;
+	uint32_t right;
+	uint32_t bottom;
+};
+
+/* Set up the console for the current graphics mode and clear the screen.
+ * Fails if the firmware doesn't have the graphics output protocol. */
+efi_status_t setup_console(
+	struct console *console,
+	struct efi_system_table *system);
+
+/* Describe the linear framebuffer of the current graphics mode for the
+ * kernel. Returns false if there is no graphics output or the mode has no
+ * linear framebuffer. */
+bool find_framebuffer(
+	struct efi_system_table *system,
+	struct manifest_framebuffer *framebuffer);
+
+#endif  // __CONSOLE_H__
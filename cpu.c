@@ -0,0 +1,342 @@
+#include "clib.h"
+#include "loader.h"
+#include "log.h"
+
+
+static const uint64_t CPU_PAGE_SIZE = 4096;
+static const uint64_t CPU_STACK_SIZE = 16384;
+static const uint64_t HEARTBEAT_US = 100;
+
+#ifdef __x86_64__
+
+static void cpu_relax(void)
+{
+	__asm__ volatile ("pause" ::: "memory");
+}
+
+#elif defined(__aarch64__)
+
+static void cpu_relax(void)
+{
+	__asm__ volatile ("yield" ::: "memory");
+}
+
+#endif
+
+/* This is where the application processors spend the time between the
+ * loader and the kernel. The loader image is reclaimable memory for the
+ * kernel, so the code is copied next to the mailboxes into the kernel
+ * memory (see start_cpus) and has to be position independent. It gets the
+ * mailbox in the first argument register and the stack already set up,
+ * spins on the mailbox entry incrementing the heartbeat and then calls
+ * entry(argument) using the kernel calling convention. The heartbeat is at
+ * offset 32 of struct manifest_mailbox. */
+extern const char park_stub[];
+extern const char park_stub_end[];
+
+#ifdef __x86_64__
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	"park_stub:\n"
+	"1:\n\t"
+	"movq (%rdi), %rax\n\t"
+	"testq %rax, %rax\n\t"
+	"jnz 2f\n\t"
+	"incq 32(%rdi)\n\t"
+	"pause\n\t"
+	"jmp 1b\n"
+	"2:\n\t"
+	"movq 8(%rdi), %rdi\n\t"
+	"callq *%rax\n"
+	"3:\n\t"
+	"pause\n\t"
+	"jmp 3b\n"
+	"park_stub_end:\n");
+
+static void sync_code(uint64_t begin, uint64_t end)
+{
+	(void)begin;
+	(void)end;
+}
+
+#elif defined(__aarch64__)
+
+__asm__ (
+	".text\n"
+	".p2align 4\n"
+	"park_stub:\n"
+	"1:\n\t"
+	"ldar x1, [x0]\n\t"
+	"cbnz x1, 2f\n\t"
+	"ldr x2, [x0, #32]\n\t"
+	"add x2, x2, #1\n\t"
+	"str x2, [x0, #32]\n\t"
+	"yield\n\t"
+	"b 1b\n"
+	"2:\n\t"
+	"ldr x0, [x0, #8]\n\t"
+	"blr x1\n"
+	"3:\n\t"
+	"yield\n\t"
+	"b 3b\n"
+	"park_stub_end:\n");
+
+/* The copied code has to reach the point of unification before any CPU
+ * fetches it. */
+static void sync_code(uint64_t begin, uint64_t end)
+{
+	uint64_t ctr, dline, iline;
+
+	__asm__ volatile ("mrs %0, ctr_el0" : "=r"(ctr));
+	dline = 4ULL << ((ctr >> 16) & 0xf);
+	iline = 4ULL << (ctr & 0xf);
+
+	for (uint64_t addr = begin & ~(dline - 1); addr < end; addr += dline)
+		__asm__ volatile ("dc cvau, %0" :: "r"(addr) : "memory");
+	__asm__ volatile ("dsb ish" ::: "memory");
+	for (uint64_t addr = begin & ~(iline - 1); addr < end; addr += iline)
+		__asm__ volatile ("ic ivau, %0" :: "r"(addr) : "memory");
+	__asm__ volatile ("dsb ish\n\tisb" ::: "memory");
+}
+
+#endif
+
+/* The firmware runs the procedure on a stack it allocated as boot services
+ * memory, which becomes free memory for the kernel, so we switch to the
+ * stack from the mailbox before jumping to the copy of park_stub. */
+static uint64_t park_entry;
+
+static void start_ap(void *arg)
+{
+	struct manifest_mailbox *mailbox = arg;
+
+#ifdef __x86_64__
+	/* The stack top is page aligned, so the stack is 16 byte aligned at
+	 * the call in the stub. */
+	__asm__ volatile (
+		"mov %0, %%rsp\n\t"
+		"jmp *%1\n\t"
+		:
+		: "r"(mailbox->stack), "r"(park_entry), "D"(mailbox)
+		: "memory");
+#elif defined(__aarch64__)
+	__asm__ volatile (
+		"mov sp, %0\n\t"
+		"mov x0, %1\n\t"
+		"br %2\n\t"
+		:
+		: "r"(mailbox->stack), "r"(mailbox), "r"(park_entry)
+		: "x0", "memory");
+#endif
+	__builtin_unreachable();
+}
+
+static efi_status_t find_cpus(
+	struct loader *loader,
+	struct efi_mp_services_protocol *mp,
+	size_t *aps)
+{
+	efi_uint_t cpus, enabled;
+	efi_status_t status;
+
+	status = mp->get_number_of_processors(mp, &cpus, &enabled);
+	if (status != EFI_SUCCESS || cpus == 0) {
+		info(loader->system, "failed to get the number of CPUs\r\n");
+		return EFI_SUCCESS;
+	}
+
+	status = arena_alloc(
+		&loader->arena,
+		cpus * sizeof(*loader->cpu),
+		(void **)&loader->cpu);
+	if (status != EFI_SUCCESS) {
+		err(loader->system, "failed to allocate memory for CPUs\r\n");
+		return status;
+	}
+
+	*aps = 0;
+	for (efi_uint_t i = 0; i < cpus; ++i) {
+		const uint32_t healthy = EFI_PROCESSOR_ENABLED_BIT
+			| EFI_PROCESSOR_HEALTH_STATUS_BIT;
+		struct manifest_cpu *cpu = &loader->cpu[loader->cpus];
+		struct efi_processor_information processor;
+
+		memset(&processor, 0, sizeof(processor));
+		status = mp->get_processor_info(mp, i, &processor);
+		if (status != EFI_SUCCESS) {
+			info(
+				loader->system,
+				"failed to get information about CPU %llu\r\n",
+				(unsigned long long)i);
+			continue;
+		}
+
+		memset(cpu, 0, sizeof(*cpu));
+		cpu->id = processor.processor_id;
+		cpu->package = processor.location.package;
+		cpu->core = processor.location.core;
+		cpu->thread = processor.location.thread;
+		if (processor.status_flag & EFI_PROCESSOR_AS_BSP_BIT)
+			cpu->flags |= MANIFEST_CPU_BSP;
+		if (processor.status_flag & EFI_PROCESSOR_ENABLED_BIT)
+			cpu->flags |= MANIFEST_CPU_ENABLED;
+
+		/* Mailbox holds the processor number until the CPU is
+		 * actually parked. */
+		if ((processor.status_flag & healthy) == healthy
+				&& !(cpu->flags & MANIFEST_CPU_BSP)) {
+			cpu->mailbox = i;
+			++*aps;
+		} else {
+			cpu->mailbox = UINT64_MAX;
+		}
+		++loader->cpus;
+	}
+	return EFI_SUCCESS;
+}
+
+efi_status_t start_cpus(struct loader *loader)
+{
+	struct efi_guid guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+	struct efi_boot_table *boot = loader->system->boot;
+	struct efi_mp_services_protocol *mp;
+	const uint64_t stub_size = park_stub_end - park_stub;
+	struct manifest_mailbox *mailbox;
+	uint64_t mailboxes_size, pages;
+	size_t aps = 0, parked = 0;
+	efi_status_t status;
+	uint64_t addr;
+
+	loader->cpu = NULL;
+	loader->cpus = 0;
+	loader->cpus_section = 0;
+
+	status = boot->locate_protocol(&guid, NULL, (void **)&mp);
+	if (status != EFI_SUCCESS) {
+		info(
+			loader->system,
+			"no MP services, the kernel will start the CPUs\r\n");
+		return EFI_SUCCESS;
+	}
+
+	status = find_cpus(loader, mp, &aps);
+	if (status != EFI_SUCCESS || aps == 0)
+		return status;
+
+	/* Mailboxes go first, followed by the copy of park_stub and the
+	 * stacks, all in one allocation that the kernel owns after the
+	 * handoff. */
+	mailboxes_size = (aps * sizeof(*mailbox) + stub_size
+			+ CPU_PAGE_SIZE - 1)
+		& ~(CPU_PAGE_SIZE - 1);
+	pages = (mailboxes_size + aps * CPU_STACK_SIZE) / CPU_PAGE_SIZE;
+	status = boot->allocate_pages(
+		EFI_ALLOCATE_ANY_PAGES,
+		(enum efi_memory_type)LOADER_KERNEL_MEMORY,
+		pages,
+		&addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to allocate memory for CPU stacks\r\n");
+		return status;
+	}
+	memset((void *)addr, 0, mailboxes_size);
+
+	mailbox = (struct manifest_mailbox *)addr;
+	park_entry = (uint64_t)&mailbox[aps];
+	memcpy((void *)park_entry, park_stub, stub_size);
+	sync_code(park_entry, park_entry + stub_size);
+
+	for (size_t i = 0; i < loader->cpus; ++i) {
+		struct manifest_cpu *cpu = &loader->cpu[i];
+		const efi_uint_t number = cpu->mailbox;
+		efi_event_t event;
+
+		if (number == UINT64_MAX) {
+			cpu->mailbox = 0;
+			continue;
+		}
+
+		cpu->mailbox = 0;
+		mailbox[parked].stack_size = CPU_STACK_SIZE;
+		mailbox[parked].stack =
+			addr + mailboxes_size + (parked + 1) * CPU_STACK_SIZE;
+
+		/* The procedure never returns, so the call has to be the
+		 * non-blocking one, which needs an event. Nobody ever waits
+		 * for the event though. */
+		status = boot->create_event(
+			0, EFI_TPL_CALLBACK, NULL, NULL, &event);
+		if (status == EFI_SUCCESS) {
+			status = mp->startup_this_ap(
+				mp,
+				start_ap,
+				number,
+				event,
+				0,
+				&mailbox[parked],
+				NULL);
+		}
+		if (status != EFI_SUCCESS) {
+			info(
+				loader->system,
+				"failed to start CPU %llu\r\n",
+				(unsigned long long)number);
+			continue;
+		}
+
+		cpu->mailbox = (uint64_t)&mailbox[parked];
+		++parked;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* Some firmware takes the application processors back when the boot
+ * services exit, for example by sending them INIT to move them into a
+ * loop of its own. So after the exit we reset the heartbeat of every
+ * mailbox and give the CPUs some time to bump it again. Only the CPUs that
+ * did are reported as parked to the kernel. */
+void check_cpus(struct loader *loader, uint64_t frequency)
+{
+	const uint64_t ticks = frequency != 0
+		? frequency / (1000000 / HEARTBEAT_US)
+		: 1000000;
+	struct manifest_cpu *cpu;
+	uint64_t start;
+
+	if (loader->cpus_section == 0)
+		return;
+
+	cpu = (struct manifest_cpu *)((char *)loader->manifest
+		+ loader->cpus_section + sizeof(struct manifest_section));
+	for (size_t i = 0; i < loader->cpus; ++i) {
+		struct manifest_mailbox *mailbox =
+			(struct manifest_mailbox *)cpu[i].mailbox;
+
+		if (mailbox != NULL) {
+			__atomic_store_n(
+				&mailbox->heartbeat, 0, __ATOMIC_RELAXED);
+		}
+	}
+
+	start = read_counter();
+	while (read_counter() - start < ticks)
+		cpu_relax();
+
+	for (size_t i = 0; i < loader->cpus; ++i) {
+		struct manifest_mailbox *mailbox =
+			(struct manifest_mailbox *)cpu[i].mailbox;
+
+		if (mailbox == NULL)
+			continue;
+
+		if (__atomic_load_n(&mailbox->heartbeat, __ATOMIC_RELAXED) != 0)
+			cpu[i].flags |= MANIFEST_CPU_PARKED;
+		else
+			cpu[i].mailbox = 0;
+	}
+}
@@ -0,0 +1,39 @@
+#ifndef __EFI_BLOCK_IO_PROTOCOL_H__
+#define __EFI_BLOCK_IO_PROTOCOL_H__
+
+#include "types.h"
+
+#define EFI_BLOCK_IO_PROTOCOL_GUID \
+	{ 0x964e5b21, 0x6459, 0x11d2, \
+	  { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } }
+
+struct efi_block_io_media {
+	uint32_t media_id;
+	bool removable_media;
+	bool media_present;
+	bool logical_partition;
+	bool read_only;
+	bool write_caching;
+	uint32_t block_size;
+	uint32_t io_align;
+	uint64_t last_block;
+};
+
+struct efi_block_io_protocol {
+	uint64_t revision;
+	struct efi_block_io_media *media;
+
+	void (*unused1)();
+
+	efi_status_t (*read_blocks)(
+		struct efi_block_io_protocol *,
+		uint32_t,
+		uint64_t,
+		efi_uint_t,
+		void *);
+
+	void (*unused2)();
+	void (*unused3)();
+};
+
+#endif // __EFI_BLOCK_IO_PROTOCOL_H__
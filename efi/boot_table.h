@@ -4,6 +4,7 @@
 #include "types.h"
 
 static const uint32_t EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL = 0x00000001;
+static const efi_uint_t EFI_TPL_CALLBACK = 8;
 
 struct efi_boot_table
 {
@@ -31,7 +32,12 @@ struct efi_boot_table
 	efi_status_t (*free_pool)(void *);
 
 	// Event & Timer Services
-	void (*unused7)();
+	efi_status_t (*create_event)(
+		uint32_t,
+		efi_uint_t,
+		void (*)(efi_event_t, void *),
+		void *,
+		efi_event_t *);
 	void (*unused8)();
 	void (*unused9)();
 	void (*unused10)();
@@ -59,7 +65,7 @@ struct efi_boot_table
 
 	// Miscellaneius Services
 	void (*unused26)();
-	void (*unused27)();
+	efi_status_t (*stall)(efi_uint_t);
 	void (*unused28)();
 
 	// DriverSupport Services
@@ -85,7 +91,8 @@ struct efi_boot_table
 	efi_status_t (*protocols_per_handle)(
 		efi_handle_t, struct efi_guid ***, efi_uint_t *);
 	void (*unused35)();
-	void (*unused36)();
+	efi_status_t (*locate_protocol)(
+		struct efi_guid *, void *, void **);
 	void (*unused37)();
 	void (*unused38)();
 
@@ -0,0 +1,27 @@
+#ifndef __EFI_CONFIGURATION_TABLE_H__
+#define __EFI_CONFIGURATION_TABLE_H__
+
+#include "types.h"
+
+#define EFI_ACPI_20_TABLE_GUID \
+	{ 0x8868e871, 0xe4f1, 0x11d3, \
+	  { 0xbc, 0x22, 0x00, 0x80, 0xc7, 0x3c, 0x88, 0x81 } }
+
+#define EFI_ACPI_TABLE_GUID \
+	{ 0xeb9d2d30, 0x2d88, 0x11d3, \
+	  { 0x9a, 0x16, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d } }
+
+#define EFI_SMBIOS3_TABLE_GUID \
+	{ 0xf2fd1544, 0x9794, 0x4a2c, \
+	  { 0x99, 0x2e, 0xe5, 0xbb, 0xcf, 0x20, 0xe3, 0x94 } }
+
+#define EFI_DTB_TABLE_GUID \
+	{ 0xb1b621d5, 0xf19c, 0x41a5, \
+	  { 0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0 } }
+
+struct efi_configuration_table {
+	struct efi_guid guid;
+	void *table;
+};
+
+#endif // __EFI_CONFIGURATION_TABLE_H__
@@ -3,10 +3,33 @@
 
 #include "types.h"
 
+#define EFI_DEVICE_PATH_PROTOCOL_GUID \
+	{ 0x09576e91, 0x6d3f, 0x11d2, \
+	  { 0x8e, 0x39, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } }
+
+// Device path node types and a few subtypes we care about
+static const uint8_t EFI_DEVICE_PATH_MEDIA = 0x04;
+static const uint8_t EFI_DEVICE_PATH_END = 0x7f;
+static const uint8_t EFI_DEVICE_PATH_MEDIA_HARD_DRIVE = 0x01;
+static const uint8_t EFI_DEVICE_PATH_END_ENTIRE = 0xff;
+
 struct efi_device_path_protocol {
 	uint8_t type;
 	uint8_t subtype;
 	uint16_t length;
 };
 
+// The hard drive media node is packed and its fields are not naturally
+// aligned, so the structure below only describes offsets of the fields
+// in the node and should be accessed with memcpy.
+struct efi_hard_drive_device_path {
+	struct efi_device_path_protocol header;
+	uint8_t partition_number[4];
+	uint8_t partition_start[8];
+	uint8_t partition_size[8];
+	uint8_t partition_signature[16];
+	uint8_t partition_format;
+	uint8_t signature_type;
+};
+
 #endif // __EFI_DEVICE_PATH_PROTOCOL_H__
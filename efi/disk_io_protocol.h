@@ -0,0 +1,23 @@
+#ifndef __EFI_DISK_IO_PROTOCOL_H__
+#define __EFI_DISK_IO_PROTOCOL_H__
+
+#include "types.h"
+
+#define EFI_DISK_IO_PROTOCOL_GUID \
+	{ 0xce345171, 0xba0b, 0x11d2, \
+	  { 0x8e, 0x4f, 0x00, 0xa0, 0xc9, 0x69, 0x72, 0x3b } }
+
+struct efi_disk_io_protocol {
+	uint64_t revision;
+
+	efi_status_t (*read_disk)(
+		struct efi_disk_io_protocol *,
+		uint32_t,
+		uint64_t,
+		efi_uint_t,
+		void *);
+
+	void (*unused1)();
+};
+
+#endif // __EFI_DISK_IO_PROTOCOL_H__
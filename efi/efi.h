@@ -1,10 +1,16 @@
 #ifndef __EFI_H__
 #define __EFI_H__
 
+#include "block_io_protocol.h"
 #include "boot_table.h"
+#include "configuration_table.h"
 #include "device_path_protocol.h"
+#include "disk_io_protocol.h"
 #include "file_protocol.h"
+#include "graphics_output_protocol.h"
 #include "loaded_image_protocol.h"
+#include "mp_services_protocol.h"
+#include "runtime_table.h"
 #include "simple_file_system_protocol.h"
 #include "simple_text_output_protocol.h"
 #include "system_table.h"
@@ -0,0 +1,78 @@
+#ifndef __EFI_GRAPHICS_OUTPUT_PROTOCOL_H__
+#define __EFI_GRAPHICS_OUTPUT_PROTOCOL_H__
+
+#include "types.h"
+
+#define EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID \
+	{ 0x9042a9de, 0x23dc, 0x4a38, \
+	  { 0x96, 0xfb, 0x7a, 0xde, 0xd0, 0x80, 0x51, 0x6a } }
+
+enum efi_graphics_pixel_format {
+	EFI_PIXEL_RED_GREEN_BLUE_RESERVED_8BIT_PER_COLOR,
+	EFI_PIXEL_BLUE_GREEN_RED_RESERVED_8BIT_PER_COLOR,
+	EFI_PIXEL_BIT_MASK,
+	EFI_PIXEL_BLT_ONLY,
+	EFI_PIXEL_FORMAT_MAX,
+};
+
+struct efi_pixel_bitmask {
+	uint32_t red_mask;
+	uint32_t green_mask;
+	uint32_t blue_mask;
+	uint32_t reserved_mask;
+};
+
+struct efi_graphics_output_mode_information {
+	uint32_t version;
+	uint32_t horizontal_resolution;
+	uint32_t vertical_resolution;
+	enum efi_graphics_pixel_format pixel_format;
+	struct efi_pixel_bitmask pixel_information;
+	uint32_t pixels_per_scan_line;
+};
+
+struct efi_graphics_output_protocol_mode {
+	uint32_t max_mode;
+	uint32_t mode;
+	struct efi_graphics_output_mode_information *info;
+	efi_uint_t size_of_info;
+	uint64_t frame_buffer_base;
+	efi_uint_t frame_buffer_size;
+};
+
+/* Blt pixels are always 32 bits: blue, green, red and a reserved byte. */
+struct efi_graphics_output_blt_pixel {
+	uint8_t blue;
+	uint8_t green;
+	uint8_t red;
+	uint8_t reserved;
+};
+
+enum efi_graphics_output_blt_operation {
+	EFI_BLT_VIDEO_FILL,
+	EFI_BLT_VIDEO_TO_BLT_BUFFER,
+	EFI_BLT_BUFFER_TO_VIDEO,
+	EFI_BLT_VIDEO_TO_VIDEO,
+	EFI_GRAPHICS_OUTPUT_BLT_OPERATION_MAX,
+};
+
+struct efi_graphics_output_protocol {
+	void (*unused1)();
+	void (*unused2)();
+
+	efi_status_t (*blt)(
+		struct efi_graphics_output_protocol *,
+		struct efi_graphics_output_blt_pixel *,
+		enum efi_graphics_output_blt_operation,
+		efi_uint_t,
+		efi_uint_t,
+		efi_uint_t,
+		efi_uint_t,
+		efi_uint_t,
+		efi_uint_t,
+		efi_uint_t);
+
+	struct efi_graphics_output_protocol_mode *mode;
+};
+
+#endif // __EFI_GRAPHICS_OUTPUT_PROTOCOL_H__
@@ -0,0 +1,55 @@
+#ifndef __EFI_MP_SERVICES_PROTOCOL_H__
+#define __EFI_MP_SERVICES_PROTOCOL_H__
+
+#include "types.h"
+
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+	{ 0x3fdda605, 0xa76e, 0x4f46, \
+	  { 0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08 } }
+
+static const uint32_t EFI_PROCESSOR_AS_BSP_BIT = 0x00000001;
+static const uint32_t EFI_PROCESSOR_ENABLED_BIT = 0x00000002;
+static const uint32_t EFI_PROCESSOR_HEALTH_STATUS_BIT = 0x00000004;
+
+struct efi_cpu_physical_location {
+	uint32_t package;
+	uint32_t core;
+	uint32_t thread;
+};
+
+/* The extended location is only filled in if asked for explicitly, but
+ * newer firmware may still assume the buffer is large enough for it. */
+struct efi_processor_information {
+	uint64_t processor_id;
+	uint32_t status_flag;
+	struct efi_cpu_physical_location location;
+	uint32_t extended_location[6];
+};
+
+struct efi_mp_services_protocol {
+	efi_status_t (*get_number_of_processors)(
+		struct efi_mp_services_protocol *,
+		efi_uint_t *,
+		efi_uint_t *);
+	efi_status_t (*get_processor_info)(
+		struct efi_mp_services_protocol *,
+		efi_uint_t,
+		struct efi_processor_information *);
+
+	void (*unused1)();
+
+	efi_status_t (*startup_this_ap)(
+		struct efi_mp_services_protocol *,
+		void (*)(void *),
+		efi_uint_t,
+		efi_event_t,
+		efi_uint_t,
+		void *,
+		bool *);
+
+	void (*unused2)();
+	void (*unused3)();
+	void (*unused4)();
+};
+
+#endif // __EFI_MP_SERVICES_PROTOCOL_H__
@@ -0,0 +1,52 @@
+#ifndef __EFI_RUNTIME_TABLE_H__
+#define __EFI_RUNTIME_TABLE_H__
+
+#include "types.h"
+
+// Variable attributes
+static const uint32_t EFI_VARIABLE_NON_VOLATILE = 0x00000001;
+static const uint32_t EFI_VARIABLE_BOOTSERVICE_ACCESS = 0x00000002;
+static const uint32_t EFI_VARIABLE_RUNTIME_ACCESS = 0x00000004;
+
+struct efi_runtime_table
+{
+	struct efi_table_header header;
+
+	// Time Services
+	void (*unused1)();
+	void (*unused2)();
+	void (*unused3)();
+	void (*unused4)();
+
+	// Virtual Memory Services
+	void (*unused5)();
+	void (*unused6)();
+
+	// Variable Services
+	efi_status_t (*get_variable)(
+		uint16_t *,
+		struct efi_guid *,
+		uint32_t *,
+		efi_uint_t *,
+		void *);
+	void (*unused8)();
+	efi_status_t (*set_variable)(
+		uint16_t *,
+		struct efi_guid *,
+		uint32_t,
+		efi_uint_t,
+		void *);
+
+	// Miscellaneous Services
+	void (*unused10)();
+	void (*unused11)();
+
+	// Capsule Services
+	void (*unused12)();
+	void (*unused13)();
+
+	// Miscellaneous UEFI 2.0 Service
+	void (*unused14)();
+};
+
+#endif // __EFI_RUNTIME_TABLE_H__
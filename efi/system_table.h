@@ -2,6 +2,8 @@
 #define __EFI_SYSTEM_TABLE_H__
 
 #include "boot_table.h"
+#include "configuration_table.h"
+#include "runtime_table.h"
 #include "simple_text_output_protocol.h"
 #include "types.h"
 
@@ -16,10 +18,10 @@ struct efi_system_table
 	struct efi_simple_text_output_protocol *out;
 	void *unused6;
 	struct efi_simple_text_output_protocol *err;
-	void *unused8;
+	struct efi_runtime_table *runtime;
 	struct efi_boot_table *boot;
-	efi_uint_t unused10;
-	void *unused11;
+	efi_uint_t config_entries;
+	struct efi_configuration_table *config;
 };
 
 #endif // __EFI_SYSTEM_TABLE_H__
@@ -6,6 +6,7 @@
 #include <stdint.h>
 
 typedef void *efi_handle_t;
+typedef void *efi_event_t;
 typedef uint64_t efi_status_t;
 typedef uint64_t efi_uint_t;
 
@@ -18,6 +19,8 @@ static const efi_status_t EFI_LOAD_ERROR = ERROR_CODE(1);
 static const efi_status_t EFI_INVALID_PARAMETER = ERROR_CODE(2);
 static const efi_status_t EFI_UNSUPPORTED = ERROR_CODE(3);
 static const efi_status_t EFI_BUFFER_TOO_SMALL = ERROR_CODE(5);
+static const efi_status_t EFI_VOLUME_CORRUPTED = ERROR_CODE(10);
+static const efi_status_t EFI_NOT_FOUND = ERROR_CODE(14);
 
 struct efi_time {
 	uint16_t year;
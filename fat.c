@@ -0,0 +1,515 @@
+#include "fat.h"
+
+#include "clib.h"
+#include "log.h"
+
+
+static const uint8_t FAT_ATTR_VOLUME_ID = 0x08;
+static const uint8_t FAT_ATTR_DIRECTORY = 0x10;
+static const uint8_t FAT_ATTR_LONG_NAME = 0x0f;
+static const uint8_t FAT_ATTR_LONG_NAME_MASK = 0x3f;
+
+static const size_t FAT_DIR_ENTRY_SIZE = 32;
+static const size_t FAT_LFN_CHARS = 13;
+static const size_t FAT_LFN_ENTRIES = 20;
+
+/* A directory is either the fixed root directory of FAT12/FAT16 or a chain
+ * of clusters. In both cases we iterate over it one sector at a time. */
+struct fat_dir {
+	uint32_t cluster;
+	uint64_t offset;
+	uint32_t sectors;
+};
+
+static uint16_t get16(const uint8_t *data)
+{
+	return (uint16_t)data[0] | ((uint16_t)data[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *data)
+{
+	return (uint32_t)get16(data) | ((uint32_t)get16(data + 2) << 16);
+}
+
+static efi_status_t fat_read(
+	struct fat *fat, uint64_t offset, size_t size, void *dst)
+{
+	efi_status_t status;
+
+	status = fat->disk->read_disk(
+		fat->disk, fat->media_id, offset, size, dst);
+	if (status != EFI_SUCCESS) {
+		err(
+			fat->system,
+			"failed to read the boot volume: %llu\r\n",
+			(unsigned long long)status);
+		return status;
+	}
+	return EFI_SUCCESS;
+}
+
+static uint64_t fat_cluster_offset(const struct fat *fat, uint32_t cluster)
+{
+	return fat->data_offset + (uint64_t)(cluster - 2) * fat->cluster_size;
+}
+
+/* Free, bad and end of chain markers all fall outside of the range of
+ * valid data clusters, so we don't need to tell them apart. */
+static bool fat_valid_cluster(const struct fat *fat, uint32_t cluster)
+{
+	return cluster >= 2 && cluster < fat->clusters + 2;
+}
+
+static efi_status_t fat_byte(struct fat *fat, uint64_t offset, uint8_t *byte)
+{
+	const uint64_t sector = offset / fat->sector_size;
+
+	if (sector != fat->fat_cached) {
+		efi_status_t status = fat_read(
+			fat,
+			sector * fat->sector_size,
+			fat->sector_size,
+			fat->fat_sector);
+
+		if (status != EFI_SUCCESS)
+			return status;
+		fat->fat_cached = sector;
+	}
+
+	*byte = fat->fat_sector[offset % fat->sector_size];
+	return EFI_SUCCESS;
+}
+
+static efi_status_t fat_next_cluster(
+	struct fat *fat, uint32_t cluster, uint32_t *next)
+{
+	uint8_t entry[4];
+	uint64_t offset;
+	size_t size;
+
+	switch (fat->bits) {
+	case 12:
+		offset = cluster + cluster / 2;
+		size = 2;
+		break;
+	case 16:
+		offset = 2 * (uint64_t)cluster;
+		size = 2;
+		break;
+	default:
+		offset = 4 * (uint64_t)cluster;
+		size = 4;
+		break;
+	}
+
+	/* FAT12 entries might cross the sector boundary, so we just read
+	 * FAT entries byte by byte. It's all served from the cache anyway. */
+	for (size_t i = 0; i < size; ++i) {
+		efi_status_t status = fat_byte(
+			fat, fat->fat_offset + offset + i, &entry[i]);
+
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	switch (fat->bits) {
+	case 12:
+		*next = get16(entry);
+		*next = (cluster & 1) ? *next >> 4 : *next & 0xfff;
+		break;
+	case 16:
+		*next = get16(entry);
+		break;
+	default:
+		*next = get32(entry) & 0x0fffffff;
+		break;
+	}
+	return EFI_SUCCESS;
+}
+
+efi_status_t setup_fat(
+	struct fat *fat,
+	struct efi_system_table *system,
+	struct efi_disk_io_protocol *disk,
+	uint32_t media_id,
+	uint32_t block_size)
+{
+	efi_status_t status = EFI_SUCCESS;
+	uint8_t bpb[512];
+	uint32_t reserved_sectors, fats, root_entries;
+	uint32_t total_sectors, fat_sectors, data_sector;
+
+	memset(fat, 0, sizeof(*fat));
+	fat->system = system;
+	fat->disk = disk;
+	fat->media_id = media_id;
+	fat->block_size = block_size;
+	fat->fat_cached = UINT64_MAX;
+
+	status = fat_read(fat, /* offset */0, sizeof(bpb), bpb);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	if (bpb[510] != 0x55 || bpb[511] != 0xaa)
+		return EFI_UNSUPPORTED;
+
+	fat->sector_size = get16(&bpb[11]);
+	fat->cluster_sectors = bpb[13];
+	reserved_sectors = get16(&bpb[14]);
+	fats = bpb[16];
+	root_entries = get16(&bpb[17]);
+	total_sectors = get16(&bpb[19]);
+	if (total_sectors == 0)
+		total_sectors = get32(&bpb[32]);
+	fat_sectors = get16(&bpb[22]);
+	if (fat_sectors == 0)
+		fat_sectors = get32(&bpb[36]);
+
+	if (fat->sector_size < 512
+		|| fat->sector_size > sizeof(fat->fat_sector)
+		|| (fat->sector_size & (fat->sector_size - 1)) != 0
+		|| fat->cluster_sectors == 0
+		|| (fat->cluster_sectors & (fat->cluster_sectors - 1)) != 0
+		|| fats == 0
+		|| fat_sectors == 0)
+		return EFI_UNSUPPORTED;
+
+	fat->root_sectors =
+		(root_entries * FAT_DIR_ENTRY_SIZE + fat->sector_size - 1)
+		/ fat->sector_size;
+	data_sector =
+		reserved_sectors + fats * fat_sectors + fat->root_sectors;
+	if (total_sectors <= data_sector)
+		return EFI_UNSUPPORTED;
+
+	fat->clusters = (total_sectors - data_sector) / fat->cluster_sectors;
+	if (fat->clusters < 4085)
+		fat->bits = 12;
+	else if (fat->clusters < 65525)
+		fat->bits = 16;
+	else
+		fat->bits = 32;
+
+	fat->cluster_size = fat->cluster_sectors * fat->sector_size;
+	fat->fat_offset = (uint64_t)reserved_sectors * fat->sector_size;
+	fat->root_offset =
+		(uint64_t)(reserved_sectors + fats * fat_sectors)
+		* fat->sector_size;
+	fat->root_cluster = fat->bits == 32 ? get32(&bpb[44]) : 0;
+	fat->data_offset = (uint64_t)data_sector * fat->sector_size;
+
+	/* We report file location in blocks of the underlying device, so the
+	 * clusters must start and end on the block boundary. */
+	if (block_size == 0
+		|| fat->data_offset % block_size != 0
+		|| fat->cluster_size % block_size != 0)
+		return EFI_UNSUPPORTED;
+
+	return EFI_SUCCESS;
+}
+
+static void fat_open_dir(
+	const struct fat *fat, uint32_t cluster, struct fat_dir *dir)
+{
+	if (cluster == 0 && fat->bits != 32) {
+		dir->cluster = 0;
+		dir->offset = fat->root_offset;
+		dir->sectors = fat->root_sectors;
+		return;
+	}
+
+	if (cluster == 0)
+		cluster = fat->root_cluster;
+	dir->cluster = cluster;
+	dir->offset = fat_cluster_offset(fat, cluster);
+	dir->sectors = fat->cluster_sectors;
+}
+
+/* Read the next sector of the directory in fat->dir_sector. When there are
+ * no more sectors in the directory *end is set to true. */
+static efi_status_t fat_read_dir(
+	struct fat *fat, struct fat_dir *dir, bool *end)
+{
+	efi_status_t status = EFI_SUCCESS;
+
+	*end = false;
+	if (dir->sectors == 0) {
+		uint32_t next;
+
+		if (dir->cluster == 0) {
+			*end = true;
+			return EFI_SUCCESS;
+		}
+
+		status = fat_next_cluster(fat, dir->cluster, &next);
+		if (status != EFI_SUCCESS)
+			return status;
+
+		if (!fat_valid_cluster(fat, next)) {
+			*end = true;
+			return EFI_SUCCESS;
+		}
+
+		fat_open_dir(fat, next, dir);
+	}
+
+	if (!fat_valid_cluster(fat, dir->cluster) && dir->cluster != 0)
+		return EFI_VOLUME_CORRUPTED;
+
+	status = fat_read(fat, dir->offset, fat->sector_size, fat->dir_sector);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	dir->offset += fat->sector_size;
+	--dir->sectors;
+	return EFI_SUCCESS;
+}
+
+static uint16_t upcase(uint16_t code)
+{
+	if (code >= 'a' && code <= 'z')
+		return code - 'a' + 'A';
+	return code;
+}
+
+static uint8_t fat_checksum(const uint8_t *entry)
+{
+	uint8_t sum = 0;
+
+	for (size_t i = 0; i < 11; ++i)
+		sum = ((sum & 1) << 7) + (sum >> 1) + entry[i];
+	return sum;
+}
+
+static bool fat_long_name_equal(
+	const uint16_t *lfn, const uint16_t *name, size_t size)
+{
+	const size_t max = FAT_LFN_ENTRIES * FAT_LFN_CHARS;
+
+	if (size > max)
+		return false;
+
+	for (size_t i = 0; i < size; ++i) {
+		if (upcase(lfn[i]) != upcase(name[i]))
+			return false;
+	}
+	return size == max || lfn[size] == 0 || lfn[size] == 0xffff;
+}
+
+static bool fat_short_name_equal(
+	const uint8_t *entry, const uint16_t *name, size_t size)
+{
+	uint16_t short_name[12];
+	size_t len = 0;
+	size_t base = 8;
+	size_t ext = 3;
+
+	while (base > 0 && entry[base - 1] == ' ')
+		--base;
+	while (ext > 0 && entry[8 + ext - 1] == ' ')
+		--ext;
+
+	for (size_t i = 0; i < base; ++i)
+		short_name[len++] = entry[i];
+	if (ext > 0) {
+		short_name[len++] = '.';
+		for (size_t i = 0; i < ext; ++i)
+			short_name[len++] = entry[8 + i];
+	}
+
+	/* 0xe5 marks deleted entries, so names that actually start with it
+	 * store 0x05 instead. */
+	if (len > 0 && short_name[0] == 0x05)
+		short_name[0] = 0xe5;
+
+	if (len != size)
+		return false;
+	for (size_t i = 0; i < len; ++i) {
+		if (upcase(short_name[i]) != upcase(name[i]))
+			return false;
+	}
+	return true;
+}
+
+/* Find an entry with the given name in the directory and copy it into
+ * entry. An entry matches by its long name or by its 8.3 alias, the same
+ * way the firmware file system driver opens files by either of them. */
+static efi_status_t fat_find(
+	struct fat *fat,
+	struct fat_dir *dir,
+	const uint16_t *name,
+	size_t size,
+	uint8_t *entry)
+{
+	static const size_t lfn_offset[] = {
+		1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+	};
+	uint16_t lfn[FAT_LFN_ENTRIES * FAT_LFN_CHARS];
+	uint8_t lfn_checksum = 0;
+	bool lfn_valid = false;
+
+	while (1) {
+		efi_status_t status;
+		bool end;
+
+		status = fat_read_dir(fat, dir, &end);
+		if (status != EFI_SUCCESS)
+			return status;
+		if (end)
+			return EFI_NOT_FOUND;
+
+		for (size_t i = 0;
+			i < fat->sector_size;
+			i += FAT_DIR_ENTRY_SIZE) {
+			const uint8_t *e = &fat->dir_sector[i];
+			size_t order;
+
+			if (e[0] == 0x00)
+				return EFI_NOT_FOUND;
+
+			if (e[0] == 0xe5) {
+				lfn_valid = false;
+				continue;
+			}
+
+			if ((e[11] & FAT_ATTR_LONG_NAME_MASK)
+					== FAT_ATTR_LONG_NAME) {
+				order = e[0] & 0x1f;
+				if (order == 0 || order > FAT_LFN_ENTRIES) {
+					lfn_valid = false;
+					continue;
+				}
+
+				if (e[0] & 0x40) {
+					memset(lfn, 0, sizeof(lfn));
+					lfn_checksum = e[13];
+					lfn_valid = true;
+				} else if (e[13] != lfn_checksum) {
+					lfn_valid = false;
+				}
+
+				for (size_t j = 0; j < FAT_LFN_CHARS; ++j) {
+					lfn[(order - 1) * FAT_LFN_CHARS + j] =
+						get16(&e[lfn_offset[j]]);
+				}
+				continue;
+			}
+
+			if (e[11] & FAT_ATTR_VOLUME_ID) {
+				lfn_valid = false;
+				continue;
+			}
+
+			if ((lfn_valid && lfn_checksum == fat_checksum(e)
+					&& fat_long_name_equal(lfn, name, size))
+					|| fat_short_name_equal(e, name, size)) {
+				memcpy(entry, e, FAT_DIR_ENTRY_SIZE);
+				return EFI_SUCCESS;
+			}
+			lfn_valid = false;
+		}
+	}
+}
+
+static bool is_separator(uint16_t code)
+{
+	return code == '\\' || code == '/';
+}
+
+efi_status_t fat_lookup(
+	struct fat *fat,
+	const uint16_t *path,
+	uint32_t *cluster,
+	uint64_t *size)
+{
+	struct fat_dir dir;
+
+	fat_open_dir(fat, /* root */0, &dir);
+	while (1) {
+		efi_status_t status = EFI_SUCCESS;
+		uint8_t entry[32];
+		const uint16_t *name;
+		uint32_t first;
+
+		while (is_separator(*path))
+			++path;
+		if (*path == 0)
+			return EFI_NOT_FOUND;
+
+		name = path;
+		while (*path != 0 && !is_separator(*path))
+			++path;
+
+		status = fat_find(fat, &dir, name, path - name, entry);
+		if (status != EFI_SUCCESS)
+			return status;
+
+		first = get16(&entry[26]);
+		if (fat->bits == 32)
+			first |= (uint32_t)get16(&entry[20]) << 16;
+
+		while (is_separator(*path))
+			++path;
+
+		if (*path == 0) {
+			if (entry[11] & FAT_ATTR_DIRECTORY)
+				return EFI_NOT_FOUND;
+			*cluster = first;
+			*size = get32(&entry[28]);
+			return EFI_SUCCESS;
+		}
+
+		if (!(entry[11] & FAT_ATTR_DIRECTORY))
+			return EFI_NOT_FOUND;
+		fat_open_dir(fat, first, &dir);
+	}
+}
+
+efi_status_t fat_extents(
+	struct fat *fat,
+	uint32_t cluster,
+	uint64_t size,
+	struct extent *extent,
+	size_t *extents)
+{
+	const uint64_t clusters =
+		(size + fat->cluster_size - 1) / fat->cluster_size;
+	const uint64_t blocks = fat->cluster_size / fat->block_size;
+	uint64_t end = 0;
+	size_t count = 0;
+
+	for (uint64_t i = 0; i < clusters; ++i) {
+		uint64_t offset;
+
+		if (!fat_valid_cluster(fat, cluster)) {
+			err(
+				fat->system,
+				"cluster chain is shorter than the file\r\n");
+			return EFI_VOLUME_CORRUPTED;
+		}
+
+		offset = fat_cluster_offset(fat, cluster);
+		if (count != 0 && offset == end) {
+			if (extent != NULL)
+				extent[count - 1].blocks += blocks;
+		} else {
+			if (extent != NULL) {
+				extent[count].lba = offset / fat->block_size;
+				extent[count].blocks = blocks;
+			}
+			++count;
+		}
+		end = offset + fat->cluster_size;
+
+		if (i + 1 < clusters) {
+			efi_status_t status = fat_next_cluster(
+				fat, cluster, &cluster);
+
+			if (status != EFI_SUCCESS)
+				return status;
+		}
+	}
+
+	*extents = count;
+	return EFI_SUCCESS;
+}
@@ -0,0 +1,72 @@
+#ifndef __FAT_H__
+#define __FAT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "efi/efi.h"
+
+
+/* A contiguous run of blocks on the boot device. */
+struct extent {
+	uint64_t lba;
+	uint64_t blocks;
+};
+
+/* This is not a FAT driver, it's just enough of the FAT to find where a
+ * file is located on the disk without reading it. The reads go through the
+ * firmware file system driver, unless the loader is built with
+ * FAT_FALLBACK, in which case the modules the driver fails to open are read
+ * through the disk protocol using the extents found here. */
+struct fat {
+	struct efi_system_table *system;
+	struct efi_disk_io_protocol *disk;
+	uint32_t media_id;
+	uint32_t block_size;
+
+	int bits;
+	uint32_t sector_size;
+	uint32_t cluster_sectors;
+	uint32_t cluster_size;
+	uint32_t clusters;
+	uint64_t fat_offset;
+	uint64_t root_offset;
+	uint32_t root_sectors;
+	uint32_t root_cluster;
+	uint64_t data_offset;
+
+	/* FAT entries are usually read one after another, so caching just
+	 * one sector of the FAT avoids most of the disk reads. */
+	uint64_t fat_cached;
+	uint8_t fat_sector[4096];
+	uint8_t dir_sector[4096];
+};
+
+/* Read the boot sector of the volume and check that it's a FAT file system
+ * that we can map files on. */
+efi_status_t setup_fat(
+	struct fat *fat,
+	struct efi_system_table *system,
+	struct efi_disk_io_protocol *disk,
+	uint32_t media_id,
+	uint32_t block_size);
+
+/* Find the first cluster and the size of the file. Both '\' and '/' are
+ * accepted as path separators and names are compared ignoring case. */
+efi_status_t fat_lookup(
+	struct fat *fat,
+	const uint16_t *path,
+	uint32_t *cluster,
+	uint64_t *size);
+
+/* Translate the cluster chain of the file into a list of extents relative
+ * to the beginning of the volume. When extent is NULL the function only
+ * counts the extents, so that the caller could allocate enough space. */
+efi_status_t fat_extents(
+	struct fat *fat,
+	uint32_t cluster,
+	uint64_t size,
+	struct extent *extent,
+	size_t *extents);
+
+#endif  // __FAT_H__
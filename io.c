@@ -1,5 +1,6 @@
 #include "io.h"
 
+#include "clib.h"
 #include "log.h"
 
 
@@ -34,9 +35,183 @@ efi_status_t efi_read_fixed(
 				(unsigned long long)status);
 			return status;
 		}
+		if (remains == 0) {
+			err(system, "unexpected end of file\r\n");
+			return EFI_LOAD_ERROR;
+		}
 
 		read += remains;
 	}
 
 	return status;
 }
+
+static bool source_range(
+	const struct source *source, uint64_t offset, uint64_t size)
+{
+	return offset <= source->size && size <= source->size - offset;
+}
+
+static efi_status_t source_range_error(const struct source *source)
+{
+	err(source->system, "read past the end of the source\r\n");
+	return EFI_LOAD_ERROR;
+}
+
+static efi_status_t file_read_at(
+	struct source *source,
+	uint64_t offset,
+	size_t size,
+	void *dst)
+{
+	struct file_source *file = (struct file_source *)source;
+
+	if (!source_range(source, offset, size))
+		return source_range_error(source);
+	return efi_read_fixed(source->system, file->file, offset, size, dst);
+}
+
+efi_status_t setup_file_source(
+	struct file_source *source,
+	struct efi_system_table *system,
+	struct efi_file_protocol *file)
+{
+	struct efi_guid guid = EFI_FILE_INFO_GUID;
+	struct efi_file_info file_info;
+	efi_uint_t size = sizeof(file_info);
+	efi_status_t status;
+
+	status = file->get_info(file, &guid, &size, (void *)&file_info);
+	if (status != EFI_SUCCESS) {
+		err(system, "failed to find the file size\r\n");
+		return status;
+	}
+
+	memset(source, 0, sizeof(*source));
+	source->source.read_at = file_read_at;
+	source->source.system = system;
+	source->source.size = file_info.file_size;
+	source->file = file;
+	return EFI_SUCCESS;
+}
+
+static efi_status_t memory_read_at(
+	struct source *source,
+	uint64_t offset,
+	size_t size,
+	void *dst)
+{
+	struct memory_source *memory = (struct memory_source *)source;
+
+	if (!source_range(source, offset, size))
+		return source_range_error(source);
+	memcpy(dst, memory->data + offset, size);
+	return EFI_SUCCESS;
+}
+
+static const void *memory_map(
+	struct source *source,
+	uint64_t offset,
+	size_t size)
+{
+	struct memory_source *memory = (struct memory_source *)source;
+
+	if (!source_range(source, offset, size))
+		return NULL;
+	return memory->data + offset;
+}
+
+void setup_memory_source(
+	struct memory_source *source,
+	struct efi_system_table *system,
+	const void *data,
+	uint64_t size)
+{
+	memset(source, 0, sizeof(*source));
+	source->source.read_at = memory_read_at;
+	source->source.map = memory_map;
+	source->source.system = system;
+	source->source.size = size;
+	source->data = data;
+}
+
+/* The extents are walked from the beginning on every read, the loader
+ * reads sources mostly from the start and in a few large reads. */
+static efi_status_t block_read_at(
+	struct source *source,
+	uint64_t offset,
+	size_t size,
+	void *dst)
+{
+	struct block_source *block = (struct block_source *)source;
+	char *buf = dst;
+
+	if (!source_range(source, offset, size))
+		return source_range_error(source);
+
+	for (size_t i = 0; i < block->extents && size > 0; ++i) {
+		const uint64_t extent_size =
+			block->extent[i].blocks * block->block_size;
+		uint64_t chunk;
+		efi_status_t status;
+
+		if (offset >= extent_size) {
+			offset -= extent_size;
+			continue;
+		}
+
+		chunk = extent_size - offset;
+		if (chunk > size)
+			chunk = size;
+
+		status = block->disk->read_disk(
+			block->disk,
+			block->media_id,
+			block->extent[i].lba * block->block_size + offset,
+			chunk,
+			buf);
+		if (status != EFI_SUCCESS) {
+			err(
+				source->system,
+				"failed to read the disk: %llu\r\n",
+				(unsigned long long)status);
+			return status;
+		}
+
+		buf += chunk;
+		size -= chunk;
+		offset = 0;
+	}
+
+	if (size != 0)
+		return source_range_error(source);
+	return EFI_SUCCESS;
+}
+
+void setup_block_source(
+	struct block_source *source,
+	struct efi_system_table *system,
+	struct efi_disk_io_protocol *disk,
+	uint32_t media_id,
+	uint32_t block_size,
+	const struct extent *extent,
+	size_t extents,
+	uint64_t size)
+{
+	memset(source, 0, sizeof(*source));
+	source->source.read_at = block_read_at;
+	source->source.system = system;
+	source->source.size = size;
+	source->disk = disk;
+	source->media_id = media_id;
+	source->block_size = block_size;
+	source->extent = extent;
+	source->extents = extents;
+}
+
+const void *source_map(struct source *source, uint64_t offset, size_t size)
+{
+	if (source->map == NULL)
+		return NULL;
+	return source->map(source, offset, size);
+}
@@ -5,6 +5,7 @@
 #include <stdint.h>
 
 #include "efi/efi.h"
+#include "fat.h"
 
 efi_status_t efi_read_fixed(
 	struct efi_system_table *system,
@@ -13,4 +14,71 @@ efi_status_t efi_read_fixed(
 	size_t size,
 	void *dst);
 
+/* Something the loader reads bytes from: a file, a buffer already in
+ * memory or a list of extents on a disk. The loader code doesn't care
+ * which one it is.
+ *
+ * map is optional. Sources that have the data in memory return a pointer
+ * to it instead of copying, for everything else map is NULL or returns
+ * NULL. Reads and maps past the end of the source fail. */
+struct source {
+	efi_status_t (*read_at)(
+		struct source *source,
+		uint64_t offset,
+		size_t size,
+		void *dst);
+	const void *(*map)(
+		struct source *source,
+		uint64_t offset,
+		size_t size);
+	struct efi_system_table *system;
+	uint64_t size;
+};
+
+struct file_source {
+	struct source source;
+	struct efi_file_protocol *file;
+};
+
+struct memory_source {
+	struct source source;
+	const char *data;
+};
+
+struct block_source {
+	struct source source;
+	struct efi_disk_io_protocol *disk;
+	uint32_t media_id;
+	uint32_t block_size;
+	const struct extent *extent;
+	size_t extents;
+};
+
+/* The size of the file is taken from the file info. */
+efi_status_t setup_file_source(
+	struct file_source *source,
+	struct efi_system_table *system,
+	struct efi_file_protocol *file);
+
+void setup_memory_source(
+	struct memory_source *source,
+	struct efi_system_table *system,
+	const void *data,
+	uint64_t size);
+
+/* The extents are in blocks of the disk the protocol reads, the same way
+ * fat_extents reports them, and are referenced, not copied. */
+void setup_block_source(
+	struct block_source *source,
+	struct efi_system_table *system,
+	struct efi_disk_io_protocol *disk,
+	uint32_t media_id,
+	uint32_t block_size,
+	const struct extent *extent,
+	size_t extents,
+	uint64_t size);
+
+/* Returns a pointer to the data if the source can map it or NULL. */
+const void *source_map(struct source *source, uint64_t offset, size_t size);
+
 #endif  // __IO_H__
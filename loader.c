@@ -4,8 +4,18 @@
 #include "compiler.h"
 #include "io.h"
 #include "log.h"
+#include "pe.h"
 
 
+static bool same_reserve(const struct reserve *r, const char *name)
+{
+	return r->name == name || strcmp(r->name, name) == 0;
+}
+
+/* Reserved ranges are appended as they come, firmware usually allocates
+ * from the top of memory down, so keeping them sorted on the way would
+ * shift the whole array on every insert. They are sorted and checked once
+ * all of them are known (see sort_reserves). */
 static efi_status_t reserve(
 	struct loader *loader,
 	const char *name,
@@ -21,8 +31,8 @@ static efi_status_t reserve(
 		if (new_size == 0)
 			new_size = 16;
 
-		status = loader->system->boot->allocate_pool(
-			EFI_LOADER_DATA,
+		status = arena_alloc(
+			&loader->arena,
 			new_size * sizeof(struct reserve),
 			(void **)&new_reserve);
 		if (status != EFI_SUCCESS) {
@@ -38,17 +48,6 @@ static efi_status_t reserve(
 			loader->reserves * sizeof(struct reserve));
 		loader->reserve = new_reserve;
 		loader->reserve_capacity = new_size;
-
-		if (old_reserve != NULL) {
-			status = loader->system->boot->free_pool(
-				(void *)old_reserve);
-			if (status != EFI_SUCCESS) {
-				err(
-					loader->system,
-					"failed to free buffer for memory reserve\r\n");
-				return status;
-			}
-		}
 	}
 
 	memset(&loader->reserve[loader->reserves], 0, sizeof(struct reserve));
@@ -59,6 +58,219 @@ static efi_status_t reserve(
 	return EFI_SUCCESS;
 }
 
+/* Empty ranges go before the ranges starting at the same address, so that
+ * they don't look like overlaps. */
+static bool reserve_less(const struct reserve *l, const struct reserve *r)
+{
+	if (l->begin != r->begin)
+		return l->begin < r->begin;
+	return l->end < r->end;
+}
+
+static void sift_down(struct reserve *reserve, size_t root, size_t size)
+{
+	while (2 * root + 1 < size) {
+		size_t child = 2 * root + 1;
+		struct reserve tmp;
+
+		if (child + 1 < size
+				&& reserve_less(&reserve[child], &reserve[child + 1]))
+			++child;
+		if (!reserve_less(&reserve[root], &reserve[child]))
+			return;
+
+		tmp = reserve[root];
+		reserve[root] = reserve[child];
+		reserve[child] = tmp;
+		root = child;
+	}
+}
+
+/* Heap sort, since it doesn't need any memory and the order the ranges
+ * come in doesn't matter for it. */
+efi_status_t sort_reserves(struct loader *loader)
+{
+	struct reserve *reserve = loader->reserve;
+	size_t reserves = 0;
+
+	for (size_t i = loader->reserves / 2; i > 0; --i)
+		sift_down(reserve, i - 1, loader->reserves);
+
+	for (size_t size = loader->reserves; size > 1; --size) {
+		struct reserve tmp = reserve[0];
+
+		reserve[0] = reserve[size - 1];
+		reserve[size - 1] = tmp;
+		sift_down(reserve, 0, size - 1);
+	}
+
+	for (size_t i = 0; i < loader->reserves; ++i) {
+		struct reserve *prev =
+			reserves > 0 ? &reserve[reserves - 1] : NULL;
+
+		if (prev != NULL && prev->end > reserve[i].begin) {
+			err(
+				loader->system,
+				"memory of %s at 0x%llx-0x%llx overlaps with %s\r\n",
+				reserve[i].name,
+				(unsigned long long)reserve[i].begin,
+				(unsigned long long)reserve[i].end,
+				prev->name);
+			return EFI_INVALID_PARAMETER;
+		}
+
+		if (prev != NULL && prev->end == reserve[i].begin
+				&& same_reserve(prev, reserve[i].name)) {
+			prev->end = reserve[i].end;
+			continue;
+		}
+
+		reserve[reserves++] = reserve[i];
+	}
+
+	loader->reserves = reserves;
+	return EFI_SUCCESS;
+}
+
+static efi_status_t add_lazy(
+	struct loader *loader,
+	const char *name,
+	uint64_t size,
+	struct extent *extent,
+	size_t extents)
+{
+	if (loader->lazies == loader->lazy_capacity) {
+		efi_status_t status = EFI_SUCCESS;
+		size_t new_size = 2 * loader->lazies;
+		struct lazy *new_lazy = NULL;
+		struct lazy *old_lazy = loader->lazy;
+
+		if (new_size == 0)
+			new_size = 16;
+
+		status = arena_alloc(
+			&loader->arena,
+			new_size * sizeof(struct lazy),
+			(void **)&new_lazy);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to allocate buffer for lazy modules\r\n");
+			return status;
+		}
+
+		memcpy(
+			new_lazy,
+			old_lazy,
+			loader->lazies * sizeof(struct lazy));
+		loader->lazy = new_lazy;
+		loader->lazy_capacity = new_size;
+	}
+
+	memset(&loader->lazy[loader->lazies], 0, sizeof(struct lazy));
+	loader->lazy[loader->lazies].name = name;
+	loader->lazy[loader->lazies].size = size;
+	loader->lazy[loader->lazies].device = loader->boot_device;
+	loader->lazy[loader->lazies].extent = extent;
+	loader->lazy[loader->lazies].extents = extents;
+	++loader->lazies;
+	return EFI_SUCCESS;
+}
+
+static int bundle_name_cmp(
+	const char *name, size_t size, const uint16_t *path)
+{
+	while (*path == '\\' || *path == '/')
+		++path;
+
+	for (size_t i = 0; i < size; ++i, ++path) {
+		uint16_t l = (unsigned char)name[i];
+		uint16_t r = *path == '/' ? '\\' : *path;
+
+		if (l >= 'a' && l <= 'z')
+			l = l - 'a' + 'A';
+		if (r >= 'a' && r <= 'z')
+			r = r - 'a' + 'A';
+		if (l != r)
+			return l < r ? -1 : 1;
+	}
+	return *path == 0 ? 0 : -1;
+}
+
+static const struct bundle_entry *find_in_bundle(
+	const struct loader *loader,
+	const uint16_t *path)
+{
+	const struct bundle_entry *entry =
+		(const struct bundle_entry *)(loader->bundle + 1);
+	const char *strings =
+		(const char *)loader->bundle + loader->bundle->strings;
+	size_t l = 0;
+	size_t r = loader->bundle->entries;
+
+	while (l < r) {
+		const size_t m = l + (r - l) / 2;
+		const int cmp = bundle_name_cmp(
+			&strings[entry[m].name], entry[m].name_size, path);
+
+		if (cmp == 0)
+			return &entry[m];
+		if (cmp < 0)
+			l = m + 1;
+		else
+			r = m;
+	}
+	return NULL;
+}
+
+static efi_status_t verify_bundle(
+	struct efi_system_table *system,
+	const struct bundle_header *bundle,
+	uint64_t size)
+{
+	const struct bundle_entry *entry =
+		(const struct bundle_entry *)(bundle + 1);
+
+	if (size < sizeof(*bundle)
+		|| memcmp(bundle->magic, BUNDLE_MAGIC, sizeof(bundle->magic))
+			!= 0) {
+		err(system, "No magic sequence in the bundle header\r\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	if (bundle->version != BUNDLE_VERSION) {
+		err(
+			system,
+			"Unsupported bundle version %u, only version %u is supported\r\n",
+			(unsigned)bundle->version,
+			(unsigned)BUNDLE_VERSION);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (bundle->size > size
+		|| bundle->entries
+			> (size - sizeof(*bundle)) / sizeof(*entry)
+		|| bundle->strings > size
+		|| bundle->strings_size > size - bundle->strings) {
+		err(system, "Bundle is truncated\r\n");
+		return EFI_LOAD_ERROR;
+	}
+
+	for (size_t i = 0; i < bundle->entries; ++i) {
+		if (entry[i].offset > bundle->size
+			|| entry[i].size > bundle->size - entry[i].offset
+			|| entry[i].offset % BUNDLE_ALIGN != 0
+			|| entry[i].name > bundle->strings_size
+			|| entry[i].name_size
+				> bundle->strings_size - entry[i].name) {
+			err(system, "Bundle entry %u is invalid\r\n", (unsigned)i);
+			return EFI_LOAD_ERROR;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
 static efi_status_t get_loader_image(
 	efi_handle_t loader,
 	struct efi_system_table *system,
@@ -99,6 +311,100 @@ static efi_status_t get_rootdir(
 	return rootfs->open_volume(rootfs, rootdir);
 }
 
+static bool has_terminator(const char *data, uint64_t size)
+{
+	for (uint64_t i = size; i > 0; --i) {
+		if (data[i - 1] == '\0')
+			return true;
+	}
+	return false;
+}
+
+/* The loader binary might carry the config and the bundle as additional PE
+ * sections (see embed.S). The firmware has already loaded the whole image
+ * in memory, so we just need to find the sections in the PE headers. */
+static efi_status_t find_embedded(struct loader *loader)
+{
+	const char *image = loader->image->image_base;
+	const uint64_t image_size = loader->image->image_size;
+	struct pe_file_header header;
+	uint32_t signature;
+	uint32_t offset;
+	uint64_t section;
+
+	if (image_size < PE_DOS_LFANEW + sizeof(offset))
+		return EFI_SUCCESS;
+
+	memcpy(&offset, &image[PE_DOS_LFANEW], sizeof(offset));
+	if (offset > image_size - sizeof(signature) - sizeof(header))
+		return EFI_SUCCESS;
+
+	memcpy(&signature, &image[offset], sizeof(signature));
+	if (signature != PE_SIGNATURE)
+		return EFI_SUCCESS;
+
+	memcpy(&header, &image[offset + sizeof(signature)], sizeof(header));
+	section = offset + sizeof(signature) + sizeof(header)
+		+ header.size_of_optional_header;
+
+	for (size_t i = 0; i < header.number_of_sections; ++i) {
+		struct pe_section_header shdr;
+		const char *data;
+
+		if (section + sizeof(shdr) > image_size)
+			break;
+
+		memcpy(&shdr, &image[section], sizeof(shdr));
+		section += sizeof(shdr);
+
+		if ((uint64_t)shdr.virtual_address + shdr.virtual_size
+				> image_size)
+			continue;
+
+		data = &image[shdr.virtual_address];
+		if (memcmp(shdr.name, ".config", sizeof(shdr.name)) == 0) {
+			if (!has_terminator(data, shdr.virtual_size)) {
+				err(
+					loader->system,
+					"embedded config is not terminated\r\n");
+				return EFI_LOAD_ERROR;
+			}
+			loader->config_data = (char *)data;
+			loader->config_size = shdr.virtual_size;
+		}
+
+		if (memcmp(shdr.name, ".bundle", sizeof(shdr.name)) == 0) {
+			efi_status_t status = verify_bundle(
+				loader->system,
+				(const struct bundle_header *)data,
+				shdr.virtual_size);
+
+			if (status != EFI_SUCCESS) {
+				err(
+					loader->system,
+					"embedded bundle didn't pass verifications\r\n");
+				return status;
+			}
+			loader->bundle = (const struct bundle_header *)data;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+uint64_t find_config_table(
+	const struct efi_system_table *system,
+	struct efi_guid guid)
+{
+	for (efi_uint_t i = 0; i < system->config_entries; ++i) {
+		const struct efi_configuration_table *entry = &system->config[i];
+
+		if (memcmp(&entry->guid, &guid, sizeof(guid)) == 0)
+			return (uint64_t)entry->table;
+	}
+	return 0;
+}
+
 efi_status_t setup_loader(
 	efi_handle_t handle,
 	struct efi_system_table *system,
@@ -109,6 +415,7 @@ efi_status_t setup_loader(
 	memset(loader, 0, sizeof(*loader));
 	loader->system = system;
 	loader->handle = handle;
+	setup_arena(&loader->arena, system, LOADER_RECLAIM_MEMORY);
 
 	status = get_loader_image(handle, system, &loader->image);
 	if (status != EFI_SUCCESS) {
@@ -118,12 +425,37 @@ efi_status_t setup_loader(
 		return status;
 	}
 
+	start_timer(&loader->timer, system);
+
+#ifdef GOP_CONSOLE
+	if (setup_console(&loader->console, system) == EFI_SUCCESS)
+		set_log_output(&loader->console.out);
+#endif
+
 	loader->root_device = loader->image->device;
-	status = get_rootfs(
-		handle, system, loader->root_device, &loader->rootfs);
+	status = find_embedded(loader);
 	if (status != EFI_SUCCESS) {
 		err(
 			system,
+			"failed to find embedded files\r\n");
+		return status;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static efi_status_t open_root(struct loader *loader)
+{
+	efi_status_t status;
+
+	status = get_rootfs(
+		loader->handle,
+		loader->system,
+		loader->root_device,
+		&loader->rootfs);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
 			"failed to get root volume\r\n");
 		return status;
 	}
@@ -131,203 +463,831 @@ efi_status_t setup_loader(
 	status = get_rootdir(loader->rootfs, &loader->rootdir);
 	if (status != EFI_SUCCESS) {
 		err(
-			system,
+			loader->system,
 			"failed to get root filesystem directory\r\n");
 		return status;
 	}
-
 	return EFI_SUCCESS;
 }
 
-static efi_status_t read_elf64_header(
-	struct efi_system_table *system,
-	struct efi_file_protocol *file,
-	struct elf64_ehdr *hdr)
+static bool is_separator(uint16_t code)
 {
-	return efi_read_fixed(system, file, /*offset*/0, sizeof(*hdr), hdr);
+	return code == '\\' || code == '/';
 }
 
-static efi_status_t verify_elf64_header(
-	struct efi_system_table *system,
-	const struct elf64_ehdr *hdr)
+/* Modules usually live in a few directories, so a linear scan is enough.
+ * The scan goes from the most recently opened directory, since modules
+ * from the same directory tend to be next to each other in the config. */
+static struct directory *find_directory(
+	struct loader *loader,
+	const uint16_t *path,
+	size_t length)
 {
-	if (hdr->e_ident[EI_MAG0] != 0x7f
-		|| hdr->e_ident[EI_MAG1] != 'E'
-		|| hdr->e_ident[EI_MAG2] != 'L'
-		|| hdr->e_ident[EI_MAG3] != 'F') {
-		err(system, "No ELF magic sequence in the ELF header\r\n");
-		return EFI_UNSUPPORTED;
+	for (size_t i = loader->directories; i > 0; --i) {
+		struct directory *directory = &loader->directory[i - 1];
+
+		if (directory->length == length
+				&& memcmp(
+					directory->path,
+					path,
+					length * sizeof(*path)) == 0)
+			return directory;
 	}
+	return NULL;
+}
 
-	if (hdr->e_type != ET_EXEC && hdr->e_type != ET_DYN) {
-		err(
-			system,
-			"Unsupported ELF file type 0x%x, the only type 0x%x is supported\r\n",
-			(unsigned)hdr->e_type,
-			(unsigned)ET_EXEC);
-		return EFI_UNSUPPORTED;
-	}
+static efi_status_t add_directory(
+	struct loader *loader,
+	const uint16_t *path,
+	size_t length,
+	struct efi_file_protocol *file)
+{
+	if (loader->directories == loader->directory_capacity) {
+		efi_status_t status = EFI_SUCCESS;
+		size_t new_size = 2 * loader->directories;
+		struct directory *new_directory = NULL;
+		struct directory *old_directory = loader->directory;
 
-	if (hdr->e_ident[EI_CLASS] != ELFCLASS64) {
-		err(
-			system,
-			"Unsupported ELF class 0x%x, the only class 0x%x is supported\r\n",
-			(unsigned)hdr->e_ident[EI_CLASS],
-			(unsigned)ELFCLASS64);
-		return EFI_UNSUPPORTED;
-	}
+		if (new_size == 0)
+			new_size = 16;
 
-	if (hdr->e_phnum == 0) {
-		err(
-			system,
-			"ELF file doesn't contain any program headers\r\n");
-		return EFI_UNSUPPORTED;
-	}
+		status = arena_alloc(
+			&loader->arena,
+			new_size * sizeof(struct directory),
+			(void **)&new_directory);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to allocate buffer for directories\r\n");
+			return status;
+		}
 
-	if (hdr->e_phentsize != sizeof(struct elf64_phdr)) {
-		err(
-			system,
-			"Unexpected ELF program header size %u, only size %u is supported\r\n",
-			(unsigned)hdr->e_phentsize,
-			(unsigned)sizeof(struct elf64_phdr));
-		return EFI_UNSUPPORTED;
+		memcpy(
+			new_directory,
+			old_directory,
+			loader->directories * sizeof(struct directory));
+		loader->directory = new_directory;
+		loader->directory_capacity = new_size;
 	}
 
+	loader->directory[loader->directories].path = path;
+	loader->directory[loader->directories].length = length;
+	loader->directory[loader->directories].file = file;
+	++loader->directories;
 	return EFI_SUCCESS;
 }
 
-static efi_status_t read_elf64_program_headers(
-	struct efi_system_table *system,
-	struct efi_boot_table *boot,
-	struct efi_file_protocol *file,
-	const struct elf64_ehdr *hdr,
-	struct elf64_phdr **phdrs)
+/* Open the directory named by the first length characters of the path.
+ * The parent directory is opened the same way first, so every directory
+ * is opened relative to its parent and each of them only once. */
+static efi_status_t open_directory(
+	struct loader *loader,
+	const uint16_t *path,
+	size_t length,
+	struct efi_file_protocol **dir)
 {
+	struct efi_file_protocol *parent = loader->rootdir;
+	const struct directory *cached;
+	size_t begin = length;
 	efi_status_t status;
+	uint16_t *prefix;
 
-	status = boot->allocate_pool(
-		EFI_LOADER_DATA,
-		hdr->e_phnum * hdr->e_phentsize,
-		(void **)phdrs);
-	if (status != EFI_SUCCESS) {
-		err(
-			system,
-			"failed to allocate buffer for program headers\r\n");
-		return status;
+	if (length == 0) {
+		*dir = loader->rootdir;
+		return EFI_SUCCESS;
 	}
 
-	status = efi_read_fixed(
-		system,
-		file,
-		hdr->e_phoff,
-		hdr->e_phentsize * hdr->e_phnum,
-		(void *)*phdrs);
+	cached = find_directory(loader, path, length);
+	if (cached != NULL) {
+		*dir = cached->file;
+		return EFI_SUCCESS;
+	}
+
+	while (begin > 0 && !is_separator(path[begin - 1]))
+		--begin;
+
+	if (begin > 0) {
+		status = open_directory(loader, path, begin - 1, &parent);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	/* Paths with repeated separators have empty names in them. */
+	if (begin == length) {
+		*dir = parent;
+		return EFI_SUCCESS;
+	}
+
+	/* The copy of the prefix is the cache key, and being terminated it
+	 * also gives us the name of the directory to open. */
+	status = arena_alloc(
+		&loader->arena,
+		(length + 1) * sizeof(*prefix),
+		(void **)&prefix);
+	if (status != EFI_SUCCESS)
+		return status;
+	memcpy(prefix, path, length * sizeof(*prefix));
+	prefix[length] = 0;
+
+	status = parent->open(
+		parent,
+		dir,
+		&prefix[begin],
+		EFI_FILE_MODE_READ,
+		EFI_FILE_READ_ONLY);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = add_directory(loader, prefix, length, *dir);
 	if (status != EFI_SUCCESS) {
-		err(
-			system,
-			"failed to read program headers\r\n");
-		boot->free_pool((void *)*phdrs);
+		(*dir)->close(*dir);
 		return status;
 	}
-
 	return EFI_SUCCESS;
 }
 
-static void elf64_image_size(
+efi_status_t open_file(
 	struct loader *loader,
-	uint64_t alignment,
-	uint64_t *begin,
-	uint64_t *end)
+	const uint16_t *path,
+	struct efi_file_protocol **file)
 {
-	*begin = UINT64_MAX;
-	*end = 0;
-
-	for (size_t i = 0; i < loader->kernel_header.e_phnum; ++i) {
-		struct elf64_phdr *phdr = &loader->program_headers[i];
-		uint64_t phdr_begin, phdr_end;
-		uint64_t align = alignment;
-
-		if (phdr->p_type != PT_LOAD)
-			continue;
+	struct efi_file_protocol *dir;
+	size_t name = 0;
+	efi_status_t status;
 
-		if (phdr->p_align > align)
-			align = phdr->p_align;
+	if (loader->rootdir == NULL) {
+		status = open_root(loader);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
 
-		phdr_begin = phdr->p_vaddr;
-		phdr_begin &= ~(align - 1);
-		if (*begin > phdr_begin)
-			*begin = phdr_begin;
+	/* Paths are relative to the root either way, and without the leading
+	 * separator the same directory always has the same cache key. */
+	while (is_separator(*path))
+		++path;
 
-		phdr_end = phdr->p_vaddr + phdr->p_memsz + align - 1;
-		phdr_end &= ~(align - 1);
-		if (*end < phdr_end)
-			*end = phdr_end;
+	for (size_t i = 0; path[i] != 0; ++i) {
+		if (is_separator(path[i]))
+			name = i + 1;
 	}
-}
 
-efi_status_t load_kernel(struct loader *loader)
-{
-	efi_status_t status = EFI_SUCCESS;
-	uint64_t page_size = 4096;
-	uint64_t image_begin;
-	uint64_t image_end;
-	uint64_t image_size;
-	uint64_t image_addr;
+	status = open_directory(
+		loader, path, name > 0 ? name - 1 : 0, &dir);
+	if (status != EFI_SUCCESS)
+		return status;
 
-	status = loader->rootdir->open(
-		loader->rootdir,
-		&loader->kernel_image,
-		(uint16_t *)loader->module[loader->kernel].path,
+	return dir->open(
+		dir,
+		file,
+		(uint16_t *)&path[name],
 		EFI_FILE_MODE_READ,
 		EFI_FILE_READ_ONLY);
+}
+
+void close_directories(struct loader *loader)
+{
+	/* Children were opened after their parents, so they are closed
+	 * first. */
+	for (size_t i = loader->directories; i > 0; --i) {
+		struct efi_file_protocol *file = loader->directory[i - 1].file;
+
+		if (file->close(file) != EFI_SUCCESS) {
+			info(
+				loader->system,
+				"failed to close directory %w\r\n",
+				loader->directory[i - 1].path);
+		}
+	}
+	loader->directory = NULL;
+	loader->directory_capacity = 0;
+	loader->directories = 0;
+
+	if (loader->rootdir != NULL) {
+		loader->rootdir->close(loader->rootdir);
+		loader->rootdir = NULL;
+	}
+}
+
+/* Allocate pages for a module honoring its placement attributes. Pages
+ * can only be allocated with page alignment, so for larger alignments we
+ * allocate more than needed and give back what remains around the aligned
+ * range. */
+static efi_status_t allocate_module(
+	struct loader *loader,
+	const struct module *module,
+	uint64_t size,
+	uint64_t *addr)
+{
+	const uint64_t page_size = 4096;
+	struct efi_boot_table *boot = loader->system->boot;
+	const enum efi_memory_type type = (enum efi_memory_type)module->type;
+	const uint64_t pages = size == 0 ? 1 : (size + page_size - 1) / page_size;
+	const uint64_t align =
+		module->align > page_size ? module->align : page_size;
+	const uint64_t extra = align / page_size - 1;
+	uint64_t begin = 0, end, aligned;
+	efi_status_t status;
+
+	if (module->fixed) {
+		if (module->below != 0
+				&& pages > (module->below - module->at) / page_size) {
+			err(
+				loader->system,
+				"module %s doesn't fit below 0x%llx\r\n",
+				module->name,
+				(unsigned long long)module->below);
+			return EFI_BUFFER_TOO_SMALL;
+		}
+
+		*addr = module->at;
+		status = boot->allocate_pages(
+			EFI_ALLOCATE_ADDRESS, type, pages, addr);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to allocate memory for %s at 0x%llx\r\n",
+				module->name,
+				(unsigned long long)module->at);
+			return status;
+		}
+		return EFI_SUCCESS;
+	}
+
+	if (module->node != MODULE_ANY_NODE) {
+		status = allocate_on_node(loader, module, pages, addr);
+		if (status == EFI_SUCCESS)
+			return EFI_SUCCESS;
+		if (status != EFI_NOT_FOUND) {
+			err(
+				loader->system,
+				"failed to allocate memory for %s\r\n",
+				module->name);
+			return status;
+		}
+		info(
+			loader->system,
+			"no memory for %s on the requested node\r\n",
+			module->name);
+	}
+
+	if (module->below != 0)
+		begin = module->below - 1;
+
+	status = boot->allocate_pages(
+		module->below != 0
+			? EFI_ALLOCATE_MAX_ADDRESS
+			: EFI_ALLOCATE_ANY_PAGES,
+		type,
+		pages + extra,
+		&begin);
 	if (status != EFI_SUCCESS) {
 		err(
 			loader->system,
-			"failed to open kernel file\r\n");
+			"failed to allocate memory for %s\r\n",
+			module->name);
 		return status;
 	}
 
-	status = read_elf64_header(
-		loader->system, loader->kernel_image, &loader->kernel_header);
+	end = begin + (pages + extra) * page_size;
+	aligned = (begin + align - 1) & ~(align - 1);
+
+	if (aligned != begin) {
+		status = boot->free_pages(begin, (aligned - begin) / page_size);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to free memory before %s\r\n",
+				module->name);
+			return status;
+		}
+	}
+
+	if (aligned + pages * page_size != end) {
+		status = boot->free_pages(
+			aligned + pages * page_size,
+			(end - aligned) / page_size - pages);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to free memory after %s\r\n",
+				module->name);
+			return status;
+		}
+	}
+
+	*addr = aligned;
+	return EFI_SUCCESS;
+}
+
+/* Modules from sources that map their data, like the bundle, are used in
+ * place, unless that would break their placement attributes, in which case
+ * they are copied out. An embedded bundle is a part of the loader image,
+ * which the kernel gets as reclaimable memory, so modules from it are
+ * always copied into LOADER_MODULE_MEMORY. */
+static bool placement_satisfied(
+	const struct loader *loader,
+	const struct module *module,
+	uint64_t addr,
+	uint64_t size)
+{
+	if (loader->image != NULL) {
+		const uint64_t image = (uint64_t)loader->image->image_base;
+
+		if (addr < image + loader->image->image_size
+				&& image < addr + size)
+			return false;
+	}
+	if (module->type != LOADER_MODULE_MEMORY)
+		return false;
+	if (module->node != MODULE_ANY_NODE)
+		return false;
+	if (module->fixed && addr != module->at)
+		return false;
+	if (module->align != 0 && addr % module->align != 0)
+		return false;
+	if (module->below != 0 && addr + size > module->below)
+		return false;
+	return true;
+}
+
+/* Bundle entries are read through memory sources, so that the modules
+ * that can stay in the bundle are never copied. */
+static bool find_bundle_source(
+	struct loader *loader,
+	const uint16_t *path,
+	struct memory_source *source)
+{
+	const struct bundle_entry *entry;
+
+	if (loader->bundle == NULL)
+		return false;
+
+	entry = find_in_bundle(loader, path);
+	if (entry == NULL)
+		return false;
+
+	setup_memory_source(
+		source,
+		loader->system,
+		(const char *)loader->bundle + entry->offset,
+		entry->size);
+	return true;
+}
+
+efi_status_t load_bundle(struct loader *loader)
+{
+	efi_status_t status = EFI_SUCCESS;
+	struct efi_file_protocol *file = NULL;
+	struct file_source source;
+	const uint16_t *path;
+	uint64_t addr;
+
+	/* The bundle embedded in the loader image takes precedence over the
+	 * one in the config. */
+	if (!loader->has_bundle || loader->bundle != NULL)
+		return EFI_SUCCESS;
+
+	path = loader->module[loader->bundle_module].path;
+	status = open_file(loader, path, &file);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to open bundle %w\r\n",
+			path);
+		return status;
+	}
+
+	status = setup_file_source(&source, loader->system, file);
 	if (status != EFI_SUCCESS) {
 		err(
 			loader->system,
-			"failed to read ELF header\r\n");
+			"failed to find bundle file size\r\n");
 		return status;
 	}
 
-	status = verify_elf64_header(
-		loader->system, &loader->kernel_header);
-	if (status != EFI_SUCCESS) {
-		err(
-			loader->system,
-			"ELF header didn't pass verifications\r\n");
-		return status;
+	status = loader->system->boot->allocate_pages(
+		EFI_ALLOCATE_ANY_PAGES,
+		(enum efi_memory_type)LOADER_MODULE_MEMORY,
+		(source.source.size + BUNDLE_ALIGN - 1) / BUNDLE_ALIGN,
+		&addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to allocate memory for bundle\r\n");
+		return status;
+	}
+
+	status = source.source.read_at(
+		&source.source,
+		/* offset */0,
+		/* size */source.source.size,
+		(void *)addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to read bundle in memory\r\n");
+		return status;
+	}
+
+	status = file->close(file);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to close bundle file\r\n");
+		return status;
+	}
+
+	status = verify_bundle(
+		loader->system,
+		(const struct bundle_header *)addr,
+		source.source.size);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"bundle didn't pass verifications\r\n");
+		return status;
+	}
+
+	loader->bundle = (const struct bundle_header *)addr;
+	loader->bundle_size =
+		(source.source.size + BUNDLE_ALIGN - 1) & ~(BUNDLE_ALIGN - 1);
+	return EFI_SUCCESS;
+}
+
+static efi_status_t verify_elf64_header(
+	struct efi_system_table *system,
+	const struct elf64_ehdr *hdr)
+{
+	if (hdr->e_ident[EI_MAG0] != 0x7f
+		|| hdr->e_ident[EI_MAG1] != 'E'
+		|| hdr->e_ident[EI_MAG2] != 'L'
+		|| hdr->e_ident[EI_MAG3] != 'F') {
+		err(system, "No ELF magic sequence in the ELF header\r\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->e_type != ET_EXEC && hdr->e_type != ET_DYN) {
+		err(
+			system,
+			"Unsupported ELF file type 0x%x, the only type 0x%x is supported\r\n",
+			(unsigned)hdr->e_type,
+			(unsigned)ET_EXEC);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->e_ident[EI_CLASS] != ELFCLASS64) {
+		err(
+			system,
+			"Unsupported ELF class 0x%x, the only class 0x%x is supported\r\n",
+			(unsigned)hdr->e_ident[EI_CLASS],
+			(unsigned)ELFCLASS64);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->e_phnum == 0) {
+		err(
+			system,
+			"ELF file doesn't contain any program headers\r\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->e_phentsize != sizeof(struct elf64_phdr)) {
+		err(
+			system,
+			"Unexpected ELF program header size %u, only size %u is supported\r\n",
+			(unsigned)hdr->e_phentsize,
+			(unsigned)sizeof(struct elf64_phdr));
+		return EFI_UNSUPPORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* When the kernel is in memory the program headers are used in place, as
+ * long as they are aligned well enough to be accessed directly. */
+static efi_status_t read_elf64_program_headers(
+	struct loader *loader,
+	const struct elf64_ehdr *hdr,
+	const struct elf64_phdr **phdrs)
+{
+	struct efi_system_table *system = loader->system;
+	struct source *source = loader->kernel_source;
+	const size_t size = hdr->e_phentsize * hdr->e_phnum;
+	struct elf64_phdr *buffer;
+	efi_status_t status;
+
+	*phdrs = source_map(source, hdr->e_phoff, size);
+	if (*phdrs != NULL && (uint64_t)*phdrs % sizeof(uint64_t) == 0)
+		return EFI_SUCCESS;
+
+	status = arena_alloc(&loader->arena, size, (void **)&buffer);
+	if (status != EFI_SUCCESS) {
+		err(
+			system,
+			"failed to allocate buffer for program headers\r\n");
+		return status;
+	}
+
+	*phdrs = buffer;
+	status = source->read_at(source, hdr->e_phoff, size, buffer);
+	if (status != EFI_SUCCESS) {
+		err(
+			system,
+			"failed to read program headers\r\n");
+		return status;
+	}
+
+	return EFI_SUCCESS;
+}
+
+static void elf64_image_size(
+	struct loader *loader,
+	uint64_t alignment,
+	uint64_t *begin,
+	uint64_t *end)
+{
+	*begin = UINT64_MAX;
+	*end = 0;
+
+	for (size_t i = 0; i < loader->kernel_header.e_phnum; ++i) {
+		const struct elf64_phdr *phdr = &loader->program_headers[i];
+		uint64_t phdr_begin, phdr_end;
+		uint64_t align = alignment;
+
+		if (phdr->p_type != PT_LOAD)
+			continue;
+
+		if (phdr->p_align > align)
+			align = phdr->p_align;
+
+		phdr_begin = phdr->p_vaddr;
+		phdr_begin &= ~(align - 1);
+		if (*begin > phdr_begin)
+			*begin = phdr_begin;
+
+		phdr_end = phdr->p_vaddr + phdr->p_memsz + align - 1;
+		phdr_end &= ~(align - 1);
+		if (*end < phdr_end)
+			*end = phdr_end;
+	}
+}
+
+static efi_status_t read_kernel_headers(
+	struct loader *loader,
+	uint64_t *image_begin,
+	uint64_t *image_end)
+{
+	uint64_t page_size = 4096;
+	efi_status_t status;
+
+	status = verify_elf64_header(
+		loader->system, &loader->kernel_header);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"ELF header didn't pass verifications\r\n");
+		return status;
+	}
+
+	status = read_elf64_program_headers(
+		loader,
+		&loader->kernel_header,
+		&loader->program_headers);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to read ELF program headers\r\n");
+		return status;
+	}
+
+	elf64_image_size(loader, page_size, image_begin, image_end);
+	return EFI_SUCCESS;
+}
+
+#ifdef __x86_64__
+static const uint32_t PRELAID_MACHINE = EM_X86_64;
+#elif defined(__aarch64__)
+static const uint32_t PRELAID_MACHINE = EM_AARCH64;
+#endif
+
+static efi_status_t verify_prelaid_header(
+	struct efi_system_table *system,
+	const struct prelaid_header *hdr)
+{
+	if (hdr->version != PRELAID_VERSION) {
+		err(
+			system,
+			"Unsupported prelaid image version %u, only version %u is supported\r\n",
+			(unsigned)hdr->version,
+			(unsigned)PRELAID_VERSION);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->machine != PRELAID_MACHINE) {
+		err(
+			system,
+			"Prelaid image is built for machine 0x%x\r\n",
+			(unsigned)hdr->machine);
+		return EFI_UNSUPPORTED;
+	}
+
+	if (hdr->memsz == 0
+		|| hdr->memsz % PRELAID_ALIGN != 0
+		|| hdr->filesz > hdr->memsz
+		|| hdr->entry >= hdr->memsz
+		|| hdr->align < PRELAID_ALIGN
+		|| (hdr->align & (hdr->align - 1)) != 0
+		|| hdr->relocs > hdr->memsz / sizeof(uint64_t)) {
+		err(
+			system,
+			"Prelaid image header is inconsistent\r\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* The image is read as is right where it's going to run, only the BSS at
+ * the end has to be cleared and the relocations applied. */
+static efi_status_t load_prelaid(
+	struct loader *loader,
+	const struct prelaid_header *hdr)
+{
+	struct module module = loader->module[loader->kernel];
+	uint64_t *relocs = NULL;
+	efi_status_t status;
+	uint64_t addr;
+
+	status = verify_prelaid_header(loader->system, hdr);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	if (module.align < hdr->align)
+		module.align = hdr->align;
+
+	status = allocate_module(loader, &module, hdr->memsz, &addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to allocate buffer for the kernel\r\n");
+		return status;
+	}
+
+	status = loader->kernel_source->read_at(
+		loader->kernel_source, PRELAID_ALIGN, hdr->filesz, (void *)addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to read the kernel image in memory\r\n");
+		return status;
+	}
+	memset((void *)(addr + hdr->filesz), 0, hdr->memsz - hdr->filesz);
+
+	if (hdr->relocs != 0) {
+		status = arena_alloc(
+			&loader->arena,
+			hdr->relocs * sizeof(*relocs),
+			(void **)&relocs);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to allocate buffer for relocations\r\n");
+			return status;
+		}
+
+		status = loader->kernel_source->read_at(
+			loader->kernel_source,
+			hdr->relocs_offset,
+			hdr->relocs * sizeof(*relocs),
+			relocs);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to read the kernel relocations\r\n");
+			return status;
+		}
+	}
+
+	for (uint64_t i = 0; i < hdr->relocs; ++i) {
+		uint64_t value;
+
+		if (relocs[i] > hdr->memsz - sizeof(value)) {
+			err(
+				loader->system,
+				"kernel relocation is out of the image\r\n");
+			return EFI_LOAD_ERROR;
+		}
+
+		memcpy(&value, (void *)(addr + relocs[i]), sizeof(value));
+		value += addr - hdr->base;
+		memcpy((void *)(addr + relocs[i]), &value, sizeof(value));
+	}
+
+	status = reserve(
+		loader,
+		module.name,
+		addr,
+		addr + hdr->memsz);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to mark kernel memory as reserved\r\n");
+		return status;
+	}
+
+	loader->kernel_image_entry = addr + hdr->entry;
+	return EFI_SUCCESS;
+}
+
+efi_status_t load_kernel(struct loader *loader)
+{
+	efi_status_t status = EFI_SUCCESS;
+	bool planned = false;
+	uint64_t image_begin;
+	uint64_t image_end;
+	uint64_t image_size;
+	uint64_t image_addr;
+
+	const uint16_t *path = loader->module[loader->kernel].path;
+	struct efi_file_protocol *file = NULL;
+
+	if (find_bundle_source(loader, path, &loader->kernel_memory)) {
+		loader->kernel_source = &loader->kernel_memory.source;
+	} else {
+		status = open_file(loader, path, &file);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to open kernel file\r\n");
+			return status;
+		}
+
+		status = setup_file_source(
+			&loader->kernel_file, loader->system, file);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to find kernel file size\r\n");
+			return status;
+		}
+
+		loader->kernel_source = &loader->kernel_file.source;
+		planned = find_plan(
+			loader->system, &loader->plan, path, file);
 	}
 
-	status = read_elf64_program_headers(
-		loader->system,
-		loader->system->boot,
-		loader->kernel_image,
-		&loader->kernel_header,
-		&loader->program_headers);
-	if (status != EFI_SUCCESS) {
-		err(
-			loader->system,
-			"failed to read ELF program headers\r\n");
-		return status;
+	if (planned) {
+		loader->kernel_header = loader->plan.header;
+		loader->program_headers = loader->plan.phdr;
+		image_begin = loader->plan.image_begin;
+		image_end = loader->plan.image_end;
+	} else {
+		union {
+			struct elf64_ehdr elf;
+			struct prelaid_header prelaid;
+		} header;
+
+		/* Both kinds of the header are read at once, the magic tells
+		 * which one it is. */
+		status = loader->kernel_source->read_at(
+			loader->kernel_source,
+			/*offset*/0,
+			sizeof(header),
+			&header);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to read kernel header\r\n");
+			return status;
+		}
+
+		if (memcmp(
+				header.prelaid.magic,
+				PRELAID_MAGIC,
+				sizeof(header.prelaid.magic)) == 0)
+			return load_prelaid(loader, &header.prelaid);
+
+		loader->kernel_header = header.elf;
+		status = read_kernel_headers(loader, &image_begin, &image_end);
+		if (status != EFI_SUCCESS)
+			return status;
+
+		if (file != NULL) {
+			save_plan(
+				loader->system,
+				&loader->plan,
+				&loader->kernel_header,
+				loader->program_headers,
+				image_begin,
+				image_end);
+		}
 	}
 
-	elf64_image_size(
-		loader,
-		page_size,
-		&image_begin,
-		&image_end);
 	image_size = image_end - image_begin;
-	status = loader->system->boot->allocate_pages(
-		EFI_ALLOCATE_ANY_PAGES,
-		EFI_LOADER_DATA,
-		image_size / page_size,
+	status = allocate_module(
+		loader,
+		&loader->module[loader->kernel],
+		image_size,
 		&image_addr);
 	if (status != EFI_SUCCESS) {
 		err(
@@ -338,16 +1298,15 @@ efi_status_t load_kernel(struct loader *loader)
 
 	memset((void *)image_addr, 0, image_size);
 	for (size_t i = 0; i < loader->kernel_header.e_phnum; ++i) {
-		struct elf64_phdr *phdr = &loader->program_headers[i];
+		const struct elf64_phdr *phdr = &loader->program_headers[i];
 		uint64_t phdr_addr;
 
 		if (phdr->p_type != PT_LOAD)
 			continue;
 
 		phdr_addr = image_addr + phdr->p_vaddr - image_begin;
-		status = efi_read_fixed(
-			loader->system,
-			loader->kernel_image,
+		status = loader->kernel_source->read_at(
+			loader->kernel_source,
 			phdr->p_offset,
 			phdr->p_filesz,
 			(void *)phdr_addr);
@@ -357,110 +1316,497 @@ efi_status_t load_kernel(struct loader *loader)
 				"failed to read the kernel segment in memory\r\n");
 			return status;
 		}
+	}
+
+	/* The kernel gets a single record in the manifest, so we reserve the
+	 * whole image, including the gaps between the segments, at once. */
+	status = reserve(
+		loader,
+		loader->module[loader->kernel].name,
+		image_addr,
+		image_addr + image_size);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to mark kernel memory as reserved\r\n");
+		return status;
+	}
+
+	loader->kernel_image_entry =
+		image_addr + loader->kernel_header.e_entry - image_begin;
+	return EFI_SUCCESS;
+}
+
+/* Sources that map their data are used in place when the placement allows
+ * it, everything else is read into the pages allocated for the module. */
+static efi_status_t load_module(
+	struct loader *loader,
+	struct source *source,
+	const struct module *module)
+{
+	const uint64_t size = source->size;
+	const void *data = source_map(source, /* offset */0, size);
+	efi_status_t status = EFI_SUCCESS;
+	uint64_t addr = (uint64_t)data;
+
+	if (data == NULL || !placement_satisfied(loader, module, addr, size)) {
+		status = allocate_module(loader, module, size, &addr);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to allocate memory for module\r\n");
+			return status;
+		}
 
-		status = reserve(
-			loader,
-			"kernel",
-			phdr_addr,
-			phdr_addr + phdr->p_memsz);
+		status = source->read_at(
+			source, /* offset */0, size, (void *)addr);
 		if (status != EFI_SUCCESS) {
 			err(
 				loader->system,
-				"failed to mark kernel segment as reserved\r\n");
+				"failed to read module in memory\r\n");
 			return status;
 		}
 	}
 
-	loader->kernel_image_entry =
-		image_addr + loader->kernel_header.e_entry - image_begin;
+	status = reserve(
+		loader,
+		module->name,
+		addr,
+		addr + size);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to mark module memory as reserved\r\n");
+		return status;
+	}
 	return EFI_SUCCESS;
 }
 
-static efi_status_t load_module(
+static void find_partition(
+	struct efi_device_path_protocol *node,
+	struct boot_device *device)
+{
+	while (node->type != EFI_DEVICE_PATH_END
+			|| node->subtype != EFI_DEVICE_PATH_END_ENTIRE) {
+		if (node->type == EFI_DEVICE_PATH_MEDIA
+				&& node->subtype
+					== EFI_DEVICE_PATH_MEDIA_HARD_DRIVE) {
+			struct efi_hard_drive_device_path *hd =
+				(struct efi_hard_drive_device_path *)node;
+
+			memcpy(
+				&device->partition_number,
+				hd->partition_number,
+				sizeof(device->partition_number));
+			memcpy(
+				&device->partition_start,
+				hd->partition_start,
+				sizeof(device->partition_start));
+			memcpy(
+				device->signature,
+				hd->partition_signature,
+				sizeof(device->signature));
+			device->signature_type = hd->signature_type;
+		}
+
+		if (node->length < sizeof(*node))
+			break;
+		node = (struct efi_device_path_protocol *)(
+			(char *)node + node->length);
+	}
+}
+
+static efi_status_t setup_boot_device(struct loader *loader)
+{
+	struct efi_guid block_io_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+	struct efi_guid disk_io_guid = EFI_DISK_IO_PROTOCOL_GUID;
+	struct efi_guid device_path_guid = EFI_DEVICE_PATH_PROTOCOL_GUID;
+	struct efi_block_io_protocol *block_io = NULL;
+	struct efi_disk_io_protocol *disk_io = NULL;
+	struct efi_device_path_protocol *device_path = NULL;
+	efi_status_t status = EFI_SUCCESS;
+
+	status = loader->system->boot->open_protocol(
+		loader->root_device,
+		&block_io_guid,
+		(void **)&block_io,
+		loader->handle,
+		NULL,
+		EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = loader->system->boot->open_protocol(
+		loader->root_device,
+		&disk_io_guid,
+		(void **)&disk_io,
+		loader->handle,
+		NULL,
+		EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	memset(&loader->boot_device, 0, sizeof(loader->boot_device));
+	loader->boot_device.block_size = block_io->media->block_size;
+
+	/* Without the device path we can still describe the file location,
+	 * but the kernel will have to figure out the disk on its own. */
+	status = loader->system->boot->open_protocol(
+		loader->root_device,
+		&device_path_guid,
+		(void **)&device_path,
+		loader->handle,
+		NULL,
+		EFI_OPEN_PROTOCOL_BY_HANDLE_PROTOCOL);
+	if (status == EFI_SUCCESS)
+		find_partition(device_path, &loader->boot_device);
+
+	return setup_fat(
+		&loader->fat,
+		loader->system,
+		disk_io,
+		block_io->media->media_id,
+		block_io->media->block_size);
+}
+
+/* Find where the module file is on the boot volume. The extents are
+ * relative to the partition, in blocks of the boot device. Failures are
+ * not fatal, the module can still be read through the firmware. */
+static efi_status_t map_module(
 	struct loader *loader,
-	struct efi_file_protocol *file,
-	const char *name)
+	const struct module *module,
+	struct extent **extent,
+	size_t *extents,
+	uint64_t *size)
 {
 	efi_status_t status = EFI_SUCCESS;
-	struct efi_guid guid = EFI_FILE_INFO_GUID;
-	void *addr = NULL;
-	struct efi_file_info file_info;
-	efi_uint_t size;
+	uint32_t cluster;
 
-	size = sizeof(file_info);
-	status = file->get_info(
-		file,
-		&guid,
-		&size,
-		(void *)&file_info);
+	*extent = NULL;
+	*extents = 0;
+
+	status = fat_lookup(&loader->fat, module->path, &cluster, size);
 	if (status != EFI_SUCCESS) {
-		err(
+		info(
 			loader->system,
-			"failed to find module file size\r\n");
+			"failed to find module %w on the boot volume\r\n",
+			module->path);
 		return status;
 	}
 
-	status = loader->system->boot->allocate_pool(
-		EFI_LOADER_DATA,
-		file_info.file_size,
-		&addr);
+	status = fat_extents(&loader->fat, cluster, *size, NULL, extents);
+	if (status != EFI_SUCCESS) {
+		info(
+			loader->system,
+			"failed to map module %w on the boot volume\r\n",
+			module->path);
+		return status;
+	}
+
+	if (*extents == 0)
+		return EFI_SUCCESS;
+
+	status = arena_alloc(
+		&loader->arena,
+		*extents * sizeof(struct extent),
+		(void **)extent);
 	if (status != EFI_SUCCESS) {
 		err(
 			loader->system,
-			"failed to allocate memory for module\r\n");
+			"failed to allocate buffer for module extents\r\n");
+		return status;
+	}
+
+	status = fat_extents(&loader->fat, cluster, *size, *extent, extents);
+	if (status != EFI_SUCCESS) {
+		info(
+			loader->system,
+			"failed to map module %w on the boot volume\r\n",
+			module->path);
 		return status;
 	}
+	return EFI_SUCCESS;
+}
+
+static efi_status_t load_lazy_module(
+	struct loader *loader,
+	const struct module *module)
+{
+	efi_status_t status = EFI_SUCCESS;
+	struct extent *extent;
+	size_t extents;
+	uint64_t size;
+
+	status = map_module(loader, module, &extent, &extents, &size);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	/* FAT reports extents relative to the partition, but the kernel will
+	 * not necessarily know where the partition starts. */
+	for (size_t i = 0; i < extents; ++i)
+		extent[i].lba += loader->boot_device.partition_start;
+
+	return add_lazy(loader, module->name, size, extent, extents);
+}
+
+#ifdef FAT_FALLBACK
+/* Read the module from the boot volume through its extents, bypassing the
+ * firmware file system driver. It's only used when the loader is built
+ * with FAT_FALLBACK and the driver fails to open the module. The disk
+ * protocol is opened on the partition, so the extents are used as FAT
+ * reports them. */
+static efi_status_t load_module_blocks(
+	struct loader *loader,
+	const struct module *module)
+{
+	efi_status_t status = EFI_SUCCESS;
+	struct block_source source;
+	struct extent *extent;
+	size_t extents;
+	uint64_t size;
+
+	status = map_module(loader, module, &extent, &extents, &size);
+	if (status != EFI_SUCCESS)
+		return status;
 
-	status = efi_read_fixed(
+	setup_block_source(
+		&source,
 		loader->system,
-		file,
-		/* offset */0,
-		/* size */file_info.file_size,
-		addr);
+		loader->fat.disk,
+		loader->fat.media_id,
+		loader->fat.block_size,
+		extent,
+		extents,
+		size);
+	return load_module(loader, &source.source, module);
+}
+#endif
+
+/* The boot volume is only needed for lazy modules and, with FAT_FALLBACK,
+ * for the modules the firmware fails to open, so it's set up on the first
+ * use, at most once. */
+static bool boot_volume_ready(struct loader *loader)
+{
+	if (!loader->boot_device_probed) {
+		loader->boot_device_probed = true;
+		if (setup_boot_device(loader) == EFI_SUCCESS)
+			loader->boot_device_ready = true;
+	}
+	return loader->boot_device_ready;
+}
+
+static bool has_lazy_modules(const struct loader *loader)
+{
+	for (size_t i = 0; i < loader->modules; ++i) {
+		if (loader->has_heap && i == loader->heap_module)
+			continue;
+		if (loader->module[i].lazy)
+			return true;
+	}
+	return false;
+}
+
+/* The heap is a module without a file, it only has the size and the
+ * placement attributes. The pages belong to the kernel unless the config
+ * says otherwise. */
+static efi_status_t allocate_heap(struct loader *loader)
+{
+	const uint64_t page_size = 4096;
+	const struct module *heap = find_module(loader, "heap");
+	struct module module;
+	uint64_t size, addr;
+	efi_status_t status;
+
+	if (heap == NULL)
+		return EFI_SUCCESS;
+
+	if (!parse_size(heap->path, &size) || size == 0
+			|| size > UINT64_MAX - page_size) {
+		err(loader->system, "invalid heap size\r\n");
+		return EFI_INVALID_PARAMETER;
+	}
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	module = *heap;
+	if (module.type == LOADER_MODULE_MEMORY)
+		module.type = LOADER_KERNEL_MEMORY;
+
+	status = allocate_module(loader, &module, size, &addr);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	status = reserve(loader, heap->name, addr, addr + size);
 	if (status != EFI_SUCCESS) {
 		err(
 			loader->system,
-			"failed to read module in memory\r\n");
+			"failed to mark heap memory as reserved\r\n");
 		return status;
 	}
 
-	status = reserve(
-		loader,
-		name,
-		(uint64_t)addr,
-		(uint64_t)addr + file_info.file_size);
+	/* Lazy heap is left for the kernel to zero when it needs to. */
+	if (!heap->lazy) {
+		memset((void *)addr, 0, size);
+		loader->heap.flags = MANIFEST_HEAP_ZEROED;
+	}
+
+	loader->has_heap = true;
+	loader->heap_module = heap - loader->module;
+	loader->heap.begin = addr;
+	loader->heap.end = addr + size;
+	return EFI_SUCCESS;
+}
+
+/* Once all the modules are loaded, the only parts of the bundle anybody
+ * needs are the modules used in place, and only those have records in the
+ * manifest. The rest of the bundle, i.e. the headers, the kernel file and
+ * the modules copied out, is returned to the firmware, so that it doesn't
+ * stay behind as module memory nobody can identify. Pages shared with a
+ * module used in place are kept. */
+static efi_status_t release_bundle(struct loader *loader)
+{
+	const uint64_t page_size = 4096;
+	const uint64_t begin = (uint64_t)loader->bundle;
+	const uint64_t end = begin + loader->bundle_size;
+	const size_t pages = loader->bundle_size / page_size;
+	efi_status_t status;
+	uint8_t *used;
+
+	if (loader->bundle_size == 0)
+		return EFI_SUCCESS;
+
+	status = arena_alloc(&loader->arena, pages, (void **)&used);
 	if (status != EFI_SUCCESS) {
 		err(
 			loader->system,
-			"failed to mark module memory as reserved\r\n");
+			"failed to allocate buffer for bundle pages\r\n");
 		return status;
 	}
+	memset(used, 0, pages);
+
+	for (size_t i = 0; i < loader->reserves; ++i) {
+		const struct reserve *r = &loader->reserve[i];
+		const uint64_t from = r->begin > begin ? r->begin : begin;
+		const uint64_t to = r->end < end ? r->end : end;
+
+		if (from >= to)
+			continue;
+
+		for (size_t page = (from - begin) / page_size;
+				page < (to - begin + page_size - 1) / page_size;
+				++page)
+			used[page] = 1;
+	}
+
+	for (size_t page = 0; page < pages;) {
+		size_t run = 0;
+
+		if (used[page]) {
+			++page;
+			continue;
+		}
+
+		while (page + run < pages && !used[page + run])
+			++run;
+
+		status = loader->system->boot->free_pages(
+			begin + page * page_size, run);
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to free unused bundle memory\r\n");
+			return status;
+		}
+		page += run;
+	}
+
+	loader->bundle = NULL;
+	loader->bundle_size = 0;
 	return EFI_SUCCESS;
 }
 
 efi_status_t load_modules(struct loader *loader)
 {
+	efi_status_t status = allocate_heap(loader);
+
+	if (status != EFI_SUCCESS)
+		return status;
+
+	if (has_lazy_modules(loader)) {
+		if (!boot_volume_ready(loader))
+			info(
+				loader->system,
+				"boot volume cannot be mapped, lazy modules will be loaded in memory\r\n");
+	}
+
 	for (size_t i = 0; i < loader->modules; ++i) {
-		efi_status_t status = EFI_SUCCESS;
 		struct efi_file_protocol *file = NULL;
+		struct memory_source memory;
+		struct file_source source;
 
 		if (i == loader->kernel)
 			continue;
 
-		status = loader->rootdir->open(
-			loader->rootdir,
-			&file,
-			(uint16_t *)loader->module[i].path,
-			EFI_FILE_MODE_READ,
-			EFI_FILE_READ_ONLY);
+		if (loader->has_bundle && i == loader->bundle_module)
+			continue;
+
+		if (loader->has_heap && i == loader->heap_module)
+			continue;
+
+		if (find_bundle_source(
+				loader, loader->module[i].path, &memory)) {
+			status = load_module(
+				loader, &memory.source, &loader->module[i]);
+			if (status != EFI_SUCCESS) {
+				err(
+					loader->system,
+					"failed to load module\r\n");
+				return status;
+			}
+			continue;
+		}
+
+		/* A lazy module that cannot be mapped is loaded in memory,
+		 * just like when the boot volume itself cannot be mapped. */
+		if (loader->module[i].lazy && loader->boot_device_ready) {
+			if (load_lazy_module(loader, &loader->module[i])
+					== EFI_SUCCESS)
+				continue;
+			info(
+				loader->system,
+				"lazy module %s will be loaded in memory\r\n",
+				loader->module[i].name);
+		}
+
+		status = open_file(loader, loader->module[i].path, &file);
+#ifdef FAT_FALLBACK
+		if (status != EFI_SUCCESS && boot_volume_ready(loader)) {
+			info(
+				loader->system,
+				"failed to open module file: %llu, reading it from the boot volume\r\n",
+				(unsigned long long)status);
+			if (load_module_blocks(loader, &loader->module[i])
+					== EFI_SUCCESS)
+				continue;
+		}
+#endif
+
+		if (status != EFI_SUCCESS) {
+			err(
+				loader->system,
+				"failed to open module file: %llu\r\n",
+				(unsigned long long)status);
+			return status;
+		}
+
+		status = setup_file_source(&source, loader->system, file);
 		if (status != EFI_SUCCESS) {
 			err(
 				loader->system,
-				"failed to open module file\r\n");
+				"failed to find module file size\r\n");
 			return status;
 		}
 
-		status = load_module(loader, file, loader->module[i].name);
+		status = load_module(loader, &source.source, &loader->module[i]);
 		if (status != EFI_SUCCESS) {
 			err(
 				loader->system,
@@ -477,63 +1823,107 @@ efi_status_t load_modules(struct loader *loader)
 		}
 	}
 
-	return EFI_SUCCESS;
+	return release_bundle(loader);
 }
 
+/* The memory map is read directly into the manifest, which is allocated
+ * with some slack for the descriptors the allocations themselves might add
+ * before the final get_memory_map, so exit_boot_services normally succeeds
+ * on the first try. */
 static efi_status_t exit_efi_boot_services(struct loader *loader)
 {
-	struct efi_memory_descriptor *mmap;
-	efi_uint_t mmap_size = 4096;
+	const efi_uint_t slack = 16;
+	struct efi_boot_table *boot = loader->system->boot;
+	efi_uint_t mmap_size = 0;
 	efi_uint_t mmap_key;
-	efi_uint_t desc_size;
 	uint32_t desc_version;
 	efi_status_t status;
 
-	while (1) {
-		status = loader->system->boot->allocate_pool(
-			EFI_LOADER_DATA,
-			mmap_size,
-			(void **)&mmap);
-		if (status != EFI_SUCCESS)
-			return status;
+	status = boot->get_memory_map(
+		&mmap_size, NULL, &mmap_key, &loader->desc_size, &desc_version);
+	if (status != EFI_BUFFER_TOO_SMALL) {
+		err(
+			loader->system,
+			"failed to get the memory map size\r\n");
+		return status == EFI_SUCCESS ? EFI_LOAD_ERROR : status;
+	}
+
+	if (loader->desc_size < sizeof(struct efi_memory_descriptor)) {
+		err(
+			loader->system,
+			"unsupported memory descriptor size %llu\r\n",
+			(unsigned long long)loader->desc_size);
+		return EFI_UNSUPPORTED;
+	}
 
-		status = loader->system->boot->get_memory_map(
-			&mmap_size,
-			mmap,
-			&mmap_key,
-			&desc_size,
+	status = build_manifest(
+		loader, mmap_size + slack * loader->desc_size);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	/* Everything the kernel needs is in the manifest by now. */
+	close_directories(loader);
+	status = arena_release(&loader->arena);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	while (1) {
+		loader->mmap_size = loader->mmap_capacity;
+		status = boot->get_memory_map(
+			&loader->mmap_size,
+			loader->mmap,
+			&loader->mmap_key,
+			&loader->desc_size,
 			&desc_version);
 		if (status == EFI_SUCCESS)
 			break;
 
-		loader->system->boot->free_pool(mmap);
-
-		// If the buffer size turned out too small then get_memory_map
-		// should have updated mmap_size to contain the buffer size
-		// needed for the memory map. However subsequent free_pool and
-		// allocate_pool might change the memory map and therefore I
-		// additionally multiply it by 2.
-		if (status == EFI_BUFFER_TOO_SMALL) {
-			mmap_size *= 2;
-			continue;
+		if (status != EFI_BUFFER_TOO_SMALL) {
+			err(
+				loader->system,
+				"failed to get the memory map\r\n");
+			return status;
 		}
 
-		return status;
+		status = grow_manifest(
+			loader, loader->mmap_size + slack * loader->desc_size);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	status = boot->exit_boot_services(loader->handle, loader->mmap_key);
+
+	/* The map might still change between get_memory_map and
+	 * exit_boot_services, e.g. because of a timer event. After a failed
+	 * exit_boot_services we can only get the memory map and try again,
+	 * the buffer we have is large enough for that. */
+	for (int retry = 0; retry < 4 && status == EFI_INVALID_PARAMETER;
+			++retry) {
+		loader->mmap_size = loader->mmap_capacity;
+		status = boot->get_memory_map(
+			&loader->mmap_size,
+			loader->mmap,
+			&loader->mmap_key,
+			&loader->desc_size,
+			&desc_version);
+		if (status != EFI_SUCCESS)
+			break;
+		status = boot->exit_boot_services(
+			loader->handle, loader->mmap_key);
 	}
 
-	status = loader->system->boot->exit_boot_services(
-		loader->handle,
-		mmap_key);
 	if (status != EFI_SUCCESS)
-		loader->system->boot->free_pool(mmap);
+		return status;
 
-	return status;
+	finish_manifest(loader);
+	return EFI_SUCCESS;
 }
 
 efi_status_t start_kernel(struct loader *loader)
 {
 	efi_status_t status = EFI_SUCCESS;
-	void (ELFABI *entry)(struct reserve *, size_t);
+	void (ELFABI *entry)(const struct manifest_header *);
+	struct manifest_timer *timer;
 
 	info(loader->system, "Shutting down UEFI boot services\r\n");
 	status = exit_efi_boot_services(loader);
@@ -542,9 +1932,14 @@ efi_status_t start_kernel(struct loader *loader)
 
 	/* If we got this far there is no way back since all the EFI services
 	 * have been shut down by this point. */
-	entry = (void (ELFABI *)(struct reserve *, size_t))
+	timer = (struct manifest_timer *)((char *)loader->manifest
+		+ loader->timer_section + sizeof(struct manifest_section));
+	check_cpus(loader, timer->frequency);
+
+	entry = (void (ELFABI *)(const struct manifest_header *))
 		loader->kernel_image_entry;
-	(*entry)(loader->reserve, loader->reserves);
+	timer->handoff = read_counter();
+	(*entry)(loader->manifest);
 
 	while (1) {}
 	return EFI_LOAD_ERROR;
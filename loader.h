@@ -4,64 +4,244 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#include "arena.h"
+#include "bundle.h"
+#include "console.h"
 #include "efi/efi.h"
 #include "elf.h"
+#include "fat.h"
+#include "io.h"
+#include "manifest.h"
+#include "memmap.h"
+#include "numa.h"
+#include "plan.h"
+#include "prelaid.h"
+#include "timer.h"
 
 
 /* Each module describes a file that should be loaded in memory. Some files
  * might require a somewhat involved loading process, like for example ELF
  * binaries, but most of them will be opaque data blobs for the loader. The
  * only goal for the loader is to just read it in memory and pass on to the
- * ELF binary. */
+ * ELF binary.
+ *
+ * Modules marked as lazy are not read in memory at all, instead the loader
+ * passes the location of the file on the boot device to the kernel.
+ *
+ * The rest of the fields describe where in memory the module should be
+ * placed: align and below are zero when not specified, at is only used if
+ * fixed is set and type is the memory type to allocate the module pages
+ * with (LOADER_KERNEL_MEMORY or LOADER_MODULE_MEMORY by default). Node is
+ * the NUMA node to place the module on, MODULE_ANY_NODE if it doesn't
+ * matter or MODULE_LOCAL_NODE for the node of the boot CPU. The layout of
+ * this structure is a part of the precompiled config format (see
+ * config_bin.h). */
 struct module {
 	const uint16_t *path;
 	const char *name;
+	bool lazy;
+	bool fixed;
+	uint32_t type;
+	uint64_t align;
+	uint64_t below;
+	uint64_t at;
+	uint32_t node;
 };
 
+#define MODULE_ANY_NODE 0xffffffffU
+#define MODULE_LOCAL_NODE 0xfffffffeU
+
+/* Memory types the kernel will see in the memory map for the memory the
+ * loader allocated, all of them are in the range UEFI leaves for the OS.
+ * The kernel image and the modules (including the bundle) have to be kept,
+ * while the loader bookkeeping can be reclaimed. The only reclaimable
+ * memory left at handoff is the manifest, which the kernel can reuse once
+ * it's done with it. */
+#define LOADER_KERNEL_MEMORY 0x80000000U
+#define LOADER_MODULE_MEMORY 0x80000001U
+#define LOADER_RECLAIM_MEMORY 0x80000002U
+
+/* Memory the loader has placed something in. The list is internal to the
+ * loader and kept in the order of reserve calls; build_manifest sorts it
+ * with sort_reserves, which rejects overlaps and merges adjacent ranges of
+ * the same module, before it describes the ranges to the kernel. */
 struct reserve {
 	const char *name;
 	uint64_t begin;
 	uint64_t end;
 };
 
+struct lazy {
+	const char *name;
+	uint64_t size;
+	struct boot_device device;
+	struct extent *extent;
+	size_t extents;
+};
+
+/* A directory opened on the way to a file, path is the prefix of the file
+ * paths naming the directory (see open_file). */
+struct directory {
+	const uint16_t *path;
+	size_t length;
+	struct efi_file_protocol *file;
+};
+
 struct loader {
 	struct efi_system_table *system;
 	efi_handle_t handle;
 	struct efi_loaded_image_protocol *image;
 	efi_handle_t root_device;
+	struct timer timer;
+	struct console console;
+
+	/* Config data, module list, reserve and lazy module arrays and all
+	 * other loader bookkeeping is allocated from the arena. Everything the
+	 * kernel needs is copied into the manifest, so the whole arena is
+	 * released before exiting the boot services. */
+	struct arena arena;
+
+	/* NUMA topology, only looked at if a module asks for a node. */
+	struct numa numa;
+
+	/* The root directory is opened on the first use, so that we don't
+	 * touch the file system at all if everything is embedded. */
 	struct efi_simple_file_system_protocol *rootfs;
 	struct efi_file_protocol *rootdir;
 
+	/* Directories are opened once and kept open, so that files are
+	 * opened relative to their directory instead of walking the whole
+	 * path from the root every time. */
+	struct directory *directory;
+	size_t directory_capacity;
+	size_t directories;
+
+	/* The config data must be writable, since the parser terminates the
+	 * module names in place. */
 	struct efi_file_protocol *config;
-	const char *config_data;
+	char *config_data;
+	uint64_t config_size;
+
+	/* Set while checking if the load options are a config, options that
+	 * aren't don't produce errors. */
+	bool config_probe;
 
 	/* The list of modules that have to be loaded according to the config
 	 * file. One of them is a dedicated ELF kernel binary that we will
 	 * pass control to after loading. */
 	struct module *module;
-	size_t module_capacity;
 	size_t modules;
 	size_t kernel;
 
-	/* Bookkeeping information for loading ELF binary in memory. */
-	struct efi_file_protocol *kernel_image;
+	/* Open addressing hash index of the module names, each slot holds
+	 * either zero or the module position plus one. */
+	size_t *module_index;
+	size_t module_index_size;
+
+	/* Optional bundle with some or all of the modules. Modules found in
+	 * the bundle are not loaded separately, they are referenced in place
+	 * in the bundle memory instead, unless the bundle is embedded in the
+	 * loader image, which the kernel doesn't keep. */
+	bool has_bundle;
+	size_t bundle_module;
+	const struct bundle_header *bundle;
+	/* Size of the memory load_bundle allocated for the bundle, 0 when the
+	 * bundle is embedded in the loader image (see release_bundle). */
+	uint64_t bundle_size;
+
+	/* Optional early kernel heap, the path of the "heap" entry is its
+	 * size (see allocate_heap). */
+	bool has_heap;
+	size_t heap_module;
+	struct manifest_heap heap;
+
+	/* Bookkeeping information for loading ELF binary in memory. The kernel
+	 * is read from kernel_source, which points either to kernel_file or,
+	 * when the kernel comes from the bundle, to kernel_memory. Program
+	 * headers might point right into the bundle. */
+	struct file_source kernel_file;
+	struct memory_source kernel_memory;
+	struct source *kernel_source;
 	struct elf64_ehdr kernel_header;
-	struct elf64_phdr *program_headers;
+	const struct elf64_phdr *program_headers;
 	uint64_t kernel_image_entry;
 
+	/* ELF headers of the kernel file saved on a previous boot, so that
+	 * they don't have to be read and checked again (see find_plan). */
+	struct plan plan;
+
 	struct reserve *reserve;
 	size_t reserve_capacity;
 	size_t reserves;
+
+	/* Lazy modules are mapped on the boot device using the FAT structures
+	 * directly, and with FAT_FALLBACK the modules the firmware fails to
+	 * open are read through the same mapping. The boot device is probed once, when it's first
+	 * needed, and boot_device_ready tells if we managed to set it up. */
+	bool boot_device_probed;
+	bool boot_device_ready;
+	struct boot_device boot_device;
+	struct fat fat;
+
+	struct lazy *lazy;
+	size_t lazy_capacity;
+	size_t lazies;
+
+	/* CPUs as the firmware MP services see them, mailbox is the address
+	 * of the mailbox the CPU was started on or zero (see start_cpus). */
+	struct manifest_cpu *cpu;
+	size_t cpus;
+
+	/* The boot manifest passed to the kernel (see manifest.h). The memory
+	 * map is the last section of the manifest, the raw memory map is read
+	 * directly into the section and converted into the memory ranges in
+	 * place after exiting the boot services. Sections the loader fills in
+	 * later are kept as offsets, since the manifest might be moved (see
+	 * grow_manifest). */
+	struct manifest_header *manifest;
+	uint64_t manifest_pages;
+	uint64_t timer_section;
+	uint64_t cpus_section;
+	uint64_t mmap_section;
+	struct efi_memory_descriptor *mmap;
+	efi_uint_t mmap_capacity;
+	efi_uint_t mmap_size;
+	efi_uint_t mmap_key;
+	efi_uint_t desc_size;
 };
 
+/* Prepare the loader structure. If the loader image has the config and the
+ * bundle embedded (see embed.S) they are found here, and the file system is
+ * not touched until a file that isn't embedded has to be opened. */
 efi_status_t setup_loader(
 	efi_handle_t handle,
 	struct efi_system_table *system,
 	struct loader *loader);
 
+/* Returns the address of the configuration table with the given GUID, or
+ * zero if the firmware doesn't have it. */
+uint64_t find_config_table(
+	const struct efi_system_table *system,
+	struct efi_guid guid);
+
+/* Open a file for reading on the volume the loader binary was loaded from.
+ * The directories on the path are opened on the first use and cached, so
+ * the firmware only has to look up the file name in its directory. */
+efi_status_t open_file(
+	struct loader *loader,
+	const uint16_t *path,
+	struct efi_file_protocol **file);
+
+/* Close all the directories opened by open_file and the root directory.
+ * Called once before exiting the boot services. */
+void close_directories(struct loader *loader);
+
 /* Load the configuration from the specified path into memory. The path is
  * expected to point to a file in the same volume as the loader binary
- * itself. No attempts to verify/parse the config are made in this function. */
+ * itself. If the config is embedded in the loader image, or the load
+ * options of the loader image parse as a config, the file is not read.
+ * Only the load options are parsed here, to tell a config from options
+ * meant for something else; everything else is left to parse_config. */
 efi_status_t load_config(struct loader *loader, const uint16_t *config_path);
 
 /* Parse the config loaded in memory and populate the list of modules to load
@@ -69,20 +249,104 @@ efi_status_t load_config(struct loader *loader, const uint16_t *config_path);
  *
  * The format of the config is rather simplistic - it's just a combination of
  * keys and values. Values are separated from keys by ':' and the key:value
- * paris are separated from each other by whitespace characters. */
+ * paris are separated from each other by whitespace characters.
+ *
+ * A few module names have special meaning: "kernel" is the ELF binary to
+ * pass control to and "bundle" is an archive with other modules.
+ *
+ * Paths might be followed by module attributes, like "lazy" or placement
+ * directives such as "align=2M below=4G" (see parse_attribute).
+ *
+ * The config might also be precompiled by tools/mkconfig (see config_bin.h),
+ * in which case it's used in place without any parsing or allocations. */
 efi_status_t parse_config(struct loader *loader);
 
+/* Find a module by name in the index built by parse_config. Returns NULL
+ * if there is no such module. */
+const struct module *find_module(
+	const struct loader *loader,
+	const char *name);
+
+/* Parse a size written the same way as in module attributes, e.g. 256M,
+ * from a module path. Used for entries whose path is a size, like heap. */
+bool parse_size(const uint16_t *str, uint64_t *size);
+
+/* Load the bundle specified in the config, if any, into memory. The whole
+ * bundle is read with a single read into page allocated memory. Modules
+ * are later read from the bundle through memory sources (see io.h), which
+ * let them be used in place. */
+efi_status_t load_bundle(struct loader *loader);
+
 /* Load ELF binary specified in the config into memory. It's expected that 
- * this function will be called only after successfully parsing the config. */
+ * this function will be called only after successfully parsing the config.
+ * When the kernel is read from a file, the ELF headers come from the plan
+ * saved on a previous boot if the file hasn't changed since (see plan.h).
+ * Instead of ELF the kernel might be a prelaid image (see prelaid.h), which
+ * is read in memory as is. */
 efi_status_t load_kernel(struct loader *loader);
 
 /* Load all modules that are not kernel ELF images if any. It's expected that
- * this function will be called only after successfully parsing the config. */
+ * this function will be called only after successfully parsing the config.
+ *
+ * If the config has a "heap" entry, like "heap: 256M align=2M", a zeroed
+ * range of that size is allocated for the kernel early heap instead of
+ * loading a file.
+ *
+ * Lazy modules are not loaded, instead we find the extents they occupy on
+ * the boot device. If the boot volume is not FAT, or it cannot be accessed
+ * directly, lazy modules are loaded in memory as any other module, and so
+ * is a lazy module that cannot be found on the boot volume.
+ *
+ * Once all the modules are loaded, the memory of the bundle that no module
+ * is used from in place is returned to the firmware. */
 efi_status_t load_modules(struct loader *loader);
 
+/* Allocate pages for a module on the node it asks for, or on the nearest
+ * node that has enough free memory if the SLIT tells the distances.
+ * Returns EFI_NOT_FOUND if there is no NUMA information or no node has
+ * the memory. */
+efi_status_t allocate_on_node(
+	struct loader *loader,
+	const struct module *module,
+	uint64_t pages,
+	uint64_t *addr);
+
+/* Start all the healthy application processors through the firmware MP
+ * services and park each of them on its own stack spinning on a mailbox
+ * (see struct manifest_mailbox), so that the kernel can release them with a
+ * single store instead of waking them up one by one. Missing MP services or
+ * CPUs that fail to start are not errors, the kernel will have to start
+ * such CPUs itself. */
+efi_status_t start_cpus(struct loader *loader);
+
+/* Check which of the CPUs survived exiting the boot services and mark them
+ * as parked in the manifest. This is called after exiting the boot
+ * services, so it must not use them. */
+void check_cpus(struct loader *loader, uint64_t frequency);
+
+/* Sort the reserved ranges by address and merge the adjacent ranges of the
+ * same module. Fails if two ranges overlap, since that means that two
+ * modules share the same memory. */
+efi_status_t sort_reserves(struct loader *loader);
+
+/* Pack the kernel, the modules and the lazy modules into the boot manifest,
+ * with mmap_capacity bytes left at the end for the memory map. The memory
+ * map section stays empty until finish_manifest. */
+efi_status_t build_manifest(struct loader *loader, efi_uint_t mmap_capacity);
+
+/* Move the manifest to a larger allocation if the memory map has grown. */
+efi_status_t grow_manifest(struct loader *loader, efi_uint_t mmap_capacity);
+
+/* Convert the memory map read into the manifest into memory ranges. This
+ * is called after exiting the boot services, so it must not use them. */
+void finish_manifest(struct loader *loader);
+
 /* Shutdown EFI services and transfer exectution control to the kernel.
  * This function is expected to be called after the kernel and the modules
- * have been loaded successfully. */
+ * have been loaded successfully.
+ *
+ * The kernel gets the boot manifest (see manifest.h) as the only argument,
+ * everything else, including the loader arena, is freed before that. */
 efi_status_t start_kernel(struct loader *loader);
 
 #endif  // __LOADER_H__
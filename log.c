@@ -4,6 +4,13 @@
 #include "efi/efi.h"
 
 
+static struct efi_simple_text_output_protocol *log_output;
+
+void set_log_output(struct efi_simple_text_output_protocol *out)
+{
+	log_output = out;
+}
+
 static void debug(
 	struct efi_simple_text_output_protocol *out,
 	const char *fmt,
@@ -12,6 +19,8 @@ static void debug(
 	uint16_t msg[512];
 
 	vsnprintf(msg, sizeof(msg), fmt, args);
+	if (log_output != NULL)
+		out = log_output;
 	out->output_string(out, msg);
 }
 
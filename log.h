@@ -2,6 +2,11 @@
 #define __LOG_H__
 
 struct efi_system_table;
+struct efi_simple_text_output_protocol;
+
+/* Send all the messages to the given output instead of the firmware
+ * consoles, or back to the firmware consoles if out is NULL. */
+void set_log_output(struct efi_simple_text_output_protocol *out);
 
 void info(struct efi_system_table *system, const char *fmt, ...);
 void err(struct efi_system_table *system, const char *fmt, ...);
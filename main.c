@@ -26,6 +26,11 @@ efi_status_t efi_main(
 	if (status != EFI_SUCCESS)
 		return status;
 
+	info(system, "Loading the bundle...\r\n");
+	status = load_bundle(&loader);
+	if (status != EFI_SUCCESS)
+		return status;
+
 	info(system, "Loading the kernel...\r\n");
 	status = load_kernel(&loader);
 	if (status != EFI_SUCCESS)
@@ -36,6 +41,11 @@ efi_status_t efi_main(
 	if (status != EFI_SUCCESS)
 		return status;
 
+	info(system, "Starting the CPUs...\r\n");
+	status = start_cpus(&loader);
+	if (status != EFI_SUCCESS)
+		return status;
+
 	info(system, "Starting the kernel...\r\n");
 	status = start_kernel(&loader);
 	if (status != EFI_SUCCESS)
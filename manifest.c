@@ -0,0 +1,480 @@
+#include "loader.h"
+
+#include "clib.h"
+#include "log.h"
+
+
+static const uint64_t MANIFEST_PAGE_SIZE = 4096;
+static const uint32_t MANIFEST_MAX_SEED = 1 << 20;
+
+static uint64_t align8(uint64_t x)
+{
+	return (x + 7) & ~(uint64_t)7;
+}
+
+static uint32_t pow2_at_least(uint64_t x)
+{
+	uint32_t size = 1;
+
+	while (size < x)
+		size *= 2;
+	return size;
+}
+
+static const char *record_name(
+	const char *base,
+	const struct manifest_header *hdr,
+	uint32_t record)
+{
+	const struct manifest_record *r = (const struct manifest_record *)
+		&base[hdr->records_offset + record * sizeof(*r)];
+
+	return &base[hdr->strings_offset + r->name];
+}
+
+/* Build the hash and displace index (see manifest_find). Names are grouped
+ * into buckets and, starting from the largest bucket, we look for a seed
+ * that puts all the names of the bucket into free slots. With at least
+ * twice as many slots as names a few tries per bucket are usually enough. */
+static efi_status_t build_index(
+	struct loader *loader,
+	char *base,
+	const struct manifest_header *hdr)
+{
+	const uint32_t buckets = hdr->index_buckets;
+	const uint32_t slots = hdr->index_slots;
+	uint32_t *seed = (uint32_t *)&base[hdr->index_offset];
+	uint32_t *slot = &seed[buckets];
+	uint32_t *start, *fill, *key;
+	uint32_t max_size = 0;
+	efi_status_t status;
+
+	status = arena_alloc(
+		&loader->arena,
+		(2 * (size_t)buckets + 1 + hdr->records) * sizeof(uint32_t),
+		(void **)&start);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to allocate buffer for the manifest index\r\n");
+		return status;
+	}
+	fill = &start[buckets + 1];
+	key = &fill[buckets];
+
+	memset(start, 0, (buckets + 1) * sizeof(uint32_t));
+	memset(seed, 0, buckets * sizeof(uint32_t));
+	memset(slot, 0xff, slots * sizeof(uint32_t));
+
+	for (uint32_t i = 0; i < hdr->records; ++i) {
+		const char *name = record_name(base, hdr, i);
+
+		++start[(manifest_hash(name, 0) & (buckets - 1)) + 1];
+	}
+
+	for (uint32_t b = 0; b < buckets; ++b) {
+		if (start[b + 1] > max_size)
+			max_size = start[b + 1];
+		start[b + 1] += start[b];
+		fill[b] = start[b];
+	}
+
+	for (uint32_t i = 0; i < hdr->records; ++i) {
+		const char *name = record_name(base, hdr, i);
+
+		key[fill[manifest_hash(name, 0) & (buckets - 1)]++] = i;
+	}
+
+	for (uint32_t size = max_size; size > 0; --size) {
+		for (uint32_t b = 0; b < buckets; ++b) {
+			const uint32_t *bucket = &key[start[b]];
+			uint32_t s;
+
+			if (start[b + 1] - start[b] != size)
+				continue;
+
+			for (s = 1; s < MANIFEST_MAX_SEED; ++s) {
+				uint32_t placed = 0;
+
+				for (; placed < size; ++placed) {
+					const char *name = record_name(
+						base, hdr, bucket[placed]);
+					const uint64_t pos =
+						manifest_hash(name, s) & (slots - 1);
+
+					if (slot[pos] != MANIFEST_NO_RECORD)
+						break;
+					slot[pos] = bucket[placed];
+				}
+
+				if (placed == size)
+					break;
+
+				while (placed-- > 0) {
+					const char *name = record_name(
+						base, hdr, bucket[placed]);
+
+					slot[manifest_hash(name, s) & (slots - 1)] =
+						MANIFEST_NO_RECORD;
+				}
+			}
+
+			if (s == MANIFEST_MAX_SEED) {
+				err(
+					loader->system,
+					"failed to build the manifest index\r\n");
+				return EFI_LOAD_ERROR;
+			}
+			seed[b] = s;
+		}
+	}
+
+	return EFI_SUCCESS;
+}
+
+/* The kernel gets the firmware tables from the configuration table, so it
+ * doesn't have to scan memory for them. Returns the number of tables found,
+ * missing tables are left zero. */
+static size_t find_platform_tables(
+	const struct efi_system_table *system,
+	uint64_t *table)
+{
+	struct efi_guid acpi20 = EFI_ACPI_20_TABLE_GUID;
+	struct efi_guid acpi = EFI_ACPI_TABLE_GUID;
+	struct efi_guid smbios3 = EFI_SMBIOS3_TABLE_GUID;
+	struct efi_guid dtb = EFI_DTB_TABLE_GUID;
+	size_t found = 0;
+
+	table[0] = find_config_table(system, acpi20);
+	if (table[0] == 0)
+		table[0] = find_config_table(system, acpi);
+	table[1] = find_config_table(system, smbios3);
+	table[2] = find_config_table(system, dtb);
+
+	for (size_t i = 0; i < 3; ++i) {
+		if (table[i] != 0)
+			++found;
+	}
+	return found;
+}
+
+static struct manifest_section *add_section(
+	char *base,
+	struct manifest_header *hdr,
+	uint64_t *offset,
+	uint32_t type,
+	uint64_t size)
+{
+	struct manifest_section *section =
+		(struct manifest_section *)&base[*offset];
+
+	section->type = type;
+	section->size = size;
+	*offset = align8(*offset + sizeof(*section) + size);
+	++hdr->sections;
+	return section;
+}
+
+efi_status_t build_manifest(struct loader *loader, efi_uint_t mmap_capacity)
+{
+	static const uint32_t platform_section[] = {
+		MANIFEST_SECTION_ACPI_RSDP,
+		MANIFEST_SECTION_SMBIOS3,
+		MANIFEST_SECTION_DEVICETREE,
+	};
+	size_t records;
+	struct manifest_framebuffer framebuffer;
+	bool has_framebuffer;
+	uint64_t platform[3];
+	size_t platform_tables;
+	struct manifest_header *hdr;
+	struct manifest_record *record;
+	struct manifest_extent *extent = NULL;
+	struct manifest_section *section;
+	struct manifest_timer *timer;
+	uint64_t strings_size = 0;
+	uint64_t extents = 0;
+	uint64_t offset, pos;
+	efi_status_t status;
+	uint64_t addr;
+	char *base;
+
+	/* Records of the modules in memory go sorted by address. */
+	status = sort_reserves(loader);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	records = loader->reserves + loader->lazies;
+	for (size_t i = 0; i < loader->reserves; ++i)
+		strings_size += strlen(loader->reserve[i].name) + 1;
+	for (size_t i = 0; i < loader->lazies; ++i) {
+		strings_size += strlen(loader->lazy[i].name) + 1;
+		extents += loader->lazy[i].extents;
+	}
+
+	if (records >= MANIFEST_NO_RECORD || strings_size > UINT32_MAX) {
+		err(loader->system, "too many modules for the manifest\r\n");
+		return EFI_UNSUPPORTED;
+	}
+
+	platform_tables = find_platform_tables(loader->system, platform);
+	has_framebuffer = find_framebuffer(loader->system, &framebuffer);
+
+	/* The whole layout has to be known in advance, since the memory map
+	 * goes at the end of the manifest. */
+	offset = align8(sizeof(*hdr));
+	offset = align8(offset + records * sizeof(*record));
+	offset = align8(offset + strings_size);
+	offset = align8(offset
+		+ ((uint64_t)pow2_at_least((records + 3) / 4)
+			+ pow2_at_least(2 * records)) * sizeof(uint32_t));
+	if (loader->lazies != 0) {
+		offset = align8(
+			offset
+			+ sizeof(struct manifest_section)
+			+ sizeof(struct boot_device));
+		offset = align8(
+			offset
+			+ sizeof(struct manifest_section)
+			+ extents * sizeof(*extent));
+	}
+	offset += platform_tables
+		* align8(sizeof(struct manifest_section) + sizeof(uint64_t));
+	offset = align8(
+		offset
+		+ sizeof(struct manifest_section)
+		+ sizeof(struct manifest_timer));
+	if (loader->cpus != 0) {
+		offset = align8(
+			offset
+			+ sizeof(struct manifest_section)
+			+ loader->cpus * sizeof(struct manifest_cpu));
+	}
+	if (loader->has_heap) {
+		offset = align8(
+			offset
+			+ sizeof(struct manifest_section)
+			+ sizeof(struct manifest_heap));
+	}
+	if (has_framebuffer) {
+		offset = align8(
+			offset
+			+ sizeof(struct manifest_section)
+			+ sizeof(struct manifest_framebuffer));
+	}
+	loader->mmap_section = offset;
+	offset += sizeof(struct manifest_section);
+
+	loader->manifest_pages =
+		(offset + mmap_capacity + MANIFEST_PAGE_SIZE - 1)
+		/ MANIFEST_PAGE_SIZE;
+	status = loader->system->boot->allocate_pages(
+		EFI_ALLOCATE_ANY_PAGES,
+		(enum efi_memory_type)LOADER_RECLAIM_MEMORY,
+		loader->manifest_pages,
+		&addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to allocate memory for the manifest\r\n");
+		return status;
+	}
+
+	base = (char *)addr;
+	memset(base, 0, offset);
+	loader->manifest = (struct manifest_header *)base;
+	loader->mmap = (struct efi_memory_descriptor *)&base[offset];
+	loader->mmap_capacity =
+		loader->manifest_pages * MANIFEST_PAGE_SIZE - offset;
+
+	hdr = loader->manifest;
+	memcpy(hdr->magic, MANIFEST_MAGIC, sizeof(hdr->magic));
+	hdr->version = MANIFEST_VERSION;
+	hdr->header_size = sizeof(*hdr);
+	hdr->records = (uint32_t)records;
+	hdr->resident_records = (uint32_t)loader->reserves;
+	hdr->record_size = sizeof(*record);
+	hdr->records_offset = align8(sizeof(*hdr));
+	hdr->strings_offset =
+		align8(hdr->records_offset + records * sizeof(*record));
+	hdr->strings_size = strings_size;
+	hdr->index_buckets = pow2_at_least((records + 3) / 4);
+	hdr->index_slots = pow2_at_least(2 * records);
+	hdr->index_offset = align8(hdr->strings_offset + strings_size);
+	hdr->sections_offset = align8(
+		hdr->index_offset
+		+ ((uint64_t)hdr->index_buckets + hdr->index_slots)
+			* sizeof(uint32_t));
+
+	record = (struct manifest_record *)&base[hdr->records_offset];
+	pos = 0;
+	for (size_t i = 0; i < loader->reserves; ++i) {
+		const struct reserve *r = &loader->reserve[i];
+		const size_t size = strlen(r->name);
+
+		record[i].begin = r->begin;
+		record[i].end = r->end;
+		record[i].size = r->end - r->begin;
+		record[i].name = (uint32_t)pos;
+		record[i].name_size = (uint32_t)size;
+		record[i].type =
+			r->name == loader->module[loader->kernel].name
+				? MANIFEST_KERNEL
+				: MANIFEST_MODULE;
+		memcpy(&base[hdr->strings_offset + pos], r->name, size + 1);
+		pos += size + 1;
+	}
+
+	offset = hdr->sections_offset;
+	if (loader->lazies != 0) {
+		section = add_section(
+			base, hdr, &offset,
+			MANIFEST_SECTION_BOOT_DEVICE,
+			sizeof(struct boot_device));
+		memcpy(&section[1], &loader->boot_device, sizeof(struct boot_device));
+
+		section = add_section(
+			base, hdr, &offset,
+			MANIFEST_SECTION_EXTENTS,
+			extents * sizeof(*extent));
+		extent = (struct manifest_extent *)&section[1];
+	}
+
+	for (size_t i = 0; i < loader->lazies; ++i) {
+		const struct lazy *lazy = &loader->lazy[i];
+		struct manifest_record *r = &record[loader->reserves + i];
+		const size_t size = strlen(lazy->name);
+
+		r->size = lazy->size;
+		r->name = (uint32_t)pos;
+		r->name_size = (uint32_t)size;
+		r->type = MANIFEST_LAZY;
+		r->extents = (uint32_t)lazy->extents;
+		r->extent = (uint64_t)((char *)extent - base);
+		memcpy(&base[hdr->strings_offset + pos], lazy->name, size + 1);
+		pos += size + 1;
+
+		for (size_t j = 0; j < lazy->extents; ++j) {
+			extent->lba = lazy->extent[j].lba;
+			extent->blocks = lazy->extent[j].blocks;
+			++extent;
+		}
+	}
+
+	for (size_t i = 0; i < 3; ++i) {
+		if (platform[i] == 0)
+			continue;
+
+		section = add_section(
+			base, hdr, &offset,
+			platform_section[i],
+			sizeof(uint64_t));
+		memcpy(&section[1], &platform[i], sizeof(uint64_t));
+	}
+
+	/* The handoff timestamp is only filled in right before we jump to the
+	 * kernel (see start_kernel). */
+	loader->timer_section = offset;
+	section = add_section(
+		base, hdr, &offset,
+		MANIFEST_SECTION_TIMER,
+		sizeof(struct manifest_timer));
+	timer = (struct manifest_timer *)&section[1];
+	timer->frequency = timer_frequency(&loader->timer, loader->system);
+	timer->start = loader->timer.start;
+
+	/* CPUs are only marked as parked once we know they are still there
+	 * after exiting the boot services (see check_cpus). */
+	loader->cpus_section = 0;
+	if (loader->cpus != 0) {
+		loader->cpus_section = offset;
+		section = add_section(
+			base, hdr, &offset,
+			MANIFEST_SECTION_CPUS,
+			loader->cpus * sizeof(struct manifest_cpu));
+		memcpy(
+			&section[1],
+			loader->cpu,
+			loader->cpus * sizeof(struct manifest_cpu));
+	}
+
+	if (loader->has_heap) {
+		section = add_section(
+			base, hdr, &offset,
+			MANIFEST_SECTION_HEAP,
+			sizeof(struct manifest_heap));
+		memcpy(
+			&section[1],
+			&loader->heap,
+			sizeof(struct manifest_heap));
+	}
+
+	if (has_framebuffer) {
+		section = add_section(
+			base, hdr, &offset,
+			MANIFEST_SECTION_FRAMEBUFFER,
+			sizeof(struct manifest_framebuffer));
+		memcpy(&section[1], &framebuffer, sizeof(framebuffer));
+	}
+
+	/* The memory map must stay the last section, since it's the only one
+	 * that isn't complete until we exit the boot services. */
+	add_section(base, hdr, &offset, MANIFEST_SECTION_MEMORY_MAP, 0);
+	hdr->size = offset;
+
+	return build_index(loader, base, hdr);
+}
+
+efi_status_t grow_manifest(struct loader *loader, efi_uint_t mmap_capacity)
+{
+	const uint64_t offset = loader->mmap_section
+		+ sizeof(struct manifest_section);
+	const uint64_t pages =
+		(offset + mmap_capacity + MANIFEST_PAGE_SIZE - 1)
+		/ MANIFEST_PAGE_SIZE;
+	efi_status_t status;
+	uint64_t addr;
+
+	status = loader->system->boot->allocate_pages(
+		EFI_ALLOCATE_ANY_PAGES,
+		(enum efi_memory_type)LOADER_RECLAIM_MEMORY,
+		pages,
+		&addr);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to allocate memory for the manifest\r\n");
+		return status;
+	}
+
+	/* The manifest doesn't have any pointers inside, so it can be moved
+	 * with a plain copy. */
+	memcpy((void *)addr, loader->manifest, offset);
+	status = loader->system->boot->free_pages(
+		(uint64_t)loader->manifest, loader->manifest_pages);
+	if (status != EFI_SUCCESS) {
+		err(
+			loader->system,
+			"failed to free memory of the manifest\r\n");
+		return status;
+	}
+
+	loader->manifest = (struct manifest_header *)addr;
+	loader->manifest_pages = pages;
+	loader->mmap = (struct efi_memory_descriptor *)(addr + offset);
+	loader->mmap_capacity = pages * MANIFEST_PAGE_SIZE - offset;
+	return EFI_SUCCESS;
+}
+
+void finish_manifest(struct loader *loader)
+{
+	char *base = (char *)loader->manifest;
+	struct manifest_section *section =
+		(struct manifest_section *)&base[loader->mmap_section];
+	const size_t ranges = normalize_memory_map(
+		loader->mmap, loader->mmap_size, loader->desc_size);
+
+	section->size = ranges * sizeof(struct memory_range);
+	loader->manifest->size = align8(
+		loader->mmap_section + sizeof(*section) + section->size);
+}
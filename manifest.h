@@ -0,0 +1,283 @@
+#ifndef __MANIFEST_H__
+#define __MANIFEST_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Boot manifest is everything the loader passes on to the kernel, packed in
+ * one contiguous range of pages. The layout of the manifest is:
+ *
+ *   - manifest_header
+ *   - an array of manifest_record structures, one for each module
+ *   - string table with the names of the modules
+ *   - perfect hash index of the module names
+ *   - tagged sections, each starting with manifest_section
+ *
+ * All the offsets are relative to the beginning of the manifest and there
+ * are no pointers inside, so the kernel can copy or remap the manifest as
+ * it pleases. All regions start at 8 byte aligned offsets.
+ *
+ * Records of the modules loaded in memory, the kernel included, come first
+ * and are sorted by address, records of the lazy modules follow them.
+ *
+ * New fields are only ever added at the end of the structures, so the
+ * sizes from the header must be used to walk the arrays. New kinds of boot
+ * information are added as new section types and the kernel is expected to
+ * skip sections it doesn't know.
+ *
+ * This header is shared between the loader and the kernel. */
+
+#define MANIFEST_MAGIC "BOOTMNFT"
+#define MANIFEST_VERSION 1
+#define MANIFEST_NO_RECORD 0xffffffffU
+
+struct manifest_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t size;
+
+	uint32_t records;
+	uint32_t resident_records;
+	uint32_t record_size;
+	uint32_t sections;
+	uint64_t records_offset;
+	uint64_t strings_offset;
+	uint64_t strings_size;
+	uint64_t sections_offset;
+
+	/* The index is an array of index_buckets seeds followed by an array
+	 * of index_slots record numbers (see manifest_find). Both sizes are
+	 * powers of two. */
+	uint32_t index_buckets;
+	uint32_t index_slots;
+	uint64_t index_offset;
+};
+
+enum manifest_record_type {
+	MANIFEST_KERNEL,
+	MANIFEST_MODULE,
+	/* Lazy modules are not in memory, extent is the offset of an array of
+	 * extents the module occupies on the boot device (see
+	 * MANIFEST_SECTION_BOOT_DEVICE) and extents is their number. */
+	MANIFEST_LAZY,
+};
+
+struct manifest_record {
+	uint64_t begin;
+	uint64_t end;
+	uint64_t size;
+	uint32_t name;
+	uint32_t name_size;
+	uint32_t type;
+	uint32_t extents;
+	uint64_t extent;
+};
+
+/* A contiguous run of blocks on the boot device. */
+struct manifest_extent {
+	uint64_t lba;
+	uint64_t blocks;
+};
+
+enum manifest_section_type {
+	/* An array of struct memory_range. */
+	MANIFEST_SECTION_MEMORY_MAP = 1,
+	/* struct boot_device. */
+	MANIFEST_SECTION_BOOT_DEVICE = 2,
+	/* Extents of the lazy modules, an array of struct manifest_extent. */
+	MANIFEST_SECTION_EXTENTS = 3,
+	/* Physical addresses of the firmware tables, a single uint64_t each.
+	 * The ACPI RSDP is the ACPI 2.0 one if the firmware has it, the
+	 * revision field of the RSDP tells which one it is. */
+	MANIFEST_SECTION_ACPI_RSDP = 4,
+	MANIFEST_SECTION_SMBIOS3 = 5,
+	MANIFEST_SECTION_DEVICETREE = 6,
+	/* struct manifest_timer. */
+	MANIFEST_SECTION_TIMER = 7,
+	/* An array of struct manifest_cpu, one for each CPU the firmware
+	 * knows about. */
+	MANIFEST_SECTION_CPUS = 8,
+	/* struct manifest_heap. */
+	MANIFEST_SECTION_HEAP = 9,
+	/* struct manifest_framebuffer. */
+	MANIFEST_SECTION_FRAMEBUFFER = 10,
+};
+
+/* Size is the size of the section data that immediately follows the
+ * section header, the next section starts at the next 8 byte aligned
+ * offset after the data. */
+struct manifest_section {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t size;
+};
+
+/* Frequency of the counter the kernel is expected to use as its clock, the
+ * TSC on x86-64 and the virtual counter on aarch64, and the counter values
+ * when the loader started and right before it passed control to the
+ * kernel. Frequency is zero if the loader failed to calibrate it. */
+struct manifest_timer {
+	uint64_t frequency;
+	uint64_t start;
+	uint64_t handoff;
+};
+
+#define MANIFEST_HEAP_ZEROED 0x1
+
+/* Memory the loader set aside for the early kernel allocator, so that it
+ * can work before the kernel looks at the memory map. Unless
+ * MANIFEST_HEAP_ZEROED is set the memory isn't zeroed. The range is page
+ * aligned and is also in the records under the name "heap". */
+struct manifest_heap {
+	uint64_t begin;
+	uint64_t end;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+/* Linear framebuffer of the graphics mode the firmware left on, so that
+ * the kernel console doesn't have to set a mode. Stride is in pixels. The
+ * masks tell where the colors are in a pixel, for the firmware formats
+ * with 8 bits per color they are filled in by the loader, and the pixel
+ * size is given by the highest bit of all the masks combined. */
+struct manifest_framebuffer {
+	uint64_t base;
+	uint64_t size;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t red_mask;
+	uint32_t green_mask;
+	uint32_t blue_mask;
+	uint32_t reserved_mask;
+	uint32_t reserved;
+};
+
+#define MANIFEST_CPU_BSP 0x1
+#define MANIFEST_CPU_ENABLED 0x2
+#define MANIFEST_CPU_PARKED 0x4
+
+/* Id is the local APIC id on x86-64 and the affinity bits of MPIDR_EL1 on
+ * aarch64. If MANIFEST_CPU_PARKED is set, mailbox is the physical address
+ * of the struct manifest_mailbox the CPU spins on, otherwise the CPU is in
+ * whatever state the firmware left it and the kernel has to wake it up the
+ * usual way. */
+struct manifest_cpu {
+	uint64_t id;
+	uint64_t mailbox;
+	uint32_t flags;
+	uint32_t package;
+	uint32_t core;
+	uint32_t thread;
+};
+
+/* A parked CPU runs on a stack of stack_size bytes below stack, keeps
+ * incrementing heartbeat and waits for a non-zero entry. To release it the
+ * kernel stores argument and then entry with a release store. The CPU
+ * calls entry(argument) on the same stack using the kernel calling
+ * convention, with interrupts disabled and the page tables the firmware
+ * set up. Mailboxes, stacks and the code the CPUs spin in are in
+ * MEMORY_KERNEL memory, each mailbox takes a cache line of its own.
+ *
+ * The firmware page tables, GDT and IDT the parked CPUs still use are in
+ * memory reported as MEMORY_AVAILABLE though, so the kernel has to release
+ * the CPUs and switch them to its own tables before it reuses any of the
+ * available memory. */
+struct manifest_mailbox {
+	uint64_t entry;
+	uint64_t argument;
+	uint64_t stack;
+	uint64_t stack_size;
+	uint64_t heartbeat;
+	uint64_t reserved[3];
+};
+
+/* Describes the partition lazy modules are stored on. The kernel is
+ * supposed to find the disk using the partition signature, extents of the
+ * lazy modules are given in blocks of block_size bytes relative to the
+ * beginning of the disk, not the partition. */
+struct boot_device {
+	uint64_t block_size;
+	uint64_t partition_start;
+	uint32_t partition_number;
+	uint8_t signature_type;
+	uint8_t signature[16];
+};
+
+/* The memory map the kernel gets is a sorted array of non-overlapping
+ * ranges. Adjacent ranges of the same type are merged and the UEFI memory
+ * types are reduced to what matters for the kernel page allocator. */
+enum memory_type {
+	/* Free memory, including the memory the firmware used for boot
+	 * services. */
+	MEMORY_AVAILABLE,
+	/* Memory used by the loader, including the manifest. It can be
+	 * reused once the kernel is done with it. */
+	MEMORY_RECLAIMABLE,
+	MEMORY_KERNEL,
+	MEMORY_MODULE,
+	MEMORY_ACPI_RECLAIM,
+	MEMORY_ACPI_NVS,
+	/* UEFI runtime services code and data. */
+	MEMORY_RUNTIME,
+	MEMORY_PERSISTENT,
+	/* Everything else, including MMIO and types we don't know. */
+	MEMORY_RESERVED,
+};
+
+struct memory_range {
+	uint64_t begin;
+	uint64_t end;
+	uint32_t type;
+};
+
+/* Seeded FNV-1a with a final mix, so that the low bits used for the index
+ * depend on all the bits of the hash. */
+static inline uint64_t manifest_hash(const char *name, uint32_t seed)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+
+	while (*name != '\0') {
+		hash ^= (unsigned char)*name++;
+		hash *= 0x100000001b3ULL;
+	}
+
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+/* The name index is a hash and displace perfect hash: the name selects a
+ * bucket using seed 0, and the seed of the bucket selects the slot with the
+ * record number. Only one name maps to each slot, so a lookup takes two
+ * hashes and a single name comparison. */
+static inline const struct manifest_record *manifest_find(
+	const struct manifest_header *manifest,
+	const char *name)
+{
+	const char *base = (const char *)manifest;
+	const uint32_t *seed = (const uint32_t *)&base[manifest->index_offset];
+	const uint32_t *slot = &seed[manifest->index_buckets];
+	const uint64_t bucket =
+		manifest_hash(name, 0) & (manifest->index_buckets - 1);
+	const uint32_t pos = slot[
+		manifest_hash(name, seed[bucket]) & (manifest->index_slots - 1)];
+	const struct manifest_record *record;
+	const char *other;
+
+	if (pos == MANIFEST_NO_RECORD)
+		return NULL;
+
+	record = (const struct manifest_record *)&base[
+		manifest->records_offset + (uint64_t)pos * manifest->record_size];
+	other = &base[manifest->strings_offset + record->name];
+	while (*name != '\0' && *name == *other) {
+		++name;
+		++other;
+	}
+	return *name == *other ? record : NULL;
+}
+
+#endif  // __MANIFEST_H__
@@ -0,0 +1,85 @@
+#include "memmap.h"
+
+#include "clib.h"
+#include "loader.h"
+
+
+static const uint64_t EFI_PAGE_SIZE = 4096;
+
+static uint32_t memory_type(uint32_t efi_type)
+{
+	switch (efi_type) {
+	case EFI_CONVENTIAL_MEMORY:
+	case EFI_BOOT_SERVICES_CODE:
+	case EFI_BOOT_SERVICES_DATA:
+		return MEMORY_AVAILABLE;
+	case EFI_LOADER_CODE:
+	case EFI_LOADER_DATA:
+	case LOADER_RECLAIM_MEMORY:
+		return MEMORY_RECLAIMABLE;
+	case LOADER_KERNEL_MEMORY:
+		return MEMORY_KERNEL;
+	case LOADER_MODULE_MEMORY:
+		return MEMORY_MODULE;
+	case EFI_ACPI_RECLAIM_MEMORY:
+		return MEMORY_ACPI_RECLAIM;
+	case EFI_ACPI_MEMORY_NVS:
+		return MEMORY_ACPI_NVS;
+	case EFI_RUNTIME_SERVICES_CODE:
+	case EFI_RUNTIME_SERVICES_DATA:
+		return MEMORY_RUNTIME;
+	case EFI_PERSISTENT_MEMORY:
+		return MEMORY_PERSISTENT;
+	default:
+		return MEMORY_RESERVED;
+	}
+}
+
+size_t normalize_memory_map(void *mmap, size_t mmap_size, size_t desc_size)
+{
+	struct memory_range *range = (struct memory_range *)mmap;
+	const char *desc = (const char *)mmap;
+	size_t ranges = 0;
+	size_t merged = 0;
+
+	/* Descriptors are larger than ranges, so the range we write never
+	 * reaches the descriptors we haven't read yet. */
+	for (size_t offset = 0; offset + desc_size <= mmap_size;
+			offset += desc_size) {
+		struct efi_memory_descriptor d;
+
+		memcpy(&d, &desc[offset], sizeof(d));
+		if (d.pages == 0)
+			continue;
+
+		range[ranges].begin = d.physical_start;
+		range[ranges].end = d.physical_start + d.pages * EFI_PAGE_SIZE;
+		range[ranges].type = memory_type(d.type);
+		++ranges;
+	}
+
+	/* Firmware usually returns the map sorted or nearly sorted, so the
+	 * insertion sort takes linear time in practice. */
+	for (size_t i = 1; i < ranges; ++i) {
+		struct memory_range r = range[i];
+		size_t j = i;
+
+		while (j > 0 && range[j - 1].begin > r.begin) {
+			range[j] = range[j - 1];
+			--j;
+		}
+		range[j] = r;
+	}
+
+	for (size_t i = 0; i < ranges; ++i) {
+		if (merged > 0
+				&& range[merged - 1].end == range[i].begin
+				&& range[merged - 1].type == range[i].type) {
+			range[merged - 1].end = range[i].end;
+			continue;
+		}
+		range[merged++] = range[i];
+	}
+
+	return merged;
+}
@@ -0,0 +1,17 @@
+#ifndef __MEMMAP_H__
+#define __MEMMAP_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "efi/efi.h"
+#include "manifest.h"
+
+
+/* Convert the memory map returned by get_memory_map into an array of
+ * memory ranges in place, the buffer must be suitably aligned for struct
+ * memory_range. It doesn't call any firmware services, so it can be used
+ * after exit_boot_services. Returns the number of ranges. */
+size_t normalize_memory_map(void *mmap, size_t mmap_size, size_t desc_size);
+
+#endif  // __MEMMAP_H__
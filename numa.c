@@ -0,0 +1,414 @@
+#include "numa.h"
+
+#include "acpi.h"
+#include "clib.h"
+#include "loader.h"
+
+
+static const uint64_t NUMA_PAGE_SIZE = 4096;
+/* Memory below 1M is left alone, firmware and real mode code want it. */
+static const uint64_t NUMA_LOW_MEMORY = 0x100000;
+
+/* SRAT entries start after the table header, a revision and a reserved
+ * 64 bit field. */
+static const uint32_t SRAT_ENTRIES = 48;
+static const uint8_t SRAT_MEMORY = 1;
+static const uint32_t SRAT_ENABLED = 1;
+
+/* SLIT has the number of localities at offset 36 followed by the matrix. */
+static const uint32_t SLIT_MATRIX = 44;
+
+static uint8_t read8(const char *entry, size_t offset)
+{
+	return (uint8_t)entry[offset];
+}
+
+static uint32_t read32(const char *entry, size_t offset)
+{
+	uint32_t value;
+
+	memcpy(&value, &entry[offset], sizeof(value));
+	return value;
+}
+
+static uint64_t read64(const char *entry, size_t offset)
+{
+	uint64_t value;
+
+	memcpy(&value, &entry[offset], sizeof(value));
+	return value;
+}
+
+#ifdef __x86_64__
+
+static const uint8_t SRAT_APIC = 0;
+static const uint8_t SRAT_X2APIC = 2;
+
+static void cpuid(uint32_t leaf, uint32_t regs[4])
+{
+	__asm__ volatile (
+		"cpuid"
+		: "=a"(regs[0]), "=b"(regs[1]), "=c"(regs[2]), "=d"(regs[3])
+		: "a"(leaf), "c"(0));
+}
+
+/* The x2APIC id of the boot CPU if the CPU reports it and the APIC id
+ * otherwise. For ids below 255 they are the same, so the id matches both
+ * kinds of the SRAT entries. */
+static bool boot_cpu_id(const struct efi_system_table *system, uint32_t *id)
+{
+	uint32_t regs[4];
+
+	(void)system;
+	cpuid(0, regs);
+	if (regs[0] >= 0xb) {
+		cpuid(0xb, regs);
+		if (regs[1] != 0) {
+			*id = regs[3];
+			return true;
+		}
+	}
+
+	cpuid(1, regs);
+	*id = regs[1] >> 24;
+	return true;
+}
+
+static bool cpu_affinity(const char *entry, uint32_t *id, uint32_t *node)
+{
+	const uint8_t type = read8(entry, 0);
+	const uint8_t length = read8(entry, 1);
+
+	/* The high bytes of the proximity domain were only added in ACPI 3.0
+	 * and are zero before that. */
+	if (type == SRAT_APIC && length >= 16) {
+		if (!(read32(entry, 4) & SRAT_ENABLED))
+			return false;
+		*id = read8(entry, 3);
+		*node = read8(entry, 2)
+			| (uint32_t)read8(entry, 9) << 8
+			| (uint32_t)read8(entry, 10) << 16
+			| (uint32_t)read8(entry, 11) << 24;
+		return true;
+	}
+
+	if (type == SRAT_X2APIC && length >= 24) {
+		if (!(read32(entry, 12) & SRAT_ENABLED))
+			return false;
+		*id = read32(entry, 8);
+		*node = read32(entry, 4);
+		return true;
+	}
+	return false;
+}
+
+#elif defined(__aarch64__)
+
+static const uint8_t SRAT_GICC = 3;
+static const uint8_t MADT_GICC = 0xb;
+static const uint32_t MADT_ENTRIES = 44;
+static const uint64_t MPIDR_AFFINITY = 0xff00ffffffULL;
+
+/* SRAT identifies CPUs by the ACPI processor UID, so we have to find the
+ * GICC entry of the boot CPU in the MADT to get its UID. */
+static bool boot_cpu_id(const struct efi_system_table *system, uint32_t *id)
+{
+	const uint64_t madt = find_acpi_table(system, "APIC");
+	const char *table = (const char *)madt;
+	uint64_t mpidr;
+	uint32_t length;
+
+	if (madt == 0)
+		return false;
+
+	__asm__ volatile ("mrs %0, mpidr_el1" : "=r"(mpidr));
+	mpidr &= MPIDR_AFFINITY;
+
+	length = acpi_table_length(madt);
+	for (uint32_t offset = MADT_ENTRIES; offset + 2 <= length;) {
+		const char *entry = &table[offset];
+		const uint8_t size = read8(entry, 1);
+
+		if (size < 2 || offset + size > length)
+			break;
+		if (read8(entry, 0) == MADT_GICC && size >= 76
+				&& (read64(entry, 68) & MPIDR_AFFINITY) == mpidr) {
+			*id = read32(entry, 8);
+			return true;
+		}
+		offset += size;
+	}
+	return false;
+}
+
+static bool cpu_affinity(const char *entry, uint32_t *id, uint32_t *node)
+{
+	if (read8(entry, 0) != SRAT_GICC || read8(entry, 1) < 18)
+		return false;
+	if (!(read32(entry, 10) & SRAT_ENABLED))
+		return false;
+	*id = read32(entry, 6);
+	*node = read32(entry, 2);
+	return true;
+}
+
+#endif
+
+/* SRAT is walked twice: first to count the memory ranges, then to fill
+ * them in. */
+static size_t parse_srat(
+	struct numa *numa,
+	uint64_t srat,
+	bool has_cpu,
+	uint32_t cpu)
+{
+	const char *table = (const char *)srat;
+	const uint32_t length = acpi_table_length(srat);
+	size_t ranges = 0;
+
+	for (uint32_t offset = SRAT_ENTRIES; offset + 2 <= length;) {
+		const char *entry = &table[offset];
+		const uint8_t size = read8(entry, 1);
+		uint32_t id, node;
+
+		if (size < 2 || offset + size > length)
+			break;
+		offset += size;
+
+		if (has_cpu && cpu_affinity(entry, &id, &node) && id == cpu) {
+			numa->has_local = true;
+			numa->local = node;
+			continue;
+		}
+
+		if (read8(entry, 0) != SRAT_MEMORY || size < 40)
+			continue;
+		if (!(read32(entry, 28) & SRAT_ENABLED) || read64(entry, 16) == 0)
+			continue;
+
+		if (numa->range != NULL) {
+			struct numa_range *range = &numa->range[ranges];
+
+			range->begin = read64(entry, 8);
+			range->end = range->begin + read64(entry, 16);
+			range->node = read32(entry, 2);
+		}
+		++ranges;
+	}
+	return ranges;
+}
+
+efi_status_t setup_numa(
+	struct numa *numa,
+	const struct efi_system_table *system,
+	struct arena *arena)
+{
+	const uint64_t srat = find_acpi_table(system, "SRAT");
+	const uint64_t slit = find_acpi_table(system, "SLIT");
+	efi_status_t status;
+	bool has_cpu;
+	uint32_t cpu;
+
+	memset(numa, 0, sizeof(*numa));
+	numa->ready = true;
+	if (srat == 0)
+		return EFI_SUCCESS;
+
+	has_cpu = boot_cpu_id(system, &cpu);
+	numa->ranges = parse_srat(numa, srat, has_cpu, cpu);
+	if (numa->ranges == 0)
+		return EFI_SUCCESS;
+
+	status = arena_alloc(
+		arena,
+		numa->ranges * sizeof(*numa->range),
+		(void **)&numa->range);
+	if (status != EFI_SUCCESS)
+		return status;
+	parse_srat(numa, srat, false, 0);
+
+	if (slit != 0 && acpi_table_length(slit) >= SLIT_MATRIX) {
+		const char *table = (const char *)slit;
+		const uint64_t localities = read64(table, 36);
+
+		/* The matrix must fit in the table, and the check is written
+		 * so that it can't overflow. */
+		if (localities != 0 && localities < 65536
+				&& localities * localities
+					<= acpi_table_length(slit) - SLIT_MATRIX) {
+			numa->localities = localities;
+			numa->distance = (const uint8_t *)&table[SLIT_MATRIX];
+		}
+	}
+	return EFI_SUCCESS;
+}
+
+uint32_t numa_distance(const struct numa *numa, uint32_t from, uint32_t to)
+{
+	if (from == to)
+		return 10;
+	if (numa->distance == NULL
+			|| from >= numa->localities
+			|| to >= numa->localities)
+		return 0;
+	return numa->distance[from * numa->localities + to];
+}
+
+/* The memory map is read into a buffer taken from the arena and grown when
+ * needed. It has to be read again for every allocation, since each of them
+ * changes the map. */
+static efi_status_t read_memory_map(struct loader *loader)
+{
+	struct numa *numa = &loader->numa;
+	efi_status_t status;
+
+	while (1) {
+		efi_uint_t key;
+		uint32_t version;
+
+		numa->mmap_size = numa->mmap_capacity;
+		status = loader->system->boot->get_memory_map(
+			&numa->mmap_size,
+			numa->mmap,
+			&key,
+			&numa->desc_size,
+			&version);
+		if (status != EFI_BUFFER_TOO_SMALL)
+			return status;
+
+		numa->mmap_capacity = numa->mmap_size
+			+ 16 * sizeof(struct efi_memory_descriptor);
+		status = arena_alloc(
+			&loader->arena,
+			numa->mmap_capacity,
+			(void **)&numa->mmap);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+}
+
+/* Try the free ranges of the node from the top, so that the low memory
+ * stays free for devices that can't address all of it. */
+static bool allocate_in_node(
+	struct loader *loader,
+	uint32_t node,
+	enum efi_memory_type type,
+	uint64_t size,
+	uint64_t align,
+	uint64_t below,
+	uint64_t *addr)
+{
+	const struct numa *numa = &loader->numa;
+	const char *mmap = (const char *)numa->mmap;
+
+	for (size_t i = 0; i < numa->ranges; ++i) {
+		const struct numa_range *range = &numa->range[i];
+
+		if (range->node != node)
+			continue;
+
+		for (efi_uint_t pos = 0;
+				pos + numa->desc_size <= numa->mmap_size;
+				pos += numa->desc_size) {
+			const struct efi_memory_descriptor *desc =
+				(const struct efi_memory_descriptor *)&mmap[pos];
+			uint64_t begin = desc->physical_start;
+			uint64_t end = begin + desc->pages * NUMA_PAGE_SIZE;
+			uint64_t candidate;
+
+			if (desc->type != EFI_CONVENTIAL_MEMORY)
+				continue;
+
+			if (begin < range->begin)
+				begin = range->begin;
+			if (begin < NUMA_LOW_MEMORY)
+				begin = NUMA_LOW_MEMORY;
+			if (end > range->end)
+				end = range->end;
+			if (below != 0 && end > below)
+				end = below;
+			if (begin >= end || end - begin < size)
+				continue;
+
+			candidate = (end - size) & ~(align - 1);
+			if (candidate < begin)
+				continue;
+
+			if (loader->system->boot->allocate_pages(
+					EFI_ALLOCATE_ADDRESS,
+					type,
+					size / NUMA_PAGE_SIZE,
+					&candidate) == EFI_SUCCESS) {
+				*addr = candidate;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+efi_status_t allocate_on_node(
+	struct loader *loader,
+	const struct module *module,
+	uint64_t pages,
+	uint64_t *addr)
+{
+	struct numa *numa = &loader->numa;
+	const uint64_t align =
+		module->align > NUMA_PAGE_SIZE ? module->align : NUMA_PAGE_SIZE;
+	const enum efi_memory_type type = (enum efi_memory_type)module->type;
+	uint32_t home = module->node;
+	uint32_t node, distance;
+	efi_status_t status;
+
+	if (!numa->ready) {
+		status = setup_numa(numa, loader->system, &loader->arena);
+		if (status != EFI_SUCCESS)
+			return status;
+	}
+
+	if (home == MODULE_LOCAL_NODE) {
+		if (!numa->has_local)
+			return EFI_NOT_FOUND;
+		home = numa->local;
+	}
+
+	status = read_memory_map(loader);
+	if (status != EFI_SUCCESS)
+		return status;
+
+	node = home;
+	distance = numa_distance(numa, home, home);
+
+	/* If the node doesn't have enough free memory we go through the
+	 * other nodes from the nearest to the farthest, in the order of the
+	 * distance and the node number, and skip the nodes the SLIT doesn't
+	 * tell the distance to. */
+	while (1) {
+		uint32_t next = node, next_distance = UINT32_MAX;
+
+		if (allocate_in_node(
+				loader, node, type, pages * NUMA_PAGE_SIZE,
+				align, module->below, addr))
+			return EFI_SUCCESS;
+
+		for (size_t i = 0; i < numa->ranges; ++i) {
+			const uint32_t other = numa->range[i].node;
+			const uint32_t d = numa_distance(numa, home, other);
+
+			if (d == 0 || d < distance
+					|| (d == distance && other <= node))
+				continue;
+			if (d < next_distance
+					|| (d == next_distance && other < next)) {
+				next = other;
+				next_distance = d;
+			}
+		}
+
+		if (next_distance == UINT32_MAX)
+			return EFI_NOT_FOUND;
+		node = next;
+		distance = next_distance;
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "efi/efi.h"
+
+
+/* Memory affinity from the ACPI SRAT. Nodes are the proximity domains as
+ * the SRAT has them, which for QEMU is what -numa node,nodeid=N sets. */
+struct numa_range {
+	uint64_t begin;
+	uint64_t end;
+	uint32_t node;
+};
+
+/* Ranges point into the arena, distance points to the SLIT matrix in the
+ * firmware memory and is NULL if there is no SLIT. The node of the CPU the
+ * loader runs on is only known if the SRAT lists it. Setup is done on
+ * first use, so configs without NUMA placement don't pay for it.
+ *
+ * The memory map is used to find free memory on a node, it's read again
+ * before each allocation. */
+struct numa {
+	bool ready;
+	struct numa_range *range;
+	size_t ranges;
+	bool has_local;
+	uint32_t local;
+	const uint8_t *distance;
+	uint64_t localities;
+
+	struct efi_memory_descriptor *mmap;
+	efi_uint_t mmap_capacity;
+	efi_uint_t mmap_size;
+	efi_uint_t desc_size;
+};
+
+efi_status_t setup_numa(
+	struct numa *numa,
+	const struct efi_system_table *system,
+	struct arena *arena);
+
+/* Relative distance between the nodes as in the SLIT, 10 is the distance
+ * from a node to itself. Returns 0 if the distance is unknown. */
+uint32_t numa_distance(const struct numa *numa, uint32_t from, uint32_t to);
+
+#endif  // __NUMA_H__
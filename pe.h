@@ -0,0 +1,36 @@
+#ifndef __PE_H__
+#define __PE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Offset of the PE header offset in the MS-DOS stub
+static const size_t PE_DOS_LFANEW = 0x3c;
+
+// Signature that precedes the COFF file header
+static const uint32_t PE_SIGNATURE = 0x00004550;
+
+struct pe_file_header {
+    uint16_t machine;
+    uint16_t number_of_sections;
+    uint32_t time_date_stamp;
+    uint32_t pointer_to_symbol_table;
+    uint32_t number_of_symbols;
+    uint16_t size_of_optional_header;
+    uint16_t characteristics;
+};
+
+struct pe_section_header {
+    char name[8];
+    uint32_t virtual_size;
+    uint32_t virtual_address;
+    uint32_t size_of_raw_data;
+    uint32_t pointer_to_raw_data;
+    uint32_t pointer_to_relocations;
+    uint32_t pointer_to_linenumbers;
+    uint16_t number_of_relocations;
+    uint16_t number_of_linenumbers;
+    uint32_t characteristics;
+};
+
+#endif  // __PE_H__
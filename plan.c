@@ -0,0 +1,125 @@
+#include "plan.h"
+
+#include "clib.h"
+#include "log.h"
+
+
+static const uint64_t PLAN_MAGIC = 0x4e414c50544f4f42ULL;  /* "BOOTPLAN" */
+static const uint32_t PLAN_VERSION = 1;
+
+static uint16_t PLAN_VARIABLE[] = u"KernelPlan";
+
+static uint64_t path_hash(const uint16_t *path)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; path[i] != 0; ++i) {
+		hash ^= path[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static size_t plan_size(uint32_t phnum)
+{
+	return sizeof(struct plan)
+		- (PLAN_MAX_PHDRS - phnum) * sizeof(struct elf64_phdr);
+}
+
+/* Time zone and daylight fields are left out, the same file might be
+ * reported either way by different drivers. */
+static bool same_time(const struct efi_time *l, const struct efi_time *r)
+{
+	return l->year == r->year
+		&& l->month == r->month
+		&& l->day == r->day
+		&& l->hour == r->hour
+		&& l->minute == r->minute
+		&& l->second == r->second
+		&& l->nanosecond == r->nanosecond;
+}
+
+bool find_plan(
+	struct efi_system_table *system,
+	struct plan *plan,
+	const uint16_t *path,
+	struct efi_file_protocol *file)
+{
+	struct efi_guid info_guid = EFI_FILE_INFO_GUID;
+	struct efi_guid guid = LOADER_PLAN_GUID;
+	struct efi_file_info file_info;
+	struct plan saved;
+	efi_uint_t size;
+	uint32_t attributes;
+
+	memset(plan, 0, sizeof(*plan));
+	if (system->runtime == NULL)
+		return false;
+
+	size = sizeof(file_info);
+	if (file->get_info(file, &info_guid, &size, &file_info) != EFI_SUCCESS)
+		return false;
+
+	plan->magic = PLAN_MAGIC;
+	plan->version = PLAN_VERSION;
+	plan->path_hash = path_hash(path);
+	plan->file_size = file_info.file_size;
+	plan->modification_time = file_info.modifiction_time;
+
+	size = sizeof(saved);
+	if (system->runtime->get_variable(
+			PLAN_VARIABLE,
+			&guid,
+			&attributes,
+			&size,
+			&saved) != EFI_SUCCESS)
+		return false;
+
+	if (size < plan_size(0)
+			|| saved.magic != PLAN_MAGIC
+			|| saved.version != PLAN_VERSION
+			|| saved.phnum > PLAN_MAX_PHDRS
+			|| saved.phnum != saved.header.e_phnum
+			|| size != plan_size(saved.phnum))
+		return false;
+
+	if (saved.path_hash != plan->path_hash
+			|| saved.file_size != plan->file_size
+			|| !same_time(
+				&saved.modification_time,
+				&plan->modification_time))
+		return false;
+
+	memcpy(plan, &saved, size);
+	return true;
+}
+
+void save_plan(
+	struct efi_system_table *system,
+	struct plan *plan,
+	const struct elf64_ehdr *header,
+	const struct elf64_phdr *phdr,
+	uint64_t image_begin,
+	uint64_t image_end)
+{
+	struct efi_guid guid = LOADER_PLAN_GUID;
+	efi_status_t status;
+
+	if (plan->magic != PLAN_MAGIC || header->e_phnum > PLAN_MAX_PHDRS)
+		return;
+
+	plan->phnum = header->e_phnum;
+	plan->image_begin = image_begin;
+	plan->image_end = image_end;
+	plan->header = *header;
+	memcpy(plan->phdr, phdr, plan->phnum * sizeof(*phdr));
+
+	status = system->runtime->set_variable(
+		PLAN_VARIABLE,
+		&guid,
+		EFI_VARIABLE_NON_VOLATILE | EFI_VARIABLE_BOOTSERVICE_ACCESS,
+		plan_size(plan->phnum),
+		plan);
+	if (status != EFI_SUCCESS)
+		info(system, "failed to save the kernel plan\r\n");
+}
@@ -0,0 +1,55 @@
+#ifndef __PLAN_H__
+#define __PLAN_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "efi/efi.h"
+#include "elf.h"
+
+
+#define LOADER_PLAN_GUID \
+	{ 0xf16dffb2, 0xecfb, 0x4bc7, \
+	  { 0x9c, 0x05, 0xb8, 0x14, 0xe8, 0x0f, 0xe7, 0xad } }
+
+/* Kernels with more program headers are loaded without a plan. */
+#define PLAN_MAX_PHDRS 16
+
+/* What the loader learned about the kernel file on the previous boot: the
+ * ELF headers and the bounds of the image they describe. The plan is kept
+ * in a non-volatile EFI variable and used as long as the path, the size
+ * and the modification time of the kernel file stay the same, so a repeat
+ * boot goes straight to reading the segments. */
+struct plan {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t phnum;
+	uint64_t path_hash;
+	uint64_t file_size;
+	struct efi_time modification_time;
+	uint64_t image_begin;
+	uint64_t image_end;
+	struct elf64_ehdr header;
+	struct elf64_phdr phdr[PLAN_MAX_PHDRS];
+};
+
+/* Check the saved plan against the kernel file. Returns true and fills in
+ * the plan if it can be used. Otherwise the plan only remembers the file
+ * attributes for save_plan. */
+bool find_plan(
+	struct efi_system_table *system,
+	struct plan *plan,
+	const uint16_t *path,
+	struct efi_file_protocol *file);
+
+/* Save the ELF headers and the image bounds for the next boot. Failures
+ * aren't fatal, the next boot just goes without a plan. */
+void save_plan(
+	struct efi_system_table *system,
+	struct plan *plan,
+	const struct elf64_ehdr *header,
+	const struct elf64_phdr *phdr,
+	uint64_t image_begin,
+	uint64_t image_end);
+
+#endif  // __PLAN_H__
@@ -0,0 +1,42 @@
+#ifndef __PRELAID_H__
+#define __PRELAID_H__
+
+#include <stdint.h>
+
+/* Kernel image converted from ELF by tools/mkprelaid.c and laid out in the
+ * file exactly the way it's going to be in memory, so the loader reads the
+ * whole image with one read into one allocation:
+ *
+ *   - prelaid_header padded to PRELAID_ALIGN
+ *   - the image from the lowest page aligned segment address, with the
+ *     gaps between the segments zeroed and the trailing BSS left out
+ *   - relocation table, 8 byte aligned
+ *
+ * The relocation table is an array of 64 bit offsets in the image. Each
+ * of them points to a 64 bit word the difference between the load
+ * address and the base address has to be added to.
+ *
+ * The magic starts with the same byte as the ELF magic, but the rest of it
+ * differs, so the loader can tell the two apart by the first bytes.
+ *
+ * All the numbers are stored little-endian. */
+
+#define PRELAID_MAGIC "\177KRNIMG"
+
+static const uint32_t PRELAID_VERSION = 1;
+static const uint64_t PRELAID_ALIGN = 4096;
+
+struct prelaid_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t machine;
+	uint64_t base;
+	uint64_t entry;
+	uint64_t filesz;
+	uint64_t memsz;
+	uint64_t align;
+	uint64_t relocs_offset;
+	uint64_t relocs;
+};
+
+#endif  // __PRELAID_H__
@@ -0,0 +1,133 @@
+#include "timer.h"
+
+#include "acpi.h"
+#include "clib.h"
+#include "loader.h"
+
+
+#ifdef __x86_64__
+
+static const uint64_t FEMTOSECONDS = 1000000000000000ULL;
+static const uint64_t MIN_HPET_TICKS = 10000;
+static const uint64_t STALL_US = 10000;
+
+/* HPET registers, see the IA-PC HPET specification. */
+static const uint64_t HPET_CAPABILITIES = 0x0;
+static const uint64_t HPET_CONFIG = 0x10;
+static const uint64_t HPET_COUNTER = 0xf0;
+static const uint64_t HPET_COUNTER_64BIT = 1ULL << 13;
+static const uint64_t HPET_ENABLED = 1;
+
+uint64_t read_counter(void)
+{
+	uint32_t lo, hi;
+
+	__asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static uint64_t hpet_read(uint64_t hpet, uint64_t reg)
+{
+	return *(volatile uint64_t *)(hpet + reg);
+}
+
+/* The base address of the HPET is in the generic address structure at
+ * offset 40 of the table, and the address itself is at offset 4 of that
+ * structure. */
+static uint64_t find_hpet(struct efi_system_table *system)
+{
+	const uint64_t table = find_acpi_table(system, "HPET");
+	uint64_t hpet;
+
+	if (table == 0)
+		return 0;
+
+	memcpy(&hpet, (const char *)table + 44, sizeof(hpet));
+	return hpet;
+}
+
+void start_timer(struct timer *timer, struct efi_system_table *system)
+{
+	const uint64_t hpet = find_hpet(system);
+	uint64_t capabilities;
+	uint64_t period;
+
+	memset(timer, 0, sizeof(*timer));
+	timer->start = read_counter();
+
+	if (hpet == 0 || !(hpet_read(hpet, HPET_CONFIG) & HPET_ENABLED))
+		return;
+
+	capabilities = hpet_read(hpet, HPET_CAPABILITIES);
+	period = capabilities >> 32;
+	if (period == 0 || period > FEMTOSECONDS)
+		return;
+
+	timer->hpet = hpet;
+	timer->hpet_frequency = FEMTOSECONDS / period;
+	timer->hpet_mask = (capabilities & HPET_COUNTER_64BIT)
+		? UINT64_MAX
+		: UINT32_MAX;
+	timer->hpet_start = hpet_read(hpet, HPET_COUNTER);
+	timer->start = read_counter();
+}
+
+uint64_t timer_frequency(
+	const struct timer *timer,
+	struct efi_system_table *system)
+{
+	uint64_t ticks, start;
+
+	if (timer->hpet != 0) {
+		uint64_t elapsed = (hpet_read(timer->hpet, HPET_COUNTER)
+			- timer->hpet_start) & timer->hpet_mask;
+
+		ticks = read_counter() - timer->start;
+		if (elapsed >= MIN_HPET_TICKS) {
+			while (ticks > UINT64_MAX / timer->hpet_frequency) {
+				ticks >>= 1;
+				elapsed >>= 1;
+			}
+			return ticks * timer->hpet_frequency / elapsed;
+		}
+	}
+
+	/* Not enough time has passed since the start, or there is no HPET
+	 * at all, so we have to wait. */
+	start = read_counter();
+	if (system->boot->stall(STALL_US) != EFI_SUCCESS)
+		return 0;
+	ticks = read_counter() - start;
+	return ticks * (1000000 / STALL_US);
+}
+
+#elif defined(__aarch64__)
+
+uint64_t read_counter(void)
+{
+	uint64_t counter;
+
+	__asm__ volatile ("isb; mrs %0, cntvct_el0" : "=r"(counter));
+	return counter;
+}
+
+void start_timer(struct timer *timer, struct efi_system_table *system)
+{
+	(void)system;
+	memset(timer, 0, sizeof(*timer));
+	timer->start = read_counter();
+}
+
+uint64_t timer_frequency(
+	const struct timer *timer,
+	struct efi_system_table *system)
+{
+	uint64_t frequency;
+
+	(void)timer;
+	(void)system;
+	__asm__ volatile ("mrs %0, cntfrq_el0" : "=r"(frequency));
+	return frequency;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <stdint.h>
+
+#include "efi/efi.h"
+
+
+/* The counter the kernel is expected to use as its clock source: TSC on
+ * x86-64 and the virtual counter on aarch64. */
+uint64_t read_counter(void);
+
+/* Calibration of the counter frequency against a reference with a known
+ * frequency. On x86-64 it's the HPET if the firmware has it enabled, and
+ * the calibration spans the whole time the loader works, so it doesn't
+ * cost anything. Otherwise we fall back to measuring a short firmware
+ * Stall. On aarch64 the frequency is in CNTFRQ_EL0 and no calibration is
+ * needed at all. */
+struct timer {
+	uint64_t start;
+	uint64_t hpet;
+	uint64_t hpet_start;
+	uint64_t hpet_frequency;
+	uint64_t hpet_mask;
+};
+
+/* Remember the counter and the reference values at the loader start. */
+void start_timer(struct timer *timer, struct efi_system_table *system);
+
+/* Returns the counter frequency in Hz or 0 if we failed to find it. */
+uint64_t timer_frequency(
+	const struct timer *timer,
+	struct efi_system_table *system);
+
+#endif  // __TIMER_H__
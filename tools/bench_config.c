@@ -0,0 +1,261 @@
+/* Host benchmark of the config parser.
+ *
+ * Usage: bench_config [entries] [rounds]
+ *
+ * Generates a config with the given number of module entries (100000 by
+ * default) and measures parse_config and find_module against the parser
+ * the loader used before: isalnum/isspace chains for lexing, two pool
+ * allocations per entry, a doubling module array and a linear strcmp scan
+ * for lookups by name. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "loader.h"
+#include "mock_efi.h"
+
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *generate_config(size_t entries, size_t *size)
+{
+	const size_t line = 64;
+	char *config = malloc((entries + 1) * line + 1);
+	size_t pos = 0;
+
+	if (config == NULL)
+		return NULL;
+
+	pos += sprintf(&config[pos], "kernel: efi\\boot\\kernel\n");
+	for (size_t i = 0; i < entries; ++i) {
+		pos += sprintf(
+			&config[pos],
+			"    module%zu: efi\\boot\\modules\\module%zu.bin\n",
+			i, i);
+	}
+
+	*size = pos + 1;
+	return config;
+}
+
+/* The legacy parser, kept here as the baseline. Like the original it uses
+ * the character classification and string functions from clib.c and the
+ * firmware pool allocator. */
+int isalnum(int code);
+int isspace(int code);
+uint16_t *to_u16strncpy(uint16_t *dst, const char *src, size_t size);
+
+struct legacy_module {
+	const uint16_t *path;
+	const char *name;
+};
+
+static size_t legacy_skip_ws(const char *data, size_t i)
+{
+	while (isspace(data[i]))
+		++i;
+	return i;
+}
+
+static size_t legacy_skip_name(const char *data, size_t i)
+{
+	while (isalnum(data[i])
+	       || data[i] == '_'
+	       || data[i] == '-'
+	       || data[i] == '.')
+		++i;
+	return i;
+}
+
+static size_t legacy_skip_path(const char *data, size_t i)
+{
+	while (isalnum(data[i])
+	       || data[i] == '_'
+	       || data[i] == '-'
+	       || data[i] == '.'
+	       || data[i] == '\\'
+	       || data[i] == '/')
+		++i;
+	return i;
+}
+
+static struct legacy_module *legacy_parse(const char *data, size_t *count)
+{
+	struct efi_boot_table *boot = mock_efi_system()->boot;
+	struct legacy_module *module = NULL;
+	size_t capacity = 0;
+	size_t modules = 0;
+	size_t i = 0;
+
+	while (1) {
+		size_t name_begin, name_size, path_begin, path_size;
+		uint16_t *path;
+		char *name;
+
+		i = legacy_skip_ws(data, i);
+		if (data[i] == '\0')
+			break;
+
+		name_begin = i;
+		i = legacy_skip_name(data, i);
+		name_size = i - name_begin;
+		i = legacy_skip_ws(data, i);
+		if (data[i] != ':')
+			return NULL;
+
+		i = legacy_skip_ws(data, i + 1);
+		path_begin = i;
+		i = legacy_skip_path(data, i);
+		path_size = i - path_begin;
+
+		boot->allocate_pool(
+			EFI_LOADER_DATA, name_size + 1, (void **)&name);
+		strncpy(name, &data[name_begin], name_size);
+		name[name_size] = '\0';
+
+		boot->allocate_pool(
+			EFI_LOADER_DATA, 2 * (path_size + 1), (void **)&path);
+		to_u16strncpy(path, &data[path_begin], path_size);
+		path[path_size] = 0;
+
+		if (modules == capacity) {
+			struct legacy_module *old = module;
+
+			capacity = capacity ? 2 * capacity : 16;
+			boot->allocate_pool(
+				EFI_LOADER_DATA,
+				capacity * sizeof(*module),
+				(void **)&module);
+			memcpy(module, old, modules * sizeof(*module));
+			if (old != NULL)
+				boot->free_pool(old);
+		}
+		module[modules].name = name;
+		module[modules].path = path;
+		++modules;
+	}
+
+	*count = modules;
+	return module;
+}
+
+static const struct legacy_module *legacy_find(
+	const struct legacy_module *module, size_t modules, const char *name)
+{
+	for (size_t i = 0; i < modules; ++i) {
+		if (strcmp(module[i].name, name) == 0)
+			return &module[i];
+	}
+	return NULL;
+}
+
+static void legacy_free(struct legacy_module *module, size_t modules)
+{
+	for (size_t i = 0; i < modules; ++i) {
+		free((void *)module[i].name);
+		free((void *)module[i].path);
+	}
+	free(module);
+}
+
+int main(int argc, char **argv)
+{
+	const size_t entries = argc > 1 ? strtoull(argv[1], NULL, 0) : 100000;
+	const size_t rounds = argc > 2 ? strtoull(argv[2], NULL, 0) : 10;
+	const size_t lookups = 1000;
+	double legacy_parse_time = 0, parse_time = 0;
+	double legacy_find_time, find_time;
+	size_t allocations = 0;
+	struct legacy_module *legacy = NULL;
+	size_t legacy_modules = 0;
+	struct loader loader;
+	char **names;
+	size_t size;
+	char *config;
+	double start;
+
+	config = generate_config(entries, &size);
+	names = calloc(lookups, sizeof(*names));
+	if (config == NULL || names == NULL || rounds == 0) {
+		fprintf(stderr, "failed to generate the config\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < lookups; ++i) {
+		names[i] = malloc(32);
+		sprintf(names[i], "module%zu", (size_t)rand() % entries);
+	}
+
+	for (size_t r = 0; r < rounds; ++r) {
+		start = now();
+		legacy = legacy_parse(config, &legacy_modules);
+		legacy_parse_time += now() - start;
+		if (legacy == NULL) {
+			fprintf(stderr, "legacy parser failed\n");
+			return 1;
+		}
+		if (r + 1 < rounds)
+			legacy_free(legacy, legacy_modules);
+	}
+
+	for (size_t r = 0; r < rounds; ++r) {
+		const struct mock_efi_stats *stats = mock_efi_stats();
+		const size_t before = stats->allocate_pool + stats->allocate_pages;
+
+		memset(&loader, 0, sizeof(loader));
+		loader.system = mock_efi_system();
+		setup_arena(&loader.arena, loader.system, EFI_LOADER_DATA);
+		loader.config_data = malloc(size);
+		memcpy(loader.config_data, config, size);
+
+		start = now();
+		if (parse_config(&loader) != EFI_SUCCESS) {
+			fprintf(stderr, "parse_config failed\n");
+			return 1;
+		}
+		parse_time += now() - start;
+		allocations = stats->allocate_pool + stats->allocate_pages - before;
+
+		if (r + 1 < rounds) {
+			arena_release(&loader.arena);
+			free(loader.config_data);
+		}
+	}
+
+	start = now();
+	for (size_t i = 0; i < lookups; ++i) {
+		if (legacy_find(legacy, legacy_modules, names[i]) == NULL)
+			return 1;
+	}
+	legacy_find_time = now() - start;
+
+	start = now();
+	for (size_t i = 0; i < lookups; ++i) {
+		if (find_module(&loader, names[i]) == NULL)
+			return 1;
+	}
+	find_time = now() - start;
+
+	printf("entries: %zu, config size: %zu bytes\n", entries + 1, size);
+	printf(
+		"parse:  legacy %.1f ns/entry, current %.1f ns/entry"
+		" (%.2fx), %zu allocation(s)\n",
+		legacy_parse_time * 1e9 / rounds / (entries + 1),
+		parse_time * 1e9 / rounds / (entries + 1),
+		legacy_parse_time / parse_time,
+		allocations);
+	printf(
+		"lookup: legacy %.1f ns, current %.1f ns (%.2fx)\n",
+		legacy_find_time * 1e9 / lookups,
+		find_time * 1e9 / lookups,
+		legacy_find_time / find_time);
+	return 0;
+}
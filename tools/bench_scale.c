@@ -0,0 +1,557 @@
+/* Host benchmark of how the loader scales with the size of its inputs.
+ *
+ * Usage: bench_scale [-n max modules] [-b max bytes] [-r rounds]
+ *                    [-o data file]
+ *
+ * Runs parse_config, load_modules and load_kernel on top of the mock
+ * firmware with synthetic inputs (see tools/corpus.h) of growing size:
+ *
+ *   - configs with 1K up to 64K modules (-n);
+ *   - bundles with as many 1K modules, laid out both in the config order
+ *     and in reverse, the way top-down firmware allocations come, loaded
+ *     and then sorted for the manifest with sort_reserves;
+ *   - kernels with 16 up to 4096 loadable segments;
+ *   - kernels with 1M up to 256M of BSS (-b);
+ *   - single modules of 1K up to 256M that have to be copied (-b), and of
+ *     1K up to 4G that are used in place in the bundle.
+ *
+ * Every series is printed as a table with the time per module, segment or
+ * byte and a bar for it: flat bars mean linear time. The slope of the
+ * time against the size on the log-log scale is fitted for each series,
+ * and the series with a slope above 1.3 are flagged as superlinear and
+ * listed at the end. The series in bytes outgrow the CPU caches, which
+ * alone makes their slopes somewhat above 1. Points below 100us are too
+ * noisy and left out of the fit. A series stops early once a point takes
+ * more than 2s.
+ *
+ * With -o the points are also written as a data file with a block for
+ * each series, e.g. for gnuplot:
+ *
+ *   plot for [i=0:6] 'data' index i using 1:3 with linespoints
+ *
+ * where the columns are the size, the bytes and the time in seconds. */
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "corpus.h"
+#include "loader.h"
+#include "mock_efi.h"
+
+
+static const size_t MAX_POINTS = 32;
+static const double NOISE_SECONDS = 1e-4;
+static const double STOP_SECONDS = 2;
+static const double SUPERLINEAR_SLOPE = 1.3;
+static const int BAR_WIDTH = 30;
+
+struct point {
+	uint64_t size;
+	uint64_t bytes;
+	double seconds;
+};
+
+/* One benchmark run for the given size, returns the time in seconds or a
+ * negative value if the loader failed. */
+typedef double (*bench_fn)(uint64_t size, uint64_t *bytes);
+
+struct series {
+	const char *name;
+	const char *unit;
+	bench_fn run;
+	uint64_t first;
+	uint64_t last;
+	uint64_t step;
+};
+
+static size_t rounds = 3;
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* The bundle lives in calloc memory, so the parts of it that nobody
+ * writes, like the contents of huge modules, never take any memory. */
+static char *build_bundle(
+	struct corpus_file *file,
+	size_t files,
+	bool reverse,
+	uint64_t *size)
+{
+	size_t header_size;
+	char *header, *bundle;
+
+	header = corpus_bundle(file, files, reverse, &header_size, size);
+	if (header == NULL)
+		return NULL;
+
+	bundle = calloc(*size, 1);
+	if (bundle != NULL) {
+		memcpy(bundle, header, header_size);
+		for (size_t i = 0; i < files; ++i) {
+			if (file[i].data != NULL)
+				memcpy(&bundle[file[i].offset],
+					file[i].data,
+					file[i].size);
+		}
+	}
+	free(header);
+	return bundle;
+}
+
+static bool start_run(
+	struct loader *loader,
+	const char *config,
+	size_t config_size,
+	const char *bundle)
+{
+	memset(loader, 0, sizeof(*loader));
+	loader->system = mock_efi_system();
+	setup_arena(&loader->arena, loader->system, EFI_LOADER_DATA);
+	loader->config_data = malloc(config_size);
+	if (loader->config_data == NULL)
+		return false;
+	memcpy(loader->config_data, config, config_size);
+	loader->bundle = (const struct bundle_header *)bundle;
+	return true;
+}
+
+/* Everything the loader allocated pages for outside of the bundle goes
+ * back, the mock allocates each range separately. */
+static void finish_run(
+	struct loader *loader,
+	const char *bundle,
+	uint64_t bundle_size)
+{
+	for (size_t i = 0; i < loader->reserves; ++i) {
+		const struct reserve *r = &loader->reserve[i];
+
+		if (r->begin >= (uint64_t)bundle
+				&& r->begin < (uint64_t)bundle + bundle_size)
+			continue;
+		loader->system->boot->free_pages(
+			r->begin, (r->end - r->begin + 4095) / 4096);
+	}
+	arena_release(&loader->arena);
+	free(loader->config_data);
+}
+
+static double bench_parse(uint64_t modules, uint64_t *bytes)
+{
+	struct loader loader;
+	double best = -1;
+	size_t size;
+	char *config;
+
+	config = corpus_config(modules, "align=4K below=4G type=module", &size);
+	if (config == NULL)
+		return -1;
+	*bytes = size;
+
+	for (size_t r = 0; r < rounds; ++r) {
+		double start, seconds;
+		efi_status_t status;
+
+		if (!start_run(&loader, config, size, NULL))
+			break;
+		start = now();
+		status = parse_config(&loader);
+		seconds = now() - start;
+		finish_run(&loader, NULL, 0);
+		if (status != EFI_SUCCESS) {
+			best = -1;
+			break;
+		}
+		if (best < 0 || seconds < best)
+			best = seconds;
+	}
+
+	free(config);
+	return best;
+}
+
+/* Modules are loaded from the bundle, so the time is the lookup in the
+ * bundle, the placement check, reserve and sorting the reserved ranges
+ * the way build_manifest does. */
+static double bench_modules(
+	uint64_t modules,
+	uint64_t module_size,
+	const char *attributes,
+	bool reverse,
+	uint64_t *bytes)
+{
+	struct corpus_file *file = calloc(modules, sizeof(*file));
+	struct loader loader;
+	double best = -1;
+	uint64_t bundle_size;
+	char *config, *bundle = NULL;
+	size_t size;
+
+	config = corpus_config(modules, attributes, &size);
+	if (config != NULL && file != NULL) {
+		for (size_t i = 0; i < modules; ++i) {
+			corpus_module_name(i, file[i].name);
+			file[i].size = module_size;
+		}
+		bundle = build_bundle(file, modules, reverse, &bundle_size);
+	}
+	if (bundle == NULL) {
+		best = -2;
+		goto out;
+	}
+	*bytes = modules * module_size;
+
+	for (size_t r = 0; r < rounds; ++r) {
+		efi_status_t status = EFI_LOAD_ERROR;
+		double start, seconds = 0;
+
+		if (!start_run(&loader, config, size, bundle))
+			break;
+		if (parse_config(&loader) == EFI_SUCCESS) {
+			start = now();
+			status = load_modules(&loader);
+			if (status == EFI_SUCCESS)
+				status = sort_reserves(&loader);
+			seconds = now() - start;
+		}
+		finish_run(&loader, bundle, bundle_size);
+		if (status != EFI_SUCCESS) {
+			best = -1;
+			break;
+		}
+		if (best < 0 || seconds < best)
+			best = seconds;
+	}
+
+out:
+	free(bundle);
+	free(config);
+	free(file);
+	return best;
+}
+
+static double bench_kernel(uint64_t segments, uint64_t bss, uint64_t *bytes)
+{
+	struct corpus_file file;
+	struct loader loader;
+	double best = -1;
+	uint64_t bundle_size;
+	char *config, *kernel, *bundle = NULL;
+	size_t size, kernel_size;
+
+	memset(&file, 0, sizeof(file));
+	config = corpus_config(0, "", &size);
+	kernel = corpus_kernel(segments, bss, &kernel_size);
+	if (config != NULL && kernel != NULL) {
+		snprintf(file.name, sizeof(file.name), "%s", CORPUS_KERNEL);
+		file.data = kernel;
+		file.size = kernel_size;
+		bundle = build_bundle(&file, 1, false, &bundle_size);
+	}
+	if (bundle == NULL) {
+		best = -2;
+		goto out;
+	}
+	*bytes = segments * 4096 + bss;
+
+	for (size_t r = 0; r < rounds; ++r) {
+		efi_status_t status = EFI_LOAD_ERROR;
+		double start, seconds = 0;
+
+		if (!start_run(&loader, config, size, bundle))
+			break;
+		if (parse_config(&loader) == EFI_SUCCESS) {
+			start = now();
+			status = load_kernel(&loader);
+			seconds = now() - start;
+		}
+		finish_run(&loader, bundle, bundle_size);
+		if (status != EFI_SUCCESS) {
+			best = -1;
+			break;
+		}
+		if (best < 0 || seconds < best)
+			best = seconds;
+	}
+
+out:
+	free(bundle);
+	free(kernel);
+	free(config);
+	return best;
+}
+
+static double bench_ascending(uint64_t modules, uint64_t *bytes)
+{
+	return bench_modules(modules, 1024, "", false, bytes);
+}
+
+static double bench_descending(uint64_t modules, uint64_t *bytes)
+{
+	return bench_modules(modules, 1024, "", true, bytes);
+}
+
+static double bench_segments(uint64_t segments, uint64_t *bytes)
+{
+	return bench_kernel(segments, 0, bytes);
+}
+
+static double bench_bss(uint64_t bss, uint64_t *bytes)
+{
+	return bench_kernel(1, bss, bytes);
+}
+
+/* Kernel memory type doesn't match the bundle memory, so the module is
+ * copied out. */
+static double bench_copy(uint64_t size, uint64_t *bytes)
+{
+	return bench_modules(1, size, "type=kernel", false, bytes);
+}
+
+static double bench_in_place(uint64_t size, uint64_t *bytes)
+{
+	return bench_modules(1, size, "", false, bytes);
+}
+
+/* Least squares fit of log(seconds) against log(size). */
+static bool fit_slope(const struct point *point, size_t points, double *slope)
+{
+	double sx = 0, sy = 0, sxx = 0, sxy = 0;
+	size_t n = 0;
+
+	for (size_t i = 0; i < points; ++i) {
+		double x, y;
+
+		if (point[i].seconds < NOISE_SECONDS)
+			continue;
+		x = log((double)point[i].size);
+		y = log(point[i].seconds);
+		sx += x;
+		sy += y;
+		sxx += x * x;
+		sxy += x * y;
+		++n;
+	}
+
+	if (n < 3 || n * sxx - sx * sx == 0)
+		return false;
+	*slope = (n * sxy - sx * sy) / (n * sxx - sx * sx);
+	return true;
+}
+
+static void print_size(uint64_t size)
+{
+	static const char *suffix[] = { "", "K", "M", "G" };
+	size_t i = 0;
+
+	while (i + 1 < sizeof(suffix) / sizeof(suffix[0])
+			&& size >= 1024 && size % 1024 == 0) {
+		size /= 1024;
+		++i;
+	}
+	printf("%8llu%-1s", (unsigned long long)size, suffix[i]);
+}
+
+/* Returns -1 if the loader failed, 1 if the series is superlinear and 0
+ * otherwise. */
+static int run_series(const struct series *series, FILE *data)
+{
+	struct point point[MAX_POINTS];
+	double max_cost = 0, slope;
+	size_t points = 0;
+
+	printf("%s\n", series->name);
+	printf("%9s %12s %12s %12s\n",
+		series->unit, "bytes", "time, ms", "ns/unit");
+
+	for (uint64_t size = series->first;
+			size <= series->last && points < MAX_POINTS;
+			size *= series->step) {
+		uint64_t bytes = 0;
+		const double seconds = series->run(size, &bytes);
+
+		if (seconds == -2) {
+			printf("  not enough memory for %llu, stopped\n",
+				(unsigned long long)size);
+			break;
+		}
+		if (seconds < 0) {
+			printf("  loader failed at %llu\n",
+				(unsigned long long)size);
+			return -1;
+		}
+
+		point[points].size = size;
+		point[points].bytes = bytes;
+		point[points].seconds = seconds;
+		++points;
+		if (seconds > STOP_SECONDS)
+			break;
+	}
+
+	for (size_t i = 0; i < points; ++i) {
+		const double cost = point[i].seconds / point[i].size;
+
+		if (cost > max_cost)
+			max_cost = cost;
+	}
+
+	for (size_t i = 0; i < points; ++i) {
+		const double cost = point[i].seconds / point[i].size;
+		const int bar = max_cost > 0
+			? (int)(cost / max_cost * BAR_WIDTH + 0.5)
+			: 0;
+
+		print_size(point[i].size);
+		printf(" %12llu %12.3f %12.2f ",
+			(unsigned long long)point[i].bytes,
+			point[i].seconds * 1e3,
+			cost * 1e9);
+		for (int j = 0; j < bar; ++j)
+			putchar('#');
+		putchar('\n');
+
+		if (data != NULL) {
+			fprintf(data, "%llu %llu %.9f\n",
+				(unsigned long long)point[i].size,
+				(unsigned long long)point[i].bytes,
+				point[i].seconds);
+		}
+	}
+
+	if (data != NULL)
+		fprintf(data, "\n\n");
+
+	if (!fit_slope(point, points, &slope)) {
+		printf("  slope: not enough points above the noise\n\n");
+		return 0;
+	}
+
+	if (slope > SUPERLINEAR_SLOPE) {
+		printf("  slope: %.2f, SUPERLINEAR\n\n", slope);
+		return 1;
+	}
+	printf("  slope: %.2f\n\n", slope);
+	return 0;
+}
+
+static int parse_arg(const char *str, uint64_t *size)
+{
+	char *end;
+
+	*size = strtoull(str, &end, 0);
+	if (end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+		*size <<= 10;
+		/* fallthrough */
+	case 'M':
+		*size <<= 10;
+		/* fallthrough */
+	case 'K':
+		*size <<= 10;
+		++end;
+		break;
+	}
+	return *end == '\0' && *size != 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t max_modules = 65536, max_bytes = 256 << 20, value;
+	const char *superlinear[16];
+	size_t superlinears = 0;
+	const char *data_path = NULL;
+	FILE *data = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:b:r:o:")) != -1) {
+		int ret = 0;
+
+		switch (opt) {
+		case 'n':
+			ret = parse_arg(optarg, &max_modules);
+			break;
+		case 'b':
+			ret = parse_arg(optarg, &max_bytes);
+			break;
+		case 'r':
+			ret = parse_arg(optarg, &value);
+			rounds = value;
+			break;
+		case 'o':
+			data_path = optarg;
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+
+		if (ret != 0 || max_modules > 999999) {
+			fprintf(stderr,
+				"usage: %s [-n max modules] [-b max bytes] "
+				"[-r rounds] [-o data file]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (data_path != NULL) {
+		data = fopen(data_path, "w");
+		if (data == NULL) {
+			fprintf(stderr, "failed to open %s\n", data_path);
+			return 1;
+		}
+	}
+
+	{
+		const struct series series[] = {
+			{ "parse_config", "modules", bench_parse,
+				1024, max_modules, 2 },
+			{ "load_modules, bundle in config order", "modules",
+				bench_ascending, 1024, max_modules, 2 },
+			{ "load_modules, bundle in reverse order", "modules",
+				bench_descending, 1024, max_modules, 2 },
+			{ "load_kernel, segments", "segments",
+				bench_segments, 16, 4096, 2 },
+			{ "load_kernel, BSS", "bytes",
+				bench_bss, 1 << 20, max_bytes, 4 },
+			{ "load_modules, copied module", "bytes",
+				bench_copy, 1024, max_bytes, 4 },
+			{ "load_modules, module in place", "bytes",
+				bench_in_place, 1024, 4ULL << 30, 4 },
+		};
+
+		for (size_t i = 0; i < sizeof(series) / sizeof(series[0]); ++i) {
+			int ret;
+
+			if (data != NULL)
+				fprintf(data, "# %s\n", series[i].name);
+			ret = run_series(&series[i], data);
+			if (ret < 0)
+				return 1;
+			if (ret > 0)
+				superlinear[superlinears++] = series[i].name;
+		}
+	}
+
+	for (size_t i = 0; i < superlinears; ++i)
+		printf("superlinear: %s\n", superlinear[i]);
+
+	if (data != NULL && fclose(data) != 0) {
+		fprintf(stderr, "failed to write %s\n", data_path);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,165 @@
+#include "corpus.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+#include "elf.h"
+
+
+static const uint64_t CORPUS_PAGE_SIZE = 4096;
+static const uint64_t CORPUS_KERNEL_BASE = 0x200000;
+
+#ifdef __aarch64__
+static const uint16_t CORPUS_MACHINE = EM_AARCH64;
+/* wfi; b . */
+static const unsigned char CORPUS_HALT[] = {
+	0x7f, 0x20, 0x03, 0xd5, 0xff, 0xff, 0xff, 0x17 };
+#else
+static const uint16_t CORPUS_MACHINE = EM_X86_64;
+/* hlt; jmp . - 1 */
+static const unsigned char CORPUS_HALT[] = { 0xf4, 0xeb, 0xfd };
+#endif
+
+static uint64_t align_up(uint64_t x, uint64_t align)
+{
+	return (x + align - 1) & ~(align - 1);
+}
+
+void corpus_module_name(size_t i, char name[32])
+{
+	snprintf(name, 32, "efi\\corpus\\m%06u", (unsigned)(i % 1000000));
+}
+
+char *corpus_config(size_t modules, const char *attributes, size_t *size)
+{
+	const size_t line = 32 + strlen(attributes);
+	char *config = malloc((modules + 2) * line + 64);
+	size_t pos = 0;
+
+	if (config == NULL)
+		return NULL;
+
+	pos += sprintf(&config[pos], "kernel: %s\n", CORPUS_KERNEL);
+	pos += sprintf(&config[pos], "bundle: %s\n", CORPUS_BUNDLE);
+	for (size_t i = 0; i < modules; ++i) {
+		char name[32];
+
+		corpus_module_name(i, name);
+		pos += sprintf(
+			&config[pos],
+			"%s: %s %s\n",
+			strrchr(name, '\\') + 1, name, attributes);
+	}
+
+	*size = pos + 1;
+	return config;
+}
+
+char *corpus_kernel(size_t segments, uint64_t bss, size_t *size)
+{
+	const uint64_t headers = align_up(
+		sizeof(struct elf64_ehdr)
+			+ segments * sizeof(struct elf64_phdr),
+		CORPUS_PAGE_SIZE);
+	struct elf64_ehdr *ehdr;
+	struct elf64_phdr *phdr;
+	char *elf;
+
+	if (segments == 0 || segments >= UINT16_MAX)
+		return NULL;
+
+	*size = headers + segments * CORPUS_PAGE_SIZE;
+	elf = calloc(*size, 1);
+	if (elf == NULL)
+		return NULL;
+
+	ehdr = (struct elf64_ehdr *)elf;
+	memcpy(ehdr->e_ident, "\177ELF", 4);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = 1;
+	ehdr->e_type = ET_EXEC;
+	ehdr->e_machine = CORPUS_MACHINE;
+	ehdr->e_version = 1;
+	ehdr->e_entry = CORPUS_KERNEL_BASE;
+	ehdr->e_phoff = sizeof(*ehdr);
+	ehdr->e_ehsize = sizeof(*ehdr);
+	ehdr->e_phentsize = sizeof(*phdr);
+	ehdr->e_phnum = segments;
+
+	phdr = (struct elf64_phdr *)&elf[ehdr->e_phoff];
+	for (size_t i = 0; i < segments; ++i) {
+		phdr[i].p_type = PT_LOAD;
+		phdr[i].p_flags = i == 0 ? PF_R | PF_X : PF_R | PF_W;
+		phdr[i].p_offset = headers + i * CORPUS_PAGE_SIZE;
+		phdr[i].p_vaddr = CORPUS_KERNEL_BASE + i * CORPUS_PAGE_SIZE;
+		phdr[i].p_paddr = phdr[i].p_vaddr;
+		phdr[i].p_filesz = CORPUS_PAGE_SIZE;
+		phdr[i].p_memsz = CORPUS_PAGE_SIZE;
+		phdr[i].p_align = CORPUS_PAGE_SIZE;
+		memset(&elf[phdr[i].p_offset], (int)i, CORPUS_PAGE_SIZE);
+	}
+	phdr[segments - 1].p_memsz += bss;
+	memcpy(&elf[headers], CORPUS_HALT, sizeof(CORPUS_HALT));
+	return elf;
+}
+
+char *corpus_bundle(
+	struct corpus_file *file,
+	size_t files,
+	bool reverse,
+	size_t *header_size,
+	uint64_t *size)
+{
+	struct bundle_header *header;
+	struct bundle_entry *entry;
+	size_t strings_size = 0;
+	uint64_t offset;
+	char *bundle;
+
+	for (size_t i = 0; i < files; ++i)
+		strings_size += strlen(file[i].name);
+
+	*header_size = align_up(
+		sizeof(*header) + files * sizeof(*entry) + strings_size,
+		BUNDLE_ALIGN);
+	bundle = calloc(*header_size, 1);
+	if (bundle == NULL)
+		return NULL;
+
+	header = (struct bundle_header *)bundle;
+	entry = (struct bundle_entry *)(header + 1);
+	memcpy(header->magic, BUNDLE_MAGIC, sizeof(header->magic));
+	header->version = BUNDLE_VERSION;
+	header->entries = files;
+	header->strings = sizeof(*header) + files * sizeof(*entry);
+	header->strings_size = strings_size;
+
+	offset = *header_size;
+	for (size_t i = 0; i < files; ++i) {
+		struct corpus_file *f = &file[reverse ? files - 1 - i : i];
+
+		f->offset = offset;
+		offset = align_up(offset + f->size, BUNDLE_ALIGN);
+	}
+
+	strings_size = 0;
+	for (size_t i = 0; i < files; ++i) {
+		const size_t length = strlen(file[i].name);
+
+		entry[i].offset = file[i].offset;
+		entry[i].size = file[i].size;
+		entry[i].name = strings_size;
+		entry[i].name_size = length;
+		memcpy(&bundle[header->strings + strings_size],
+			file[i].name,
+			length);
+		strings_size += length;
+	}
+
+	header->size = offset;
+	*size = offset;
+	return bundle;
+}
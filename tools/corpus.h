@@ -0,0 +1,51 @@
+#ifndef __CORPUS_H__
+#define __CORPUS_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Synthetic inputs for the loader benchmarks (see tools/bench_scale.c) and
+ * for test images (see tools/mkcorpus.c). All the files live under
+ * efi\corpus: the kernel, the bundle and modules m000000, m000001 and so
+ * on. */
+
+#define CORPUS_KERNEL "efi\\corpus\\kernel"
+#define CORPUS_BUNDLE "efi\\corpus\\corpus.bnd"
+
+/* A file to put in the bundle. Data might be NULL, then the file is all
+ * zeros and isn't written at all, so huge modules don't need memory.
+ * Offset is filled in by corpus_bundle. */
+struct corpus_file {
+	char name[32];
+	const char *data;
+	uint64_t size;
+	uint64_t offset;
+};
+
+/* The name of the module number i, as it appears in the config. There
+ * are at most 1000000 distinct module names. */
+void corpus_module_name(size_t i, char name[32]);
+
+/* Config with the kernel, the bundle and the given number of modules,
+ * each followed by the attributes, which might be empty. The result is
+ * NUL terminated and size includes the NUL. */
+char *corpus_config(size_t modules, const char *attributes, size_t *size);
+
+/* ELF kernel with the given number of 4K loadable segments, the last one
+ * followed by bss bytes of BSS. The entry point halts the CPU. */
+char *corpus_kernel(size_t segments, uint64_t bss, size_t *size);
+
+/* Lay out a bundle with the files, which must be sorted by name. Returns
+ * the bundle header, the entries and the names, size is the size of the
+ * whole bundle and the files get their offsets. With reverse the files
+ * are laid out in the opposite order, so the later modules in the config
+ * end up at the lower addresses, like most firmware allocates them. */
+char *corpus_bundle(
+	struct corpus_file *file,
+	size_t files,
+	bool reverse,
+	size_t *header_size,
+	uint64_t *size);
+
+#endif  // __CORPUS_H__
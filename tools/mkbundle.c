@@ -0,0 +1,237 @@
+/* Host tool that packs files into a bundle (see bundle.h).
+ *
+ * Usage: mkbundle <output> <name>=<file> [<name>=<file>...]
+ *
+ * Name is the path of the file as it appears in the config, for example
+ * 'efi\boot\kernel=kernel.elf'. If '=' is omitted the file path is used as
+ * the name. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bundle.h"
+
+
+struct member {
+	char *name;
+	const char *file;
+	uint64_t size;
+	uint64_t offset;
+};
+
+static char upcase(char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 'A';
+	return c;
+}
+
+static int member_cmp(const void *l, const void *r)
+{
+	const char *lname = ((const struct member *)l)->name;
+	const char *rname = ((const struct member *)r)->name;
+
+	while (*lname && upcase(*lname) == upcase(*rname)) {
+		++lname;
+		++rname;
+	}
+	return (unsigned char)upcase(*lname) - (unsigned char)upcase(*rname);
+}
+
+static char *normalize_name(const char *name, size_t size)
+{
+	char *norm = malloc(size + 1);
+	size_t len = 0;
+
+	if (norm == NULL)
+		return NULL;
+
+	while (size > 0 && (*name == '\\' || *name == '/')) {
+		++name;
+		--size;
+	}
+
+	for (size_t i = 0; i < size; ++i)
+		norm[len++] = name[i] == '/' ? '\\' : name[i];
+	norm[len] = '\0';
+	return norm;
+}
+
+static int file_size(const char *path, uint64_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	long end;
+
+	if (file == NULL)
+		return -1;
+
+	if (fseek(file, 0, SEEK_END) != 0 || (end = ftell(file)) < 0) {
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+	*size = (uint64_t)end;
+	return 0;
+}
+
+static int copy_file(FILE *out, const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	char buf[65536];
+	size_t size;
+
+	if (in == NULL)
+		return -1;
+
+	while ((size = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, size, out) != size) {
+			fclose(in);
+			return -1;
+		}
+	}
+
+	if (ferror(in)) {
+		fclose(in);
+		return -1;
+	}
+	fclose(in);
+	return 0;
+}
+
+static int pad(FILE *out, uint64_t from, uint64_t to)
+{
+	for (uint64_t i = from; i < to; ++i) {
+		if (fputc(0, out) == EOF)
+			return -1;
+	}
+	return 0;
+}
+
+static uint64_t align_up(uint64_t x, uint64_t align)
+{
+	return (x + align - 1) & ~(align - 1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bundle_header header;
+	struct member *member;
+	size_t members = argc - 2;
+	uint64_t strings_size = 0;
+	uint64_t offset, pos;
+	FILE *out;
+
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <output> <name>=<file>...\n", argv[0]);
+		return 1;
+	}
+
+	member = calloc(members, sizeof(*member));
+	if (member == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < members; ++i) {
+		const char *arg = argv[i + 2];
+		const char *eq = strchr(arg, '=');
+
+		if (eq != NULL) {
+			member[i].name = normalize_name(arg, eq - arg);
+			member[i].file = eq + 1;
+		} else {
+			member[i].name = normalize_name(arg, strlen(arg));
+			member[i].file = arg;
+		}
+
+		if (member[i].name == NULL || member[i].name[0] == '\0') {
+			fprintf(stderr, "invalid member name in %s\n", arg);
+			return 1;
+		}
+
+		if (file_size(member[i].file, &member[i].size) != 0) {
+			fprintf(stderr, "failed to access %s\n", member[i].file);
+			return 1;
+		}
+		strings_size += strlen(member[i].name) + 1;
+	}
+
+	qsort(member, members, sizeof(*member), member_cmp);
+	for (size_t i = 1; i < members; ++i) {
+		if (member_cmp(&member[i - 1], &member[i]) == 0) {
+			fprintf(stderr, "duplicate member %s\n", member[i].name);
+			return 1;
+		}
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, BUNDLE_MAGIC, sizeof(header.magic));
+	header.version = BUNDLE_VERSION;
+	header.entries = (uint32_t)members;
+	header.strings = sizeof(header) + members * sizeof(struct bundle_entry);
+	header.strings_size = strings_size;
+
+	offset = align_up(header.strings + strings_size, BUNDLE_ALIGN);
+	for (size_t i = 0; i < members; ++i) {
+		member[i].offset = offset;
+		offset = align_up(offset + member[i].size, BUNDLE_ALIGN);
+	}
+	header.size = offset;
+
+	out = fopen(argv[1], "wb");
+	if (out == NULL) {
+		fprintf(stderr, "failed to create %s\n", argv[1]);
+		return 1;
+	}
+
+	if (fwrite(&header, sizeof(header), 1, out) != 1)
+		goto write_error;
+
+	pos = 0;
+	for (size_t i = 0; i < members; ++i) {
+		struct bundle_entry entry;
+		size_t len = strlen(member[i].name);
+
+		memset(&entry, 0, sizeof(entry));
+		entry.offset = member[i].offset;
+		entry.size = member[i].size;
+		entry.name = (uint32_t)pos;
+		entry.name_size = (uint32_t)len;
+		if (fwrite(&entry, sizeof(entry), 1, out) != 1)
+			goto write_error;
+		pos += len + 1;
+	}
+
+	for (size_t i = 0; i < members; ++i) {
+		if (fwrite(member[i].name, strlen(member[i].name) + 1, 1, out) != 1)
+			goto write_error;
+	}
+
+	pos = header.strings + strings_size;
+	for (size_t i = 0; i < members; ++i) {
+		if (pad(out, pos, member[i].offset) != 0)
+			goto write_error;
+		if (copy_file(out, member[i].file) != 0) {
+			fprintf(stderr, "failed to copy %s\n", member[i].file);
+			fclose(out);
+			return 1;
+		}
+		pos = member[i].offset + member[i].size;
+	}
+
+	if (pad(out, pos, header.size) != 0)
+		goto write_error;
+
+	if (fclose(out) != 0) {
+		fprintf(stderr, "failed to write %s\n", argv[1]);
+		return 1;
+	}
+	return 0;
+
+write_error:
+	fprintf(stderr, "failed to write %s\n", argv[1]);
+	fclose(out);
+	return 1;
+}
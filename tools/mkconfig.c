@@ -0,0 +1,154 @@
+/* Host tool that compiles a text config into the precompiled form the
+ * loader can use in place (see config_bin.h).
+ *
+ * Usage: mkconfig <config.txt> <output>
+ *
+ * The text is parsed by the loader's own parse_config running on top of
+ * the mock firmware, so the result is exactly what the loader would have
+ * built at boot time. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config_bin.h"
+#include "loader.h"
+#include "mock_efi.h"
+
+
+static uint64_t align8(uint64_t x)
+{
+	return (x + 7) & ~(uint64_t)7;
+}
+
+static size_t u16len(const uint16_t *str)
+{
+	size_t len = 0;
+
+	while (str[len] != 0)
+		++len;
+	return len;
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	char *data;
+	long end;
+
+	if (file == NULL)
+		return NULL;
+
+	if (fseek(file, 0, SEEK_END) != 0
+		|| (end = ftell(file)) < 0
+		|| fseek(file, 0, SEEK_SET) != 0) {
+		fclose(file);
+		return NULL;
+	}
+
+	data = calloc((size_t)end + 1, 1);
+	if (data == NULL || fread(data, 1, (size_t)end, file) != (size_t)end) {
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+
+	fclose(file);
+	*size = (size_t)end;
+	return data;
+}
+
+int main(int argc, char **argv)
+{
+	struct config_bin_header header;
+	struct loader loader;
+	uint64_t paths_pos, names_pos;
+	char *out;
+	FILE *file;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <config.txt> <output>\n", argv[0]);
+		return 1;
+	}
+
+	memset(&loader, 0, sizeof(loader));
+	loader.system = mock_efi_system();
+	setup_arena(&loader.arena, loader.system, EFI_LOADER_DATA);
+	loader.config_data = read_file(argv[1], &loader.config_size);
+	if (loader.config_data == NULL) {
+		fprintf(stderr, "failed to read %s\n", argv[1]);
+		return 1;
+	}
+
+	if (parse_config(&loader) != EFI_SUCCESS) {
+		fprintf(stderr, "failed to parse %s\n", argv[1]);
+		return 1;
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, CONFIG_BIN_MAGIC, sizeof(header.magic));
+	header.version = CONFIG_BIN_VERSION;
+	header.module_size = sizeof(struct module);
+	header.modules = loader.modules;
+	header.kernel = loader.kernel;
+	header.bundle = loader.has_bundle
+		? loader.bundle_module
+		: CONFIG_BIN_NO_BUNDLE;
+	header.index_size = loader.module_index_size;
+
+	for (size_t i = 0; i < loader.modules; ++i) {
+		header.paths_size +=
+			(u16len(loader.module[i].path) + 1) * sizeof(uint16_t);
+		header.names_size += strlen(loader.module[i].name) + 1;
+	}
+
+	header.module_offset = align8(sizeof(header));
+	header.index_offset = align8(
+		header.module_offset + header.modules * sizeof(struct module));
+	header.paths_offset = align8(
+		header.index_offset + header.index_size * sizeof(size_t));
+	header.names_offset = header.paths_offset + header.paths_size;
+	header.size = align8(header.names_offset + header.names_size);
+
+	out = calloc(header.size, 1);
+	if (out == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	memcpy(out, &header, sizeof(header));
+	memcpy(
+		&out[header.index_offset],
+		loader.module_index,
+		header.index_size * sizeof(size_t));
+
+	paths_pos = header.paths_offset;
+	names_pos = header.names_offset;
+	for (size_t i = 0; i < loader.modules; ++i) {
+		struct module module = loader.module[i];
+		const size_t path_size =
+			(u16len(module.path) + 1) * sizeof(uint16_t);
+		const size_t name_size = strlen(module.name) + 1;
+
+		memcpy(&out[paths_pos], module.path, path_size);
+		memcpy(&out[names_pos], module.name, name_size);
+		module.path = (const uint16_t *)(uintptr_t)paths_pos;
+		module.name = (const char *)(uintptr_t)names_pos;
+		memcpy(
+			&out[header.module_offset + i * sizeof(module)],
+			&module,
+			sizeof(module));
+
+		paths_pos += path_size;
+		names_pos += name_size;
+	}
+
+	file = fopen(argv[2], "wb");
+	if (file == NULL
+		|| fwrite(out, header.size, 1, file) != 1
+		|| fclose(file) != 0) {
+		fprintf(stderr, "failed to write %s\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,199 @@
+/* Host tool that writes a synthetic corpus for loader benchmarks.
+ *
+ * Usage: mkcorpus [-n modules] [-m module size] [-s segments] [-b bss]
+ *                 [-a attributes] <directory>
+ *
+ * The directory gets config.txt with the given number of modules (1000 by
+ * default), kernel.elf with the given number of 4K loadable segments (256
+ * by default) and the BSS after the last one, and corpus.bnd, the bundle
+ * with the kernel and all the modules. Modules are all zeros and the
+ * bundle is written sparse, so even 4G modules don't take the disk space.
+ * Sizes might have the K, M and G suffixes.
+ *
+ * The bundle has everything the config refers to, so for a run in QEMU
+ * both can be embedded in the loader image:
+ *
+ *   make embedded EMBED_CONFIG=dir/config.txt EMBED_BUNDLE=dir/corpus.bnd
+ *
+ * The kernel just halts. */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "corpus.h"
+
+
+static int parse_arg(const char *str, uint64_t *size)
+{
+	char *end;
+
+	errno = 0;
+	*size = strtoull(str, &end, 0);
+	if (errno != 0 || end == str)
+		return -1;
+
+	switch (*end) {
+	case 'G':
+		*size <<= 10;
+		/* fallthrough */
+	case 'M':
+		*size <<= 10;
+		/* fallthrough */
+	case 'K':
+		*size <<= 10;
+		++end;
+		break;
+	}
+	return *end == '\0' ? 0 : -1;
+}
+
+static int write_file(
+	const char *dir, const char *name, const char *data, size_t size)
+{
+	char path[4096];
+	FILE *file;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	file = fopen(path, "wb");
+	if (file == NULL
+		|| fwrite(data, 1, size, file) != size
+		|| fclose(file) != 0) {
+		fprintf(stderr, "failed to write %s\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Only the header and the files with data are written, the rest of the
+ * bundle is a hole. */
+static int write_bundle(
+	const char *dir,
+	const char *header,
+	size_t header_size,
+	const struct corpus_file *file,
+	size_t files,
+	uint64_t size)
+{
+	char path[4096];
+	FILE *out;
+
+	snprintf(path, sizeof(path), "%s/corpus.bnd", dir);
+	out = fopen(path, "wb");
+	if (out == NULL
+		|| fwrite(header, 1, header_size, out) != header_size)
+		goto fail;
+
+	for (size_t i = 0; i < files; ++i) {
+		if (file[i].data == NULL)
+			continue;
+		if (fseeko(out, (off_t)file[i].offset, SEEK_SET) != 0
+			|| fwrite(file[i].data, 1, file[i].size, out)
+				!= file[i].size)
+			goto fail;
+	}
+
+	if (fflush(out) != 0 || ftruncate(fileno(out), (off_t)size) != 0)
+		goto fail;
+	if (fclose(out) != 0) {
+		out = NULL;
+		goto fail;
+	}
+	return 0;
+
+fail:
+	if (out != NULL)
+		fclose(out);
+	fprintf(stderr, "failed to write %s\n", path);
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t modules = 1000, module_size = 4096, segments = 256, bss = 0;
+	const char *attributes = "";
+	struct corpus_file *file;
+	size_t config_size, kernel_size, header_size;
+	char *config, *kernel, *header;
+	uint64_t bundle_size;
+	const char *dir;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:m:s:b:a:")) != -1) {
+		int ret = 0;
+
+		switch (opt) {
+		case 'n':
+			ret = parse_arg(optarg, &modules);
+			break;
+		case 'm':
+			ret = parse_arg(optarg, &module_size);
+			break;
+		case 's':
+			ret = parse_arg(optarg, &segments);
+			break;
+		case 'b':
+			ret = parse_arg(optarg, &bss);
+			break;
+		case 'a':
+			attributes = optarg;
+			break;
+		default:
+			ret = -1;
+			break;
+		}
+
+		if (ret != 0) {
+			fprintf(stderr,
+				"usage: %s [-n modules] [-m module size] "
+				"[-s segments] [-b bss] [-a attributes] "
+				"<directory>\n",
+				argv[0]);
+			return 1;
+		}
+	}
+
+	if (optind + 1 != argc || modules > 999999) {
+		fprintf(stderr, "expected a directory and at most 999999 modules\n");
+		return 1;
+	}
+	dir = argv[optind];
+	if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+		fprintf(stderr, "failed to create %s\n", dir);
+		return 1;
+	}
+
+	config = corpus_config(modules, attributes, &config_size);
+	kernel = corpus_kernel(segments, bss, &kernel_size);
+	file = calloc(modules + 1, sizeof(*file));
+	if (config == NULL || kernel == NULL || file == NULL) {
+		fprintf(stderr, "failed to generate the corpus\n");
+		return 1;
+	}
+
+	/* The kernel name sorts before the module names. */
+	snprintf(file[0].name, sizeof(file[0].name), "%s", CORPUS_KERNEL);
+	file[0].data = kernel;
+	file[0].size = kernel_size;
+	for (size_t i = 0; i < modules; ++i) {
+		corpus_module_name(i, file[i + 1].name);
+		file[i + 1].size = module_size;
+	}
+
+	header = corpus_bundle(
+		file, modules + 1, false, &header_size, &bundle_size);
+	if (header == NULL) {
+		fprintf(stderr, "failed to generate the bundle\n");
+		return 1;
+	}
+
+	if (write_file(dir, "config.txt", config, config_size - 1) != 0
+		|| write_file(dir, "kernel.elf", kernel, kernel_size) != 0
+		|| write_bundle(
+			dir, header, header_size,
+			file, modules + 1, bundle_size) != 0)
+		return 1;
+	return 0;
+}
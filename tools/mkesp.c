@@ -0,0 +1,898 @@
+/* Host tool that builds a FAT32 image of the EFI system partition with the
+ * loader, the config and all the files the config refers to.
+ *
+ * Usage: mkesp [-s <size in MiB>] <output> <config> <path>=<file>...
+ *
+ * The config is installed as efi\boot\config.txt, the rest of the files
+ * are given the same way as for mkbundle, for example
+ * 'efi\boot\kernel=kernel.elf'. Every file the config refers to must be
+ * given, files the config doesn't know about, like the loader itself, are
+ * placed first in the order they are given.
+ *
+ * Each file is written as one contiguous run of clusters and the files
+ * follow each other in the order the loader reads them: the config, the
+ * bundle, the kernel and then the modules in the config order. The
+ * directories all go in front of the files. So both the firmware file
+ * system driver and the lazy module extents see strictly sequential
+ * reads.
+ *
+ * FAT32 needs at least 65525 clusters, so the cluster size is the largest
+ * one, up to 32K, that the image size allows: 8K for the default 1G image.
+ * The image has no partition table, firmware mounts such images directly,
+ * e.g. QEMU with -drive format=raw,file=esp.img. */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "loader.h"
+#include "mock_efi.h"
+
+
+static const uint32_t SECTOR_SIZE = 512;
+static const uint32_t RESERVED_SECTORS = 32;
+static const uint32_t FATS = 2;
+static const uint32_t MIN_CLUSTERS = 65525;
+static const uint32_t MAX_CLUSTER_SECTORS = 64;
+static const uint32_t ROOT_CLUSTER = 2;
+static const uint32_t END_OF_CHAIN = 0x0fffffff;
+static const size_t DIR_ENTRY_SIZE = 32;
+static const size_t LFN_CHARS = 13;
+
+static const uint8_t ATTR_DIRECTORY = 0x10;
+static const uint8_t ATTR_ARCHIVE = 0x20;
+static const uint8_t ATTR_LONG_NAME = 0x0f;
+
+static const char CONFIG_PATH[] = "efi\\boot\\config.txt";
+
+/* A file or a directory in the image. Children of a directory are kept in
+ * the order they were added, which is the load order of the files. */
+struct node {
+	char *name;
+	struct node *parent;
+	struct node *child;
+	struct node *last;
+	struct node *next;
+	size_t children;
+	bool dir;
+
+	const char *file;
+	uint64_t size;
+	time_t mtime;
+
+	char short_name[11];
+	uint32_t cluster;
+	uint32_t clusters;
+};
+
+struct image {
+	uint64_t sectors;
+	uint32_t cluster_sectors;
+	uint32_t cluster_size;
+	uint32_t fat_sectors;
+	uint32_t clusters;
+	uint32_t next_cluster;
+	uint32_t *fat;
+
+	struct node root;
+	struct node **file;
+	size_t files;
+	size_t capacity;
+};
+
+static char upcase(char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 'A';
+	return c;
+}
+
+static void put16(uint8_t *data, uint16_t value)
+{
+	data[0] = value & 0xff;
+	data[1] = value >> 8;
+}
+
+static void put32(uint8_t *data, uint32_t value)
+{
+	put16(data, value & 0xffff);
+	put16(data + 2, value >> 16);
+}
+
+static struct node *find_child(
+	struct node *dir, const char *name, size_t size)
+{
+	for (struct node *node = dir->child; node != NULL; node = node->next) {
+		size_t i = 0;
+
+		if (strlen(node->name) != size)
+			continue;
+		while (i < size && upcase(node->name[i]) == upcase(name[i]))
+			++i;
+		if (i == size)
+			return node;
+	}
+	return NULL;
+}
+
+static struct node *add_child(
+	struct node *dir, const char *name, size_t size)
+{
+	struct node *node = calloc(1, sizeof(*node));
+
+	if (node == NULL)
+		return NULL;
+
+	node->name = malloc(size + 1);
+	if (node->name == NULL)
+		return NULL;
+	memcpy(node->name, name, size);
+	node->name[size] = '\0';
+	node->parent = dir;
+
+	if (dir->last != NULL)
+		dir->last->next = node;
+	else
+		dir->child = node;
+	dir->last = node;
+	++dir->children;
+	return node;
+}
+
+/* Add a file to the image creating the directories on the way. Returns -1
+ * on errors, 0 if the file was added and 1 if it's already there. */
+static int add_file(struct image *image, const char *path, const char *file)
+{
+	struct node *dir = &image->root;
+	struct node *node;
+	struct stat st;
+
+	while (*path == '\\' || *path == '/')
+		++path;
+
+	while (1) {
+		size_t size = strcspn(path, "\\/");
+
+		if (size == 0) {
+			fprintf(stderr, "invalid path %s\n", path);
+			return -1;
+		}
+
+		node = find_child(dir, path, size);
+		if (path[size] == '\0')
+			break;
+
+		if (node == NULL) {
+			node = add_child(dir, path, size);
+			if (node == NULL)
+				return -1;
+			node->dir = true;
+		} else if (!node->dir) {
+			fprintf(stderr, "%.*s is not a directory\n",
+				(int)size, path);
+			return -1;
+		}
+
+		dir = node;
+		path += size + 1;
+	}
+
+	if (node != NULL) {
+		if (node->dir) {
+			fprintf(stderr, "%s is a directory\n", path);
+			return -1;
+		}
+		return 1;
+	}
+
+	if (stat(file, &st) != 0) {
+		fprintf(stderr, "failed to access %s\n", file);
+		return -1;
+	}
+
+	node = add_child(dir, path, strlen(path));
+	if (node == NULL)
+		return -1;
+	node->file = file;
+	node->size = (uint64_t)st.st_size;
+	node->mtime = st.st_mtime;
+
+	if (image->files == image->capacity) {
+		image->capacity = image->capacity ? 2 * image->capacity : 16;
+		image->file = realloc(
+			image->file, image->capacity * sizeof(*image->file));
+		if (image->file == NULL)
+			return -1;
+	}
+	image->file[image->files++] = node;
+	return 0;
+}
+
+static bool short_char(char c)
+{
+	return (c >= 'A' && c <= 'Z')
+		|| (c >= '0' && c <= '9')
+		|| (c != '\0' && strchr("!#$%&'()-@^_`{}~", c) != NULL);
+}
+
+/* Names that are valid 8.3 names written in upper case are stored as is,
+ * everything else gets a long name and a NAME~N.EXT alias. */
+static bool fits_short_name(const char *name, char short_name[11])
+{
+	const char *dot = strchr(name, '.');
+	const size_t base = dot != NULL ? (size_t)(dot - name) : strlen(name);
+	const size_t ext = dot != NULL ? strlen(dot + 1) : 0;
+
+	if (base == 0 || base > 8 || ext > 3 || (dot != NULL && ext == 0))
+		return false;
+
+	memset(short_name, ' ', 11);
+	for (size_t i = 0; i < base; ++i) {
+		if (!short_char(name[i]))
+			return false;
+		short_name[i] = name[i];
+	}
+	for (size_t i = 0; i < ext; ++i) {
+		if (!short_char(dot[1 + i]))
+			return false;
+		short_name[8 + i] = dot[1 + i];
+	}
+	return true;
+}
+
+static bool short_name_taken(const struct node *dir, const char name[11])
+{
+	for (const struct node *node = dir->child; node != NULL;
+			node = node->next) {
+		if (memcmp(node->short_name, name, 11) == 0)
+			return true;
+	}
+	return false;
+}
+
+static void make_alias(
+	const struct node *dir, const char *name, char out[11])
+{
+	const char *dot = strrchr(name, '.');
+	char base[8], ext[3];
+	size_t bases = 0, exts = 0;
+
+	if (dot == name)
+		dot = NULL;
+
+	for (const char *c = name; *c && c != dot && bases < 8; ++c) {
+		const char u = upcase(*c);
+
+		if (u == '.' || u == ' ')
+			continue;
+		base[bases++] = short_char(u) ? u : '_';
+	}
+	for (const char *c = dot != NULL ? dot + 1 : ""; *c && exts < 3; ++c) {
+		const char u = upcase(*c);
+
+		if (u == ' ')
+			continue;
+		ext[exts++] = short_char(u) ? u : '_';
+	}
+
+	for (unsigned n = 1;; ++n) {
+		char alias[11], tail[12];
+		const size_t tails = (size_t)sprintf(tail, "~%u", n);
+		const size_t keep = bases + tails > 8 ? 8 - tails : bases;
+
+		memset(alias, ' ', 11);
+		memcpy(alias, base, keep);
+		memcpy(&alias[keep], tail, tails);
+		memcpy(&alias[8], ext, exts);
+		if (!short_name_taken(dir, alias)) {
+			memcpy(out, alias, 11);
+			return;
+		}
+	}
+}
+
+static size_t long_entries(const struct node *node)
+{
+	char short_name[11];
+
+	if (fits_short_name(node->name, short_name))
+		return 0;
+	return (strlen(node->name) + LFN_CHARS - 1) / LFN_CHARS;
+}
+
+static void assign_short_names(struct node *dir)
+{
+	for (struct node *node = dir->child; node != NULL; node = node->next) {
+		char *upper = strdup(node->name);
+		char short_name[11];
+
+		/* Names that only differ in case keep the upper case name as
+		 * the alias, like efi and EFI. */
+		for (size_t i = 0; upper != NULL && upper[i] != '\0'; ++i)
+			upper[i] = upcase(upper[i]);
+
+		if (upper != NULL && fits_short_name(upper, short_name)
+				&& !short_name_taken(dir, short_name))
+			memcpy(node->short_name, short_name, 11);
+		else
+			make_alias(dir, node->name, node->short_name);
+		free(upper);
+
+		if (node->dir)
+			assign_short_names(node);
+	}
+}
+
+static uint32_t allocate_clusters(struct image *image, uint64_t size)
+{
+	const uint64_t cluster_size = image->cluster_size;
+	const uint32_t clusters =
+		(uint32_t)((size + cluster_size - 1) / cluster_size);
+	const uint32_t first = image->next_cluster;
+
+	for (uint32_t i = 0; i < clusters; ++i) {
+		image->fat[first + i] =
+			i + 1 < clusters ? first + i + 1 : END_OF_CHAIN;
+	}
+	image->next_cluster += clusters;
+	return clusters != 0 ? first : 0;
+}
+
+/* Directories go first, one contiguous run each, so that the files after
+ * them form one run in the load order. */
+static void layout_dirs(struct image *image, struct node *dir)
+{
+	size_t entries = dir == &image->root ? 0 : 2;
+
+	for (struct node *node = dir->child; node != NULL; node = node->next)
+		entries += 1 + long_entries(node);
+
+	/* An empty directory still has one cluster. */
+	if (entries == 0)
+		entries = 1;
+
+	dir->clusters = (uint32_t)
+		((entries * DIR_ENTRY_SIZE + image->cluster_size - 1)
+			/ image->cluster_size);
+	dir->cluster = allocate_clusters(
+		image, (uint64_t)dir->clusters * image->cluster_size);
+
+	for (struct node *node = dir->child; node != NULL; node = node->next) {
+		if (node->dir)
+			layout_dirs(image, node);
+	}
+}
+
+static int setup_geometry(struct image *image, uint64_t size)
+{
+	image->sectors = size / SECTOR_SIZE;
+	if (image->sectors > UINT32_MAX) {
+		fprintf(stderr, "image is too large\n");
+		return -1;
+	}
+
+	for (uint32_t spc = MAX_CLUSTER_SECTORS; spc > 0; spc /= 2) {
+		const uint64_t data = image->sectors - RESERVED_SECTORS;
+		const uint64_t fat_sectors =
+			((data / spc + 2) * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+		uint64_t clusters;
+
+		if (data <= FATS * fat_sectors)
+			continue;
+		clusters = (data - FATS * fat_sectors) / spc;
+		if (clusters < MIN_CLUSTERS || clusters >= END_OF_CHAIN - 16)
+			continue;
+
+		image->cluster_sectors = spc;
+		image->cluster_size = spc * SECTOR_SIZE;
+		image->fat_sectors = (uint32_t)fat_sectors;
+		image->clusters = (uint32_t)clusters;
+		image->fat = calloc(clusters + 2, sizeof(*image->fat));
+		if (image->fat == NULL)
+			return -1;
+		image->fat[0] = 0x0ffffff8;
+		image->fat[1] = END_OF_CHAIN;
+		image->next_cluster = ROOT_CLUSTER;
+		return 0;
+	}
+
+	fprintf(stderr, "image is too small for FAT32\n");
+	return -1;
+}
+
+static uint64_t cluster_offset(const struct image *image, uint32_t cluster)
+{
+	return ((uint64_t)RESERVED_SECTORS
+		+ (uint64_t)FATS * image->fat_sectors
+		+ (uint64_t)(cluster - ROOT_CLUSTER) * image->cluster_sectors)
+		* SECTOR_SIZE;
+}
+
+static int write_at(
+	FILE *out, uint64_t offset, const void *data, size_t size)
+{
+	if (fseek(out, (long)offset, SEEK_SET) != 0
+			|| fwrite(data, 1, size, out) != size)
+		return -1;
+	return 0;
+}
+
+static void fat_time(time_t mtime, uint16_t *date, uint16_t *time)
+{
+	struct tm *tm = gmtime(&mtime);
+
+	if (tm == NULL || tm->tm_year < 80) {
+		*date = (1 << 5) | 1;
+		*time = 0;
+		return;
+	}
+	*date = (uint16_t)(((tm->tm_year - 80) << 9)
+		| ((tm->tm_mon + 1) << 5) | tm->tm_mday);
+	*time = (uint16_t)((tm->tm_hour << 11)
+		| (tm->tm_min << 5) | (tm->tm_sec / 2));
+}
+
+static uint8_t checksum(const char short_name[11])
+{
+	uint8_t sum = 0;
+
+	for (size_t i = 0; i < 11; ++i)
+		sum = ((sum & 1) << 7) + (sum >> 1) + (uint8_t)short_name[i];
+	return sum;
+}
+
+static void put_entry(
+	uint8_t *entry,
+	const char name[11],
+	uint8_t attr,
+	uint32_t cluster,
+	uint32_t size,
+	time_t mtime)
+{
+	uint16_t date, time;
+
+	fat_time(mtime, &date, &time);
+	memcpy(entry, name, 11);
+	entry[11] = attr;
+	put16(&entry[14], time);
+	put16(&entry[16], date);
+	put16(&entry[18], date);
+	put16(&entry[20], cluster >> 16);
+	put16(&entry[22], time);
+	put16(&entry[24], date);
+	put16(&entry[26], cluster & 0xffff);
+	put32(&entry[28], size);
+}
+
+/* Long name entries go before the short entry, the last part of the name
+ * first. */
+static uint8_t *put_long_name(uint8_t *entry, const struct node *node)
+{
+	static const size_t offsets[] =
+		{ 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+	const size_t entries = long_entries(node);
+	const size_t len = strlen(node->name);
+	const uint8_t sum = checksum(node->short_name);
+
+	for (size_t e = entries; e > 0; --e) {
+		const size_t first = (e - 1) * LFN_CHARS;
+
+		entry[0] = (uint8_t)e | (e == entries ? 0x40 : 0);
+		entry[11] = ATTR_LONG_NAME;
+		entry[13] = sum;
+		for (size_t i = 0; i < LFN_CHARS; ++i) {
+			uint16_t code = 0xffff;
+
+			if (first + i < len)
+				code = (uint8_t)node->name[first + i];
+			else if (first + i == len)
+				code = 0;
+			put16(&entry[offsets[i]], code);
+		}
+		entry += DIR_ENTRY_SIZE;
+	}
+	return entry;
+}
+
+static int write_dirs(
+	FILE *out, const struct image *image, const struct node *dir)
+{
+	const size_t size = (size_t)dir->clusters * image->cluster_size;
+	uint8_t *data = calloc(size, 1);
+	uint8_t *entry = data;
+	int ret;
+
+	if (data == NULL)
+		return -1;
+
+	if (dir != &image->root) {
+		const uint32_t parent = dir->parent == &image->root
+			? 0 : dir->parent->cluster;
+
+		put_entry(entry, ".          ", ATTR_DIRECTORY,
+			dir->cluster, 0, 0);
+		entry += DIR_ENTRY_SIZE;
+		put_entry(entry, "..         ", ATTR_DIRECTORY,
+			parent, 0, 0);
+		entry += DIR_ENTRY_SIZE;
+	}
+
+	for (const struct node *node = dir->child; node != NULL;
+			node = node->next) {
+		entry = put_long_name(entry, node);
+		put_entry(
+			entry,
+			node->short_name,
+			node->dir ? ATTR_DIRECTORY : ATTR_ARCHIVE,
+			node->cluster,
+			(uint32_t)node->size,
+			node->mtime);
+		entry += DIR_ENTRY_SIZE;
+	}
+
+	ret = write_at(out, cluster_offset(image, dir->cluster), data, size);
+	free(data);
+	if (ret != 0)
+		return ret;
+
+	for (const struct node *node = dir->child; node != NULL;
+			node = node->next) {
+		if (node->dir && write_dirs(out, image, node) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int copy_file(FILE *out, uint64_t offset, const char *path)
+{
+	FILE *in = fopen(path, "rb");
+	char buf[65536];
+	size_t size;
+
+	if (in == NULL || fseek(out, (long)offset, SEEK_SET) != 0) {
+		if (in != NULL)
+			fclose(in);
+		return -1;
+	}
+
+	while ((size = fread(buf, 1, sizeof(buf), in)) > 0) {
+		if (fwrite(buf, 1, size, out) != size) {
+			fclose(in);
+			return -1;
+		}
+	}
+
+	if (ferror(in)) {
+		fclose(in);
+		return -1;
+	}
+	fclose(in);
+	return 0;
+}
+
+static int write_boot_sectors(FILE *out, const struct image *image)
+{
+	uint8_t boot[512], info[512];
+	const uint32_t free_clusters =
+		image->clusters + ROOT_CLUSTER - image->next_cluster;
+
+	memset(boot, 0, sizeof(boot));
+	boot[0] = 0xeb;
+	boot[1] = 0x58;
+	boot[2] = 0x90;
+	memcpy(&boot[3], "MKESP   ", 8);
+	put16(&boot[11], SECTOR_SIZE);
+	boot[13] = (uint8_t)image->cluster_sectors;
+	put16(&boot[14], RESERVED_SECTORS);
+	boot[16] = FATS;
+	boot[21] = 0xf8;
+	put16(&boot[24], 32);
+	put16(&boot[26], 64);
+	put32(&boot[32], (uint32_t)image->sectors);
+	put32(&boot[36], image->fat_sectors);
+	put32(&boot[44], ROOT_CLUSTER);
+	put16(&boot[48], 1);
+	put16(&boot[50], 6);
+	boot[64] = 0x80;
+	boot[66] = 0x29;
+	put32(&boot[67], 0x45535021);
+	memcpy(&boot[71], "ESP        ", 11);
+	memcpy(&boot[82], "FAT32   ", 8);
+	boot[510] = 0x55;
+	boot[511] = 0xaa;
+
+	memset(info, 0, sizeof(info));
+	put32(&info[0], 0x41615252);
+	put32(&info[484], 0x61417272);
+	put32(&info[488], free_clusters);
+	put32(&info[492], image->next_cluster);
+	put32(&info[508], 0xaa550000);
+
+	/* The backup copies live at sector 6. */
+	for (uint32_t copy = 0; copy <= 6; copy += 6) {
+		const uint64_t offset = (uint64_t)copy * SECTOR_SIZE;
+
+		if (write_at(out, offset, boot, sizeof(boot)) != 0
+				|| write_at(out, offset + SECTOR_SIZE,
+					info, sizeof(info)) != 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int write_image(const char *path, const struct image *image)
+{
+	const size_t fat_size = (size_t)image->fat_sectors * SECTOR_SIZE;
+	uint8_t *fat = calloc(fat_size, 1);
+	const uint8_t zero = 0;
+	FILE *out;
+
+	if (fat == NULL)
+		return -1;
+	for (uint32_t i = 0; i < image->clusters + 2; ++i)
+		put32(&fat[4 * (size_t)i], image->fat[i]);
+
+	out = fopen(path, "wb");
+	if (out == NULL) {
+		free(fat);
+		return -1;
+	}
+
+	if (write_boot_sectors(out, image) != 0)
+		goto error;
+
+	for (uint32_t i = 0; i < FATS; ++i) {
+		const uint64_t offset = ((uint64_t)RESERVED_SECTORS
+			+ (uint64_t)i * image->fat_sectors) * SECTOR_SIZE;
+
+		if (write_at(out, offset, fat, fat_size) != 0)
+			goto error;
+	}
+
+	if (write_dirs(out, image, &image->root) != 0)
+		goto error;
+
+	for (size_t i = 0; i < image->files; ++i) {
+		const struct node *node = image->file[i];
+
+		if (node->cluster == 0)
+			continue;
+		if (copy_file(out, cluster_offset(image, node->cluster),
+				node->file) != 0) {
+			fprintf(stderr, "failed to copy %s\n", node->file);
+			goto error;
+		}
+	}
+
+	/* The rest of the image is left as a hole. */
+	if (write_at(out, image->sectors * SECTOR_SIZE - 1, &zero, 1) != 0)
+		goto error;
+
+	free(fat);
+	return fclose(out);
+
+error:
+	free(fat);
+	fclose(out);
+	return -1;
+}
+
+static char *to_path(const uint16_t *path)
+{
+	size_t len = 0;
+	char *str;
+
+	while (path[len] != 0)
+		++len;
+
+	str = malloc(len + 1);
+	if (str == NULL)
+		return NULL;
+	for (size_t i = 0; i <= len; ++i)
+		str[i] = (char)path[i];
+	return str;
+}
+
+/* Host file for the path in the image, given on the command line as
+ * <path>=<file>. */
+static const char *find_arg(char **arg, size_t args, const char *path)
+{
+	while (*path == '\\' || *path == '/')
+		++path;
+
+	for (size_t i = 0; i < args; ++i) {
+		const char *name = arg[i];
+		const char *eq = strchr(name, '=');
+		size_t j = 0;
+
+		if (eq == NULL)
+			continue;
+		while (*name == '\\' || *name == '/')
+			++name;
+
+		while (&name[j] < eq && path[j] != '\0') {
+			const char l = name[j] == '/' ? '\\' : upcase(name[j]);
+			const char r = path[j] == '/' ? '\\' : upcase(path[j]);
+
+			if (l != r)
+				break;
+			++j;
+		}
+		if (&name[j] == eq && path[j] == '\0')
+			return eq + 1;
+	}
+	return NULL;
+}
+
+static int add_module(
+	struct image *image,
+	const struct loader *loader,
+	size_t module,
+	char **arg,
+	size_t args)
+{
+	char *path = to_path(loader->module[module].path);
+	const char *file;
+	int ret;
+
+	if (path == NULL)
+		return -1;
+
+	file = find_arg(arg, args, path);
+	if (file == NULL) {
+		fprintf(stderr, "no file given for %s\n", path);
+		free(path);
+		return -1;
+	}
+
+	ret = add_file(image, path, file);
+	free(path);
+	return ret < 0 ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint64_t size = 1024;
+	struct image image;
+	struct loader loader;
+	struct stat st;
+	char **arg;
+	size_t args;
+	int first = 1;
+
+	if (argc > 2 && strcmp(argv[1], "-s") == 0) {
+		size = strtoull(argv[2], NULL, 0);
+		first = 3;
+	}
+
+	if (argc - first < 2 || size == 0) {
+		fprintf(stderr,
+			"usage: %s [-s <size in MiB>] <output> <config>"
+			" <path>=<file>...\n",
+			argv[0]);
+		return 1;
+	}
+	arg = &argv[first + 2];
+	args = (size_t)(argc - first - 2);
+
+	memset(&loader, 0, sizeof(loader));
+	loader.system = mock_efi_system();
+	setup_arena(&loader.arena, loader.system, EFI_LOADER_DATA);
+
+	if (stat(argv[first + 1], &st) != 0) {
+		fprintf(stderr, "failed to access %s\n", argv[first + 1]);
+		return 1;
+	}
+	loader.config_size = (uint64_t)st.st_size;
+	loader.config_data = calloc(loader.config_size + 1, 1);
+	if (loader.config_data == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	} else {
+		FILE *in = fopen(argv[first + 1], "rb");
+
+		if (in == NULL || fread(loader.config_data, 1,
+				loader.config_size, in) != loader.config_size) {
+			fprintf(stderr, "failed to read %s\n", argv[first + 1]);
+			return 1;
+		}
+		fclose(in);
+	}
+
+	if (parse_config(&loader) != EFI_SUCCESS) {
+		fprintf(stderr, "failed to parse %s\n", argv[first + 1]);
+		return 1;
+	}
+
+	memset(&image, 0, sizeof(image));
+	image.root.dir = true;
+	if (setup_geometry(&image, size * 1024 * 1024) != 0)
+		return 1;
+
+	/* Files the config doesn't refer to go first, then everything else in
+	 * the order the loader reads it. */
+	for (size_t i = 0; i < args; ++i) {
+		const char *eq = strchr(arg[i], '=');
+		char *path;
+		bool known = false;
+
+		if (eq == NULL) {
+			fprintf(stderr,
+				"expected <path>=<file> in %s\n", arg[i]);
+			return 1;
+		}
+
+		path = malloc((size_t)(eq - arg[i]) + 1);
+		if (path == NULL)
+			return 1;
+		memcpy(path, arg[i], (size_t)(eq - arg[i]));
+		path[eq - arg[i]] = '\0';
+
+		for (size_t j = 0; j < loader.modules && !known; ++j) {
+			char *module = to_path(loader.module[j].path);
+
+			known = module != NULL
+				&& find_arg(&arg[i], 1, module) != NULL;
+			free(module);
+		}
+		if (!known && add_file(&image, path, eq + 1) < 0)
+			return 1;
+		free(path);
+	}
+
+	if (add_file(&image, CONFIG_PATH, argv[first + 1]) < 0)
+		return 1;
+
+	if (loader.has_bundle
+			&& add_module(&image, &loader, loader.bundle_module,
+				arg, args) != 0)
+		return 1;
+
+	if (add_module(&image, &loader, loader.kernel, arg, args) != 0)
+		return 1;
+
+	for (size_t i = 0; i < loader.modules; ++i) {
+		if (i == loader.kernel
+				|| (loader.has_bundle
+					&& i == loader.bundle_module)
+				|| strcmp(loader.module[i].name, "heap") == 0)
+			continue;
+		if (add_module(&image, &loader, i, arg, args) != 0)
+			return 1;
+	}
+
+	assign_short_names(&image.root);
+	layout_dirs(&image, &image.root);
+	for (size_t i = 0; i < image.files; ++i) {
+		struct node *node = image.file[i];
+		const uint64_t clusters =
+			(node->size + image.cluster_size - 1)
+			/ image.cluster_size;
+		const uint64_t left =
+			image.clusters + ROOT_CLUSTER - image.next_cluster;
+
+		if (clusters > left || node->size > UINT32_MAX) {
+			fprintf(stderr, "%s doesn't fit in the image\n",
+				node->file);
+			return 1;
+		}
+		node->cluster = allocate_clusters(&image, node->size);
+	}
+
+	if (write_image(argv[first], &image) != 0) {
+		fprintf(stderr, "failed to write %s\n", argv[first]);
+		return 1;
+	}
+
+	printf("%s: %llu MiB, %u byte clusters, %zu files in clusters"
+		" %u-%u\n",
+		argv[first],
+		(unsigned long long)size,
+		image.cluster_size,
+		image.files,
+		image.files > 0 ? image.file[0]->cluster : 0,
+		image.next_cluster - 1);
+	return 0;
+}
@@ -0,0 +1,324 @@
+/* Host tool that converts an ELF kernel into a prelaid image (see
+ * prelaid.h).
+ *
+ * Usage: mkprelaid <kernel.elf> <output>
+ *
+ * The loadable segments are copied to their offsets from the lowest page
+ * aligned segment address, the same way the loader lays out the ELF image
+ * in memory. Relative relocations from the dynamic section are applied as
+ * if the image were loaded at its link address and recorded in the
+ * relocation table, so the loader only has to add the load bias. Any other
+ * relocation type is an error. */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elf.h"
+#include "prelaid.h"
+
+
+static const uint64_t PAGE_SIZE = 4096;
+
+static const int64_t DT_NULL = 0;
+static const int64_t DT_RELA = 7;
+static const int64_t DT_RELASZ = 8;
+static const int64_t DT_RELAENT = 9;
+static const int64_t DT_REL = 17;
+static const int64_t DT_RELR = 36;
+
+static const uint32_t R_X86_64_NONE = 0;
+static const uint32_t R_X86_64_RELATIVE = 8;
+static const uint32_t R_AARCH64_NONE = 0;
+static const uint32_t R_AARCH64_RELATIVE = 1027;
+
+struct elf64_dyn {
+	int64_t d_tag;
+	uint64_t d_val;
+};
+
+struct elf64_rela {
+	uint64_t r_offset;
+	uint64_t r_info;
+	int64_t r_addend;
+};
+
+static uint64_t align_up(uint64_t x, uint64_t align)
+{
+	return (x + align - 1) & ~(align - 1);
+}
+
+static char *read_file(const char *path, size_t *size)
+{
+	FILE *file = fopen(path, "rb");
+	char *data;
+	long end;
+
+	if (file == NULL)
+		return NULL;
+
+	if (fseek(file, 0, SEEK_END) != 0
+		|| (end = ftell(file)) < 0
+		|| fseek(file, 0, SEEK_SET) != 0) {
+		fclose(file);
+		return NULL;
+	}
+
+	data = calloc((size_t)end + 1, 1);
+	if (data == NULL || fread(data, 1, (size_t)end, file) != (size_t)end) {
+		free(data);
+		fclose(file);
+		return NULL;
+	}
+
+	fclose(file);
+	*size = (size_t)end;
+	return data;
+}
+
+static bool verify_elf(const char *elf, size_t size)
+{
+	struct elf64_ehdr hdr;
+
+	if (size < sizeof(hdr))
+		return false;
+	memcpy(&hdr, elf, sizeof(hdr));
+
+	return memcmp(hdr.e_ident, "\177ELF", 4) == 0
+		&& hdr.e_ident[EI_CLASS] == ELFCLASS64
+		&& hdr.e_ident[EI_DATA] == ELFDATA2LSB
+		&& (hdr.e_type == ET_EXEC || hdr.e_type == ET_DYN)
+		&& (hdr.e_machine == EM_X86_64 || hdr.e_machine == EM_AARCH64)
+		&& hdr.e_phentsize == sizeof(struct elf64_phdr)
+		&& hdr.e_phnum != 0
+		&& hdr.e_phoff <= size
+		&& (uint64_t)hdr.e_phnum * hdr.e_phentsize
+			<= size - hdr.e_phoff;
+}
+
+static bool relative_relocation(uint32_t machine, uint32_t type, bool *skip)
+{
+	*skip = false;
+	if (machine == EM_X86_64) {
+		*skip = type == R_X86_64_NONE;
+		return *skip || type == R_X86_64_RELATIVE;
+	}
+	*skip = type == R_AARCH64_NONE;
+	return *skip || type == R_AARCH64_RELATIVE;
+}
+
+/* Relocation offsets are collected into relocs, which has room for
+ * memsz / 8 entries, more than there can be distinct relocations. */
+static int apply_relocations(
+	char *image,
+	uint64_t memsz,
+	uint64_t base,
+	uint32_t machine,
+	const struct elf64_phdr *dynamic,
+	uint64_t *relocs,
+	uint64_t *count)
+{
+	uint64_t rela = 0, rela_size = 0, rela_ent = sizeof(struct elf64_rela);
+
+	uint64_t dyn_offset;
+
+	*count = 0;
+	if (dynamic == NULL)
+		return 0;
+
+	dyn_offset = dynamic->p_vaddr - base;
+	if (dynamic->p_vaddr < base
+			|| dyn_offset > memsz
+			|| dynamic->p_memsz > memsz - dyn_offset) {
+		fprintf(stderr, "dynamic section is outside of the image\n");
+		return -1;
+	}
+
+	for (uint64_t pos = 0;
+			pos + sizeof(struct elf64_dyn) <= dynamic->p_memsz;
+			pos += sizeof(struct elf64_dyn)) {
+		struct elf64_dyn dyn;
+
+		memcpy(&dyn, &image[dyn_offset + pos], sizeof(dyn));
+		if (dyn.d_tag == DT_NULL)
+			break;
+		if (dyn.d_tag == DT_RELA)
+			rela = dyn.d_val;
+		else if (dyn.d_tag == DT_RELASZ)
+			rela_size = dyn.d_val;
+		else if (dyn.d_tag == DT_RELAENT)
+			rela_ent = dyn.d_val;
+		else if (dyn.d_tag == DT_REL || dyn.d_tag == DT_RELR) {
+			fprintf(stderr,
+				"only RELA relocations are supported\n");
+			return -1;
+		}
+	}
+
+	if (rela_size == 0)
+		return 0;
+
+	if (rela_ent != sizeof(struct elf64_rela)
+			|| rela < base
+			|| rela - base > memsz
+			|| rela_size > memsz - (rela - base)) {
+		fprintf(stderr, "relocation table is outside of the image\n");
+		return -1;
+	}
+
+	for (uint64_t pos = 0; pos < rela_size; pos += rela_ent) {
+		struct elf64_rela r;
+		uint32_t type;
+		uint64_t value;
+		bool skip;
+
+		memcpy(&r, &image[rela - base + pos], sizeof(r));
+		type = (uint32_t)r.r_info;
+		if (!relative_relocation(machine, type, &skip)) {
+			fprintf(stderr, "unsupported relocation type %u\n",
+				(unsigned)type);
+			return -1;
+		}
+		if (skip)
+			continue;
+
+		if (r.r_offset < base
+				|| r.r_offset - base > memsz - sizeof(value)) {
+			fprintf(stderr, "relocation is outside of the image\n");
+			return -1;
+		}
+
+		/* Loaded at the link address the bias is zero, so the word
+		 * is just the addend. */
+		value = (uint64_t)r.r_addend;
+		memcpy(&image[r.r_offset - base], &value, sizeof(value));
+		relocs[(*count)++] = r.r_offset - base;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	const struct elf64_phdr *dynamic = NULL;
+	struct prelaid_header header;
+	struct elf64_ehdr ehdr;
+	struct elf64_phdr *phdr;
+	uint64_t begin = UINT64_MAX, end = 0, align = PAGE_SIZE;
+	uint64_t filesz = 0, relocs_count;
+	uint64_t *relocs;
+	char *elf, *image;
+	size_t size;
+	FILE *file;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <kernel.elf> <output>\n", argv[0]);
+		return 1;
+	}
+
+	elf = read_file(argv[1], &size);
+	if (elf == NULL) {
+		fprintf(stderr, "failed to read %s\n", argv[1]);
+		return 1;
+	}
+
+	if (!verify_elf(elf, size)) {
+		fprintf(stderr, "%s is not a supported ELF file\n", argv[1]);
+		return 1;
+	}
+	memcpy(&ehdr, elf, sizeof(ehdr));
+	phdr = (struct elf64_phdr *)&elf[ehdr.e_phoff];
+
+	/* Same bounds as elf64_image_size in the loader computes. */
+	for (size_t i = 0; i < ehdr.e_phnum; ++i) {
+		uint64_t seg_align = PAGE_SIZE, seg_begin, seg_end;
+
+		if (phdr[i].p_type == PT_DYNAMIC)
+			dynamic = &phdr[i];
+		if (phdr[i].p_type != PT_LOAD)
+			continue;
+
+		if (phdr[i].p_filesz > phdr[i].p_memsz
+				|| phdr[i].p_offset > size
+				|| phdr[i].p_filesz > size - phdr[i].p_offset) {
+			fprintf(stderr, "segment %zu is truncated\n", i);
+			return 1;
+		}
+
+		if (phdr[i].p_align > seg_align)
+			seg_align = phdr[i].p_align;
+		if (seg_align > align)
+			align = seg_align;
+
+		seg_begin = phdr[i].p_vaddr & ~(seg_align - 1);
+		seg_end = align_up(
+			phdr[i].p_vaddr + phdr[i].p_memsz, seg_align);
+		if (begin > seg_begin)
+			begin = seg_begin;
+		if (end < seg_end)
+			end = seg_end;
+	}
+
+	if (begin >= end || ehdr.e_entry < begin || ehdr.e_entry >= end) {
+		fprintf(stderr, "%s has no loadable image\n", argv[1]);
+		return 1;
+	}
+
+	image = calloc(end - begin, 1);
+	relocs = calloc((end - begin) / sizeof(*relocs) + 1, sizeof(*relocs));
+	if (image == NULL || relocs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < ehdr.e_phnum; ++i) {
+		const uint64_t offset = phdr[i].p_vaddr - begin;
+
+		if (phdr[i].p_type != PT_LOAD)
+			continue;
+
+		memcpy(&image[offset],
+			&elf[phdr[i].p_offset],
+			phdr[i].p_filesz);
+		if (phdr[i].p_filesz != 0 && filesz < offset + phdr[i].p_filesz)
+			filesz = offset + phdr[i].p_filesz;
+	}
+
+	if (apply_relocations(
+			image, end - begin, begin, ehdr.e_machine,
+			dynamic, relocs, &relocs_count) != 0)
+		return 1;
+
+	/* Relocations might land in the BSS part of a segment, then that
+	 * part has to be stored too. */
+	for (uint64_t i = 0; i < relocs_count; ++i) {
+		if (filesz < relocs[i] + sizeof(uint64_t))
+			filesz = relocs[i] + sizeof(uint64_t);
+	}
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PRELAID_MAGIC, sizeof(header.magic));
+	header.version = PRELAID_VERSION;
+	header.machine = ehdr.e_machine;
+	header.base = begin;
+	header.entry = ehdr.e_entry - begin;
+	header.filesz = filesz;
+	header.memsz = end - begin;
+	header.align = align;
+	header.relocs_offset = align_up(PRELAID_ALIGN + filesz, 8);
+	header.relocs = relocs_count;
+
+	file = fopen(argv[2], "wb");
+	if (file == NULL
+		|| fwrite(&header, sizeof(header), 1, file) != 1
+		|| fseek(file, (long)PRELAID_ALIGN, SEEK_SET) != 0
+		|| fwrite(image, 1, filesz, file) != filesz
+		|| fseek(file, (long)header.relocs_offset, SEEK_SET) != 0
+		|| fwrite(relocs, sizeof(*relocs), relocs_count, file)
+			!= relocs_count
+		|| fclose(file) != 0) {
+		fprintf(stderr, "failed to write %s\n", argv[2]);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,92 @@
+#include "mock_efi.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "efi/efi.h"
+
+
+static struct mock_efi_stats stats;
+static struct efi_simple_text_output_protocol console;
+static struct efi_boot_table boot;
+static struct efi_system_table table;
+
+static efi_status_t mock_output_string(
+	struct efi_simple_text_output_protocol *out, uint16_t *str)
+{
+	(void)out;
+	while (*str) {
+		if (*str != '\r')
+			putchar(*str < 0x80 ? *str : '?');
+		++str;
+	}
+	return EFI_SUCCESS;
+}
+
+static efi_status_t mock_allocate_pool(
+	enum efi_memory_type type, efi_uint_t size, void **ptr)
+{
+	(void)type;
+	++stats.allocate_pool;
+	*ptr = malloc(size != 0 ? size : 1);
+	return *ptr != NULL ? EFI_SUCCESS : EFI_LOAD_ERROR;
+}
+
+static efi_status_t mock_free_pool(void *ptr)
+{
+	++stats.free_pool;
+	free(ptr);
+	return EFI_SUCCESS;
+}
+
+static efi_status_t mock_allocate_pages(
+	enum efi_allocate_type type,
+	enum efi_memory_type memory_type,
+	efi_uint_t pages,
+	uint64_t *addr)
+{
+	void *ptr;
+
+	(void)memory_type;
+	++stats.allocate_pages;
+	if (type != EFI_ALLOCATE_ANY_PAGES)
+		return EFI_UNSUPPORTED;
+
+	ptr = aligned_alloc(4096, pages != 0 ? pages * 4096 : 4096);
+	if (ptr == NULL)
+		return EFI_LOAD_ERROR;
+	*addr = (uint64_t)(uintptr_t)ptr;
+	return EFI_SUCCESS;
+}
+
+static efi_status_t mock_free_pages(uint64_t addr, efi_uint_t pages)
+{
+	(void)pages;
+	++stats.free_pages;
+	free((void *)(uintptr_t)addr);
+	return EFI_SUCCESS;
+}
+
+struct efi_system_table *mock_efi_system(void)
+{
+	memset(&console, 0, sizeof(console));
+	console.output_string = mock_output_string;
+
+	memset(&boot, 0, sizeof(boot));
+	boot.allocate_pool = mock_allocate_pool;
+	boot.free_pool = mock_free_pool;
+	boot.allocate_pages = mock_allocate_pages;
+	boot.free_pages = mock_free_pages;
+
+	memset(&table, 0, sizeof(table));
+	table.out = &console;
+	table.err = &console;
+	table.boot = &boot;
+	return &table;
+}
+
+struct mock_efi_stats *mock_efi_stats(void)
+{
+	return &stats;
+}
@@ -0,0 +1,23 @@
+#ifndef __MOCK_EFI_H__
+#define __MOCK_EFI_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct efi_system_table;
+
+/* Counters of the firmware calls made through the mock system table. */
+struct mock_efi_stats {
+	size_t allocate_pool;
+	size_t free_pool;
+	size_t allocate_pages;
+	size_t free_pages;
+};
+
+/* Minimal host-side stand-in for the firmware: console output goes to
+ * stdout and memory services are backed by malloc. It only covers what
+ * the loader needs to run the config parser and the like on the host. */
+struct efi_system_table *mock_efi_system(void);
+struct mock_efi_stats *mock_efi_stats(void);
+
+#endif  // __MOCK_EFI_H__